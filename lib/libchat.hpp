@@ -3,6 +3,7 @@
 
 #pragma once
 #include "netty/netty.hpp"
+#include "polly/log.hpp"
 #include "surreal/surreal.hpp"
 #include <cstddef>
 #include <iomanip>
@@ -11,9 +12,7 @@
 #include <stdint.h>
 #include <variant>
 #include <vector>
-#include <atomic>
 #include <unistd.h>
-#include <signal.h>
 #define FILE_BLOCKSIZE 2048
 
 // we use this to check at runtime if the message we recieved has
@@ -29,6 +28,10 @@ enum class message_t {
     MSG_XFER,
     MSG_GETLIST,
     MSG_LIST, // actually recv the list
+    MSG_STREAM, // file header, followed by the raw file (see StreamPacket)
+    MSG_JOIN,   // join a room (see RoomPacket)
+    MSG_PART,   // leave one
+    MSG_ROOM,   // a message to everyone in a room
 
     // ERROR messages. empty data payload.
     ERR_NOLOGIN = 400, // when a client isn't logged in
@@ -38,6 +41,8 @@ enum class message_t {
     ERR_NOSUCHUSER, // can't message user since they don't exist.
     ERR_PASSWRONG,  // wrong password
     ERR_NOPERMS,    // tried to send message as a different user.
+    ERR_NOTMEMBER,  // sent to (or left) a room we're not in.
+    ERR_BADNAME,    // room name isn't 4-8 letters or numbers.
 };
 const std::map<message_t, std::string> message_names{
     {message_t::MSG_OK, "OK"},
@@ -47,6 +52,10 @@ const std::map<message_t, std::string> message_names{
     {message_t::MSG_SEND, "SEND"},
     {message_t::MSG_XFER, "XFER"},
     {message_t::MSG_GETLIST, "LIST"},
+    {message_t::MSG_STREAM, "STREAM"},
+    {message_t::MSG_JOIN, "JOIN"},
+    {message_t::MSG_PART, "PART"},
+    {message_t::MSG_ROOM, "SENDR"},
     {message_t::ERR_NOLOGIN, "NOLOGIN"},
     {message_t::ERR_NOTREGISTERED, "NOTREGISTERED"},
 };
@@ -59,6 +68,8 @@ const std::map<message_t, std::string> error_meanings{
     {message_t::ERR_NOSUCHUSER, "user does not exist"},
     {message_t::ERR_PASSWRONG, "incorrect password"},
     {message_t::ERR_NOPERMS, "tried to send message as a different user"},
+    {message_t::ERR_NOTMEMBER, "not in that room"},
+    {message_t::ERR_BADNAME, "room names are 4-8 letters or numbers"},
 };
 // we could later just make this a std::string if we want (would have to add
 // serialization stuff)
@@ -111,6 +122,38 @@ struct FilePacket {
     MAKE_SERIAL(eof, username, filename, data, destination)
 };
 
+// The header for streaming a file. Instead of cutting the file up into
+// FilePackets, the sender sends this and then the whole file straight after it,
+// size bytes of it with no framing at all. That way the client can sendfile()
+// it and the server can splice() it through to the recipient, and the file
+// never gets copied into user space. The server forwards the header to the
+// recipient, and then the body.
+//
+// If the sender goes away halfway through, the recipient still gets size
+// bytes (padded with zeros) and then another header with aborted set, so it
+// knows to throw the file out.
+struct StreamPacket {
+    std::string username;
+    shortstring destination;
+    std::string filename;
+    std::uint64_t size = 0;
+    bool aborted = false;
+
+    MAKE_SERIAL(username, destination, filename, size, aborted)
+};
+
+// Joining or leaving a room, or a message to one. Rooms are made by the first
+// person to join them. Membership sticks across logins (and server restarts)
+// until you leave, but only whoever's online when a message is sent gets it.
+// For JOIN/PART only room is used.
+struct RoomPacket {
+    shortstring room;
+    shortstring username; // filled in by the server.
+    std::string message;
+
+    MAKE_SERIAL(room, username, message)
+};
+
 // contains a list of users currently logged on.
 struct ListPacket {
     std::vector<shortstring> users;
@@ -121,11 +164,12 @@ struct ListPacket {
 
 // all possible packets. Monostate is so that it can be "empty".
 using Packet_t = std::variant<std::monostate, MessagePacket, LoginPacket,
-                              FilePacket, ListPacket>;
+                              FilePacket, ListPacket, StreamPacket,
+                              RoomPacket>;
 
 
 // return the message type of the frame. Useful for server responses.
-message_t get_message(const std::vector<std::uint8_t> &data) {
+inline message_t get_message(const std::vector<std::uint8_t> &data) {
     Frame frame;
     auto buf = surreal::DataBuf(data.begin(), data.end());
     buf.deserialize(frame);
@@ -139,7 +183,7 @@ message_t get_message(const std::vector<std::uint8_t> &data) {
 /**
  * Unpack a frame from a TCP data stream.
  */
-std::pair<message_t, Packet_t> get_frame(std::vector<std::uint8_t> data) {
+inline std::pair<message_t, Packet_t> get_frame(std::vector<std::uint8_t> data) {
     Frame frame = {};
     // take data, deserialize it into frame.
     auto buf = surreal::DataBuf(data.begin(), data.end());
@@ -170,6 +214,18 @@ std::pair<message_t, Packet_t> get_frame(std::vector<std::uint8_t> data) {
         auto obj = surreal::DataBuf(frame.data.begin(), frame.data.end());
         obj.deserialize(res);
         return std::pair(frame.type, res);
+    } else if (frame.type == message_t::MSG_STREAM) {
+        StreamPacket res;
+        auto obj = surreal::DataBuf(frame.data.begin(), frame.data.end());
+        obj.deserialize(res);
+        return std::pair(frame.type, res);
+    } else if ((frame.type == message_t::MSG_JOIN) ||
+               (frame.type == message_t::MSG_PART) ||
+               (frame.type == message_t::MSG_ROOM)) {
+        RoomPacket res;
+        auto obj = surreal::DataBuf(frame.data.begin(), frame.data.end());
+        obj.deserialize(res);
+        return std::pair(frame.type, res);
     }
 
     // no data, so we just return the message type.
@@ -188,7 +244,7 @@ template <surreal::has_members T> Frame make_frame(message_t msg, T &object) {
 }
 
 // shorthand for sending error messages.
-Frame make_frame(message_t msg) {
+inline Frame make_frame(message_t msg) {
     Frame result = {};
     result.type = msg;
     return result;
@@ -196,7 +252,7 @@ Frame make_frame(message_t msg) {
 
 // returns true if the string is within spec.
 // we could turn this off and we would be able to use long usernames/passwords.
-bool string_okay(std::string str) {
+inline bool string_okay(std::string str) {
     if ((str.length() > 8) || (str.length() < 4)) {
         return false;
     }
@@ -207,27 +263,17 @@ bool string_okay(std::string str) {
     return true;
 }
 
-constexpr auto header_size = sizeof(char) + sizeof(std::size_t);
-struct recv_state {
-    std::vector<std::uint8_t> data;
-    std::size_t desired_bytes = header_size;
-    bool await_header = true;
-};
-
-// print helper. prints timestamp plus message.
-void print(std::string msg) {
-    std::time_t time = std::time(nullptr);
-
-    std::cout << std::put_time(std::localtime(&time), "%F %T") << ":" + msg
-              << std::endl;
+// print helper. prints timestamp plus message. It's queued and written out by
+// another thread (see polly/log.hpp), so it doesn't wait on stdout.
+inline void print(polly::level lvl, std::string msg) {
+    polly::Logger::get().write(lvl, std::move(msg));
+}
+inline void print(std::string msg) {
+    // errors are always marked like this, so they still show up with the
+    // level turned up.
+    auto lvl = msg.starts_with("ERROR") ? polly::level::error
+                                        : polly::level::info;
+    print(lvl, std::move(msg));
 }
 
 
-// helpers for intercepting sigint (allow for proper destructor calling).
-
-// instead of volatile, use atomic.
-std::atomic<bool> quit(false);
-auto sighandler = [](int m) {
-	quit.store(true);
-};
-
@@ -0,0 +1,138 @@
+#include "async.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <system_error>
+
+namespace Netty {
+
+AsyncSocket::AsyncSocket(polly::EventLoop &loop, std::shared_ptr<Socket> sock)
+    : loop(loop), sock(sock), waiter(loop, *sock) {
+    sock->set_handler(
+        [this](Socket &s, int events) { waiter.handle(events); });
+    loop.add_item(sock, 0);
+}
+
+AsyncSocket::~AsyncSocket() { loop.delete_item(*sock); }
+
+bool AsyncSocket::ReadOp::step() {
+    result = ::recv(conn.sock->get_fd(), buf.data(), buf.size(), 0);
+    if (result == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        }
+        error = errno;
+    }
+    return true;
+}
+
+std::size_t AsyncSocket::ReadOp::await_resume() {
+    if (error != 0) {
+        throw std::system_error(error, std::generic_category(),
+                                "recv() failed");
+    }
+    return result;
+}
+
+bool AsyncSocket::ReceiveOp::step() {
+    try {
+        result = conn.sock->recv_into(reader);
+    } catch (...) {
+        error = std::current_exception();
+        return true;
+    }
+    return result.bytes > 0 || result.status != recv_status::again;
+}
+
+RecvResult AsyncSocket::ReceiveOp::await_resume() {
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return result;
+}
+
+bool AsyncSocket::WriteOp::step() {
+    while (sent < buf.size()) {
+        ssize_t n = ::send(conn.sock->get_fd(), buf.data() + sent,
+                           buf.size() - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            error = errno;
+            return true;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+void AsyncSocket::WriteOp::await_resume() {
+    if (error != 0) {
+        throw std::system_error(error, std::generic_category(),
+                                "send() failed");
+    }
+}
+
+bool AsyncSocket::SendFileOp::step() {
+    try {
+        while (left > 0) {
+            ssize_t n = Netty::sendfile(conn.sock->get_fd(), file, offset, left);
+            if (n == -1) {
+                return false;
+            }
+            if (n == 0) {
+                throw std::runtime_error("file ended early");
+            }
+            left -= n;
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    return true;
+}
+
+void AsyncSocket::SendFileOp::await_resume() {
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+bool AsyncSocket::ReceiveFileOp::step() {
+    try {
+        while (left > 0 || in_pipe > 0) {
+            if (in_pipe > 0) {
+                // the pipe has data in it and the file is a file, so this
+                // can't block.
+                ssize_t n = Netty::splice(pipe.read_fd(), file, in_pipe);
+                if (n <= 0) {
+                    throw std::runtime_error("couldn't write to the file");
+                }
+                in_pipe -= n;
+                continue;
+            }
+            ssize_t n = Netty::splice(conn.sock->get_fd(), pipe.write_fd(),
+                                      std::min<std::uint64_t>(left,
+                                                              pipe.capacity()));
+            if (n == -1) {
+                return false; // the socket's empty.
+            }
+            if (n == 0) {
+                throw std::runtime_error("connection closed mid-file");
+            }
+            left -= n;
+            in_pipe = n;
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    return true;
+}
+
+void AsyncSocket::ReceiveFileOp::await_resume() {
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+} // namespace Netty
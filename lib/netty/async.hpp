@@ -0,0 +1,156 @@
+// async.hpp - coroutine interface for netty sockets
+// (c) Saji Champlin 2022
+#pragma once
+#include "netty.hpp"
+#include "polly/coro.hpp"
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <span>
+namespace Netty {
+
+// AsyncSocket lets coroutines use a (non-blocking) Socket with co_await
+// instead of a handler. It registers the socket with the event loop, and
+// takes over its handler.
+//
+//     auto n = co_await conn.read_some(buf); // 0 means the peer hung up
+//     co_await conn.write_all(bytes);        // waits out a full send buffer
+//
+// Reads and writes are tried straight away, and only suspend when the socket
+// would block. Errors are thrown as std::system_error from the co_await.
+class AsyncSocket {
+    polly::EventLoop &loop;
+    std::shared_ptr<Socket> sock;
+    polly::Waiter waiter;
+
+  public:
+    // awaitable returned by read_some().
+    struct ReadOp : polly::Op {
+        AsyncSocket &conn;
+        std::span<std::uint8_t> buf;
+        ssize_t result = 0;
+        int error = 0;
+        ReadOp(AsyncSocket &conn, std::span<std::uint8_t> buf)
+            : conn(conn), buf(buf) {}
+        bool step() override;
+        bool await_ready() { return step(); }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            conn.waiter.suspend_read(this);
+        }
+        std::size_t await_resume();
+    };
+
+    // awaitable returned by receive().
+    struct ReceiveOp : polly::Op {
+        AsyncSocket &conn;
+        FrameReader &reader;
+        RecvResult result;
+        std::exception_ptr error;
+        ReceiveOp(AsyncSocket &conn, FrameReader &reader)
+            : conn(conn), reader(reader) {}
+        bool step() override;
+        bool await_ready() { return step(); }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            conn.waiter.suspend_read(this);
+        }
+        RecvResult await_resume();
+    };
+
+    // awaitable returned by write_all().
+    struct WriteOp : polly::Op {
+        AsyncSocket &conn;
+        std::span<const std::uint8_t> buf;
+        std::size_t sent = 0;
+        int error = 0;
+        WriteOp(AsyncSocket &conn, std::span<const std::uint8_t> buf)
+            : conn(conn), buf(buf) {}
+        bool step() override;
+        bool await_ready() { return step(); }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            conn.waiter.suspend_write(this);
+        }
+        void await_resume();
+    };
+
+    // awaitable returned by send_file().
+    struct SendFileOp : polly::Op {
+        AsyncSocket &conn;
+        int file;
+        off_t offset;
+        std::size_t left;
+        std::exception_ptr error;
+        SendFileOp(AsyncSocket &conn, int file, off_t offset, std::size_t len)
+            : conn(conn), file(file), offset(offset), left(len) {}
+        bool step() override;
+        bool await_ready() { return step(); }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            conn.waiter.suspend_write(this);
+        }
+        void await_resume();
+    };
+
+    // awaitable returned by receive_file().
+    struct ReceiveFileOp : polly::Op {
+        AsyncSocket &conn;
+        int file;
+        Pipe &pipe;
+        std::uint64_t left;
+        std::size_t in_pipe = 0;
+        std::exception_ptr error;
+        ReceiveFileOp(AsyncSocket &conn, int file, std::uint64_t len,
+                      Pipe &pipe)
+            : conn(conn), file(file), pipe(pipe), left(len) {}
+        bool step() override;
+        bool await_ready() { return step(); }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            conn.waiter.suspend_read(this);
+        }
+        void await_resume();
+    };
+
+    AsyncSocket(polly::EventLoop &loop, std::shared_ptr<Socket> sock);
+    AsyncSocket(const AsyncSocket &other) = delete;
+    ~AsyncSocket();
+
+    Socket &socket() { return *sock; }
+
+    // suspend until the socket is readable/writable.
+    auto readable() { return waiter.readable(); }
+    auto writable() { return waiter.writable(); }
+
+    // receive whatever is available (up to buf.size() bytes), waiting for
+    // data if there isn't any. Returns the number of bytes, or 0 on EOF.
+    ReadOp read_some(std::span<std::uint8_t> buf) { return ReadOp(*this, buf); }
+
+    // receive into a FrameReader, see Socket::recv_into(). Only waits if
+    // there was nothing at all to read.
+    ReceiveOp receive(FrameReader &reader) { return ReceiveOp(*this, reader); }
+
+    // send all of buf, waiting for room in the send buffer as needed. buf has
+    // to stay alive until the co_await finishes.
+    WriteOp write_all(std::span<const std::uint8_t> buf) {
+        return WriteOp(*this, buf);
+    }
+
+    // send len bytes of a file, starting at offset, with sendfile(). They go
+    // straight from the page cache to the socket without being copied
+    // through here. Throws std::runtime_error if the file is shorter than
+    // that.
+    SendFileOp send_file(int file, off_t offset, std::size_t len) {
+        return SendFileOp(*this, file, offset, len);
+    }
+
+    // The other way around: move the next len bytes from the socket into a
+    // file, using splice() through pipe (which should start out empty).
+    // Throws std::runtime_error if the peer hangs up first.
+    ReceiveFileOp receive_file(int file, std::uint64_t len, Pipe &pipe) {
+        return ReceiveFileOp(*this, file, len, pipe);
+    }
+};
+
+} // namespace Netty
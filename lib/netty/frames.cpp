@@ -0,0 +1,283 @@
+#include "frames.hpp"
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <system_error>
+namespace Netty {
+
+FrameHeader frame_header(std::uint64_t size) {
+    FrameHeader header;
+    header[0] = frame_magic;
+    size = htobe64(size);
+    std::memcpy(header.data() + 1, &size, sizeof(size));
+    return header;
+}
+
+FrameReader::FrameReader(std::size_t capacity, std::size_t max_frame)
+    : buf(capacity), min_room(capacity / 4), max_frame(max_frame) {}
+
+// reads the header at start. Only call if there are enough bytes.
+static std::uint64_t payload_size(const std::uint8_t *header) {
+    if (header[0] != frame_magic) {
+        throw std::runtime_error("header didn't match, frame misalignment.");
+    }
+    std::uint64_t size;
+    std::memcpy(&size, header + 1, sizeof(size));
+    return be64toh(size);
+}
+
+std::size_t FrameReader::wanted() const {
+    if (raw > 0) {
+        return 0; // any amount of room will do.
+    }
+    std::size_t have = end - start;
+    if (have < frame_header_size) {
+        return frame_header_size - have;
+    }
+    std::uint64_t size = payload_size(buf.data() + start);
+    if (size > max_frame) {
+        throw std::runtime_error("frame too big");
+    }
+    std::size_t total = frame_header_size + size;
+    return total > have ? total - have : 0;
+}
+
+std::span<std::uint8_t> FrameReader::space() {
+    if (start == end) {
+        // everything's been handed out, so start over from the front.
+        start = end = 0;
+    }
+    std::size_t need = wanted();
+    // shift the leftovers back to the front once we're running low on room.
+    // Not every time, since it's a copy.
+    if (start > 0 && buf.size() - end < std::max(need, min_room)) {
+        std::memmove(buf.data(), buf.data() + start, end - start);
+        end -= start;
+        start = 0;
+    }
+    // only grow if the frame we're in the middle of doesn't fit (or there's
+    // no room at all), so the buffer stays as small as the biggest frame.
+    if (buf.size() - end < std::max<std::size_t>(need, 1)) {
+        buf.resize(std::max(buf.size() * 2, end + need));
+    }
+    return std::span<std::uint8_t>(buf.data() + end, buf.size() - end);
+}
+
+void FrameReader::commit(std::size_t n) { end += n; }
+
+void FrameReader::append(std::span<const std::uint8_t> bytes) {
+    while (!bytes.empty()) {
+        auto room = space();
+        std::size_t n = std::min(room.size(), bytes.size());
+        std::memcpy(room.data(), bytes.data(), n);
+        commit(n);
+        bytes = bytes.subspan(n);
+    }
+}
+
+std::optional<std::span<const std::uint8_t>> FrameReader::next() {
+    auto payload = peek();
+    if (payload) {
+        start += frame_header_size + payload->size();
+    }
+    return payload;
+}
+
+std::optional<std::span<const std::uint8_t>> FrameReader::peek() {
+    if (raw > 0) {
+        return std::nullopt;
+    }
+    std::size_t have = end - start;
+    if (have < frame_header_size) {
+        return std::nullopt;
+    }
+    std::uint64_t size = payload_size(buf.data() + start);
+    if (size > max_frame) {
+        throw std::runtime_error("frame too big");
+    }
+    if (have - frame_header_size < size) {
+        return std::nullopt;
+    }
+    return std::span<const std::uint8_t>(
+        buf.data() + start + frame_header_size, size);
+}
+
+std::span<const std::uint8_t> FrameReader::take(std::size_t max) {
+    std::size_t n = std::min<std::uint64_t>({max, raw, end - start});
+    auto bytes = std::span<const std::uint8_t>(buf.data() + start, n);
+    start += n;
+    raw -= n;
+    return bytes;
+}
+
+void FrameWriter::push(Payload payload) {
+    Segment seg;
+    seg.header_size = frame_header_size;
+    seg.header = frame_header(payload->size());
+    pending += frame_header_size + payload->size();
+    seg.payload = std::move(payload);
+    segments.push_back(std::move(seg));
+}
+
+void FrameWriter::push_raw(Payload bytes) {
+    Segment seg;
+    seg.header_size = 0;
+    pending += bytes->size();
+    seg.payload = std::move(bytes);
+    segments.push_back(std::move(seg));
+}
+
+send_status FrameWriter::flush(int fd) {
+    // how many frames to try in one go. Two iovecs each.
+    constexpr std::size_t batch = 32;
+    auto big = [this](const Segment &seg) {
+        return zerocopy_min > 0 && seg.payload->size() >= zerocopy_min;
+    };
+    // set when the kernel won't take any more zerocopy sends right now.
+    bool copy_next = false;
+    while (!segments.empty()) {
+        // a big payload gets a sendmsg() to itself, with MSG_ZEROCOPY. The
+        // small ones around it get batched up and copied like normal.
+        bool zerocopy = big(segments.front()) && !copy_next;
+        copy_next = false;
+        // the kernel keeps pointing at whatever a zerocopy send gave it until
+        // the completion comes back, and the header lives in the deque, which
+        // can reuse it as soon as the frame's popped. So the header goes out
+        // first on its own, copied, and only the payload (which in_flight
+        // keeps alive) is sent zerocopy.
+        bool header_only = zerocopy && offset < segments.front().header_size;
+        if (header_only) {
+            zerocopy = false;
+        }
+        std::array<iovec, batch * 2> iov;
+        std::size_t n = 0;
+        std::size_t wanted = 0;
+        std::size_t skip = offset;
+        for (std::size_t i = 0; i < segments.size() && i < batch; i++) {
+            Segment &seg = segments[i];
+            if (i > 0 && (zerocopy || header_only || big(seg))) {
+                break;
+            }
+            if (skip < seg.header_size) {
+                iov[n++] = {seg.header.data() + skip, seg.header_size - skip};
+                skip = 0;
+            } else {
+                skip -= seg.header_size;
+            }
+            if (header_only) {
+                break;
+            }
+            if (seg.payload->size() > skip) {
+                iov[n++] = {const_cast<std::uint8_t *>(seg.payload->data()) +
+                                skip,
+                            seg.payload->size() - skip};
+            }
+            skip = 0;
+        }
+        for (std::size_t i = 0; i < n; i++) {
+            wanted += iov[i].iov_len;
+        }
+        msghdr msg = {};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = n;
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        if (zerocopy) {
+            flags |= MSG_ZEROCOPY;
+        }
+        ssize_t sent = ::sendmsg(fd, &msg, flags);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return send_status::again;
+            }
+            if (errno == EPIPE || errno == ECONNRESET) {
+                return send_status::closed;
+            }
+            if (zerocopy && errno == ENOBUFS) {
+                // too many pages pinned already (optmem_max). Copy this
+                // one, and go back to zerocopy for the next.
+                copy_next = true;
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(),
+                                    "sendmsg() failed");
+        }
+        if (zerocopy) {
+            in_flight.emplace_back(next_id++, segments.front().payload);
+        }
+        // drop whatever made it out.
+        pending -= sent;
+        std::size_t left = offset + sent;
+        while (!segments.empty()) {
+            std::size_t seg_size = segments.front().header_size +
+                                   segments.front().payload->size();
+            if (left < seg_size) {
+                break;
+            }
+            left -= seg_size;
+            segments.pop_front();
+        }
+        offset = left;
+        if (std::size_t(sent) < wanted) {
+            // the socket buffer filled up. Don't bother asking again, it's
+            // going to say EAGAIN.
+            return send_status::again;
+        }
+    }
+    offset = 0;
+    return send_status::done;
+}
+
+std::size_t FrameWriter::reap(int fd) {
+    std::size_t completed = 0;
+    while (true) {
+        char control[128];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return completed;
+            }
+            throw std::system_error(errno, std::generic_category(),
+                                    "recvmsg() failed");
+        }
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            bool recverr = (cm->cmsg_level == SOL_IP &&
+                            cm->cmsg_type == IP_RECVERR) ||
+                           (cm->cmsg_level == SOL_IPV6 &&
+                            cm->cmsg_type == IPV6_RECVERR);
+            if (!recverr) {
+                continue;
+            }
+            sock_extended_err err;
+            std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // sends lo through hi (inclusive, and it can wrap around) are
+            // done with.
+            std::uint32_t lo = err.ee_info;
+            std::uint32_t hi = err.ee_data;
+            std::erase_if(in_flight, [&](const auto &entry) {
+                return entry.first - lo <= hi - lo;
+            });
+            completed += hi - lo + 1;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zerocopy_min = 0;
+            }
+        }
+    }
+}
+
+} // namespace Netty
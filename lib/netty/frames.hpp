@@ -0,0 +1,152 @@
+// frames.hpp - buffer for decoding delimited frames out of a byte stream
+// (c) Saji Champlin 2022
+#pragma once
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+namespace Netty {
+
+// Every frame on the wire is a magic byte, the payload size as a big endian
+// 64 bit number, and then the payload (see delimit()/send_delimited()).
+constexpr std::uint8_t frame_magic = 0xFE;
+constexpr std::size_t frame_header_size = 1 + sizeof(std::uint64_t);
+using FrameHeader = std::array<std::uint8_t, frame_header_size>;
+// the header for a payload of size bytes, for sending it in front of a payload
+// that isn't copied.
+FrameHeader frame_header(std::uint64_t size);
+
+// FrameReader collects bytes from a stream and cuts them up into frames. It
+// used to be that every recv() made a new vector, which then got copied onto
+// the end of another vector, which then had frames erased off the front of it
+// (moving everything behind them). Here there's one buffer that gets reused:
+// bytes are received straight into the free space at the end of it, and frames
+// are handed out as views into it without copying. The only time anything
+// moves is when the unread leftovers get shifted back to the front to make
+// room, and the buffer only grows if a single frame doesn't fit.
+//
+//     Netty::RecvResult res;
+//     do {
+//         res = sock.recv_into(reader);
+//         while (auto payload = reader.next()) { ... }
+//     } while (res.status == Netty::recv_status::full);
+class FrameReader {
+    std::vector<std::uint8_t> buf;
+    std::size_t start = 0; // first byte we haven't handed out yet.
+    std::size_t end = 0;   // one past the last byte received.
+    std::size_t min_room;  // compact when there's less free space than this.
+    std::size_t max_frame;
+    std::uint64_t raw = 0; // bytes coming up that aren't frames.
+
+    // how much room the next receive should have, so the frame currently
+    // being received fits in one go.
+    std::size_t wanted() const;
+
+  public:
+    // capacity is the starting buffer size, which is also how much one
+    // receive can take in. Frames bigger than max_frame are treated as
+    // garbage (otherwise a bad header could make us allocate anything).
+    explicit FrameReader(std::size_t capacity = 65536,
+                         std::size_t max_frame = 64 * 1024 * 1024);
+
+    // the free space at the end of the buffer to receive into. Call
+    // commit() with however much of it got filled.
+    std::span<std::uint8_t> space();
+    void commit(std::size_t n);
+
+    // copy bytes in, for when they were received somewhere else (e.g by an
+    // io_uring multishot recv).
+    void append(std::span<const std::uint8_t> bytes);
+
+    // The payload of the next complete frame, or nothing if it hasn't all
+    // arrived yet. The view stays valid until the next space()/append().
+    // Throws std::runtime_error if the stream is misaligned.
+    std::optional<std::span<const std::uint8_t>> next();
+    // the same, but it's left there for next() to hand out again.
+    std::optional<std::span<const std::uint8_t>> peek();
+
+    // For when the stream switches to something else for a while, like the
+    // raw body after a MSG_STREAM header: the next n bytes aren't frames, and
+    // next() won't hand anything out until they've been take()n. Setting it
+    // back to 0 means the rest of them went somewhere else (e.g straight from
+    // the socket with splice()).
+    void expect_raw(std::uint64_t n) { raw = n; }
+    std::uint64_t raw_left() const { return raw; }
+
+    // up to max of the raw bytes that have been received. Same lifetime as
+    // next().
+    std::span<const std::uint8_t> take(std::size_t max);
+
+    // bytes received but not handed out as frames yet.
+    std::size_t buffered() const { return end - start; }
+};
+
+// A frame payload that's ready to go out. It's shared so that a message going
+// to a lot of connections only gets serialized (and stored) once.
+using Payload = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+// How a non-blocking send ended.
+enum class send_status {
+    done,   // everything went out.
+    again,  // the socket buffer is full, wait for EPOLLOUT and flush again.
+    closed, // the peer is gone (EPIPE/ECONNRESET). Drop the connection.
+};
+
+// FrameWriter holds the frames waiting to be sent on a non-blocking socket.
+// flush() writes as much as the kernel will take, gathering the headers and
+// payloads of several frames into one sendmsg(), and remembers where it left
+// off so the next flush() (on EPOLLOUT) picks up mid-frame. It never blocks
+// and never busy-loops on a full socket buffer.
+class FrameWriter {
+    struct Segment {
+        FrameHeader header;
+        std::size_t header_size; // 0 for raw bytes.
+        Payload payload;
+    };
+    std::deque<Segment> segments;
+    std::size_t offset = 0;  // how much of the front segment already went out.
+    std::size_t pending = 0; // bytes left to send, headers included.
+
+    // MSG_ZEROCOPY. The kernel numbers every zerocopy send, and tells us
+    // (on the socket's error queue) once it's done with the pages of a range
+    // of them. Until then the payload has to stay alive, so it's kept here.
+    std::size_t zerocopy_min = 0; // 0 is off.
+    std::uint32_t next_id = 0;
+    std::deque<std::pair<std::uint32_t, Payload>> in_flight;
+
+  public:
+    // queue a frame, without sending anything yet.
+    void push(Payload payload);
+    // queue bytes that go out as they are, with no header.
+    void push_raw(Payload bytes);
+
+    // send as much as possible. Errors other than the ones in send_status
+    // are thrown as std::system_error.
+    send_status flush(int fd);
+
+    bool empty() const { return segments.empty(); }
+    std::size_t size() const { return pending; }
+
+    // Send payloads of at least threshold bytes with MSG_ZEROCOPY, so the
+    // kernel sends straight from our buffer instead of copying it into the
+    // socket buffer first. That costs a page pinning and a completion
+    // notification per send, which only pays off for big buffers (the
+    // kernel docs say ~10KB and up). 0 turns it off. The socket needs
+    // SO_ZEROCOPY set as well.
+    void set_zerocopy(std::size_t threshold) { zerocopy_min = threshold; }
+    std::size_t zerocopy_threshold() const { return zerocopy_min; }
+
+    // read zerocopy completions off the socket's error queue (it shows up
+    // as EPOLLERR), and let go of the payloads the kernel is done with.
+    // Returns how many sends completed. If the kernel says it had to copy
+    // anyway (it always does over loopback), zerocopy gets turned off, since
+    // then it's pure overhead.
+    std::size_t reap(int fd);
+    // payloads still waiting on a completion.
+    std::size_t in_flight_count() const { return in_flight.size(); }
+};
+
+} // namespace Netty
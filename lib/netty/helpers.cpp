@@ -1,7 +1,10 @@
 
 #include "netty.hpp"
 #include <arpa/inet.h>
+#include <cstdlib>
 #include <cstring>
+#include <stdexcept>
+#include <sys/un.h>
 #include <system_error>
 namespace Netty {
 
@@ -54,4 +57,27 @@ addrinfo_p make_addrinfo(bool passive) noexcept {
     }
     return addrinfo_p(addr);
 }
+
+addrinfo_p make_unix_addrinfo(const std::string &path) {
+    sockaddr_un sun = {};
+    if (path.empty() || path.size() >= sizeof(sun.sun_path)) {
+        throw std::runtime_error("bad unix socket path: " + path);
+    }
+    // freeaddrinfo() frees the addrinfo and the address it points to in one
+    // go, since getaddrinfo() allocates them together. So we have to do the
+    // same thing, or it'll free a pointer malloc never gave out.
+    void *block = std::calloc(1, sizeof(addrinfo) + sizeof(sockaddr_un));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    auto *info = static_cast<addrinfo *>(block);
+    auto *addr = reinterpret_cast<sockaddr_un *>(info + 1);
+    addr->sun_family = AF_UNIX;
+    std::memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+    info->ai_family = AF_UNIX;
+    info->ai_socktype = SOCK_STREAM;
+    info->ai_addr = reinterpret_cast<sockaddr *>(addr);
+    info->ai_addrlen = sizeof(sockaddr_un);
+    return addrinfo_p(info);
+}
 } // namespace Netty
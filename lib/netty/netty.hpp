@@ -1,9 +1,13 @@
 // netty - A simple socket library for C++
 // (c) Saji Champlin 2022
 #pragma once
+#include "frames.hpp"
 #include "polly/filedes.hpp"
+#include "sockopt.hpp"
+#include "splice.hpp"
 #include <memory>
 #include <netdb.h>
+#include <span>
 #include <sys/socket.h>
 #include <vector>
 namespace Netty {
@@ -42,11 +46,35 @@ addrinfo_p getaddrinfo(std::string node, std::string service, bool passive);
 // Create a new addrinfo struct with sane defaults (TCP and either ipv6 or ipv4)
 addrinfo_p make_addrinfo(bool passive) noexcept;
 
+// An addrinfo for a unix domain (AF_UNIX) stream socket at path, for talking to
+// processes on the same machine without going through the TCP stack. Works
+// with Socket like any other addrinfo.
+addrinfo_p make_unix_addrinfo(const std::string &path);
+
+// Prepend the frame header (magic + payload size) to buf, the same way
+// send_delimited does. Useful when the bytes are sent by something other than
+// the Socket, like a polly::Ring.
+std::vector<std::uint8_t> delimit(const std::vector<std::uint8_t> &buf);
+
+// How a non-blocking receive ended. None of these are errors, so they're
+// returned instead of thrown.
+enum class recv_status {
+    again,  // drained everything, the socket would block now (EAGAIN).
+    full,   // ran out of buffer. There might be more waiting.
+    closed, // the peer closed the connection (EOF).
+};
+
+struct RecvResult {
+    std::size_t bytes = 0; // received this call, can be >0 for any status.
+    recv_status status = recv_status::again;
+};
+
 // A Socket is the base class for network communication. It wraps the linux
 // socket api in a safe manner. It helps set up connections and performs
 // error checking for all operations using C++ exceptions.
 class Socket : public polly::FileDes<Socket> {
     addrinfo_p info = nullptr;
+    FrameWriter output; // frames waiting for room in the send buffer.
 
     // private constructor for accept() *only*
     Socket(int new_fd, addrinfo_p addrinfo) : info(move(addrinfo)) {
@@ -58,8 +86,12 @@ class Socket : public polly::FileDes<Socket> {
   public:
     Socket() : info(make_addrinfo(false)) { open(); };
     Socket(addrinfo_p addrinfo) : info(move(addrinfo)) { open(); };
+    // adopt a socket that was opened somewhere else (e.g by an io_uring
+    // accept). There's no addrinfo, so bind/connect won't work.
+    explicit Socket(int new_fd) : Socket(new_fd, nullptr){};
     Socket(const Socket &other) : FileDes(other), info(other.info.get()){};
-    Socket(Socket &&other) : FileDes(other), info(std::move(other.info)){};
+    Socket(Socket &&other)
+        : FileDes(std::move(other)), info(std::move(other.info)){};
 
     // Allows for setting a socket after the fact (for whatever reason)
     void setaddrinfo(addrinfo_p new_info);
@@ -67,6 +99,23 @@ class Socket : public polly::FileDes<Socket> {
     // Incomplete wrapper to set socket options. Doesn't support socket options
     // that don't take an int.
     void setsockopt(int optname, int value);
+    // same thing, for options that aren't at the SOL_SOCKET level.
+    void setsockopt(int level, int optname, int value);
+    int getsockopt(int level, int optname);
+
+    // typed versions, see sockopt.hpp.
+    template <typename T> void set(Option<T> option, T value) {
+        setsockopt(option.level, option.name, to_sockopt(value));
+    }
+    template <typename T> T get(Option<T> option) {
+        return from_sockopt<T>(getsockopt(option.level, option.name));
+    }
+
+    // apply everything a profile sets. Buffer sizes only fully take effect
+    // if this happens before connect()/listen(). Accepted sockets inherit
+    // their listener's options, so a profile applied to a listener covers
+    // all of its connections.
+    void apply(const SocketProfile &profile);
 
     // initiate a connection with the stored addrinfo
     void connect();
@@ -77,22 +126,64 @@ class Socket : public polly::FileDes<Socket> {
     // receive Packets.
     std::vector<std::uint8_t> recv(int size);
 
+    // Receive into buf until it's full, the socket would block, or the peer
+    // closes. Doesn't block even if the socket is in blocking mode. Real
+    // errors (ECONNRESET and so on) are still thrown.
+    RecvResult recv_into(std::span<std::uint8_t> buf);
+
+    // Same thing, but into the free space of a FrameReader. If it comes back
+    // recv_status::full, take the frames out and call it again; the reader
+    // only grows when a single frame doesn't fit, so a fast sender can't make
+    // us buffer forever.
+    RecvResult recv_into(FrameReader &reader);
+
     // recv all packets, only works with nonblocking.
     std::vector<std::uint8_t> recv_all();
 
     std::vector<std::uint8_t> recv_delimited();
 
+    // send a whole frame (header and payload) in one go. Blocks until it's
+    // all out, so only for blocking sockets.
     int send_delimited(const std::vector<std::uint8_t> &buf);
 
+    // The non-blocking way to send frames: queue them up, then flush(). If
+    // flush() says send_status::again, wait for EPOLLOUT and flush() again.
+    // It picks up where it left off, even in the middle of a frame.
+    void queue_frame(Payload payload) { output.push(std::move(payload)); }
+    // bytes that go out as they are, without a frame header.
+    void queue_raw(Payload bytes) { output.push_raw(std::move(bytes)); }
+    send_status flush() { return output.flush(fd); }
+    // whether everything queued has been sent.
+    bool flushed() const { return output.empty(); }
+    // how many bytes are queued and not sent yet, frame headers included.
+    std::size_t unsent() const { return output.size(); }
+
+    // Queued frames with a payload of at least threshold bytes go out with
+    // MSG_ZEROCOPY instead of being copied into the socket buffer (0 turns
+    // it off). The kernel reports when it's done with each one through
+    // EPOLLERR, which has to be answered with reap_zerocopy() so the
+    // payloads can be freed. Small frames are cheaper to copy, so they
+    // always are.
+    void set_zerocopy(std::size_t threshold);
+    std::size_t reap_zerocopy() { return output.reap(fd); }
+
     // bind to address
     void bind();
 
-    // Start listening on this socket.
-    void listen();
+    // Start listening on this socket. The backlog is how many finished
+    // handshakes the kernel holds on to for us; it's capped by
+    // net.core.somaxconn.
+    void listen(int backlog = SOMAXCONN);
 
     // take a new connection request, accept it, and return a new socket for
     // this connection.
     Socket accept();
+
+    // The fast way to take connections: accept4() with the flags applied
+    // straight away (so no fcntl() afterwards), and no addrinfo. Returns the
+    // new fd, or -1 if there's nobody waiting. Call it in a loop until it
+    // returns -1 to drain the whole backlog in one go.
+    int accept4(int flags = SOCK_NONBLOCK | SOCK_CLOEXEC);
 };
 
 } // namespace Netty
@@ -0,0 +1,25 @@
+#include "peer.hpp"
+namespace Netty {
+
+void Peer::queue(std::vector<std::uint8_t> frame) {
+    sock->queue_frame(
+        std::make_shared<const std::vector<std::uint8_t>>(std::move(frame)));
+}
+
+send_status Peer::flush(polly::EventLoop &loop) {
+    send_status status = sock->flush();
+    if (status == send_status::closed) {
+        return status;
+    }
+    std::uint32_t want = EPOLLIN;
+    if (!sock->flushed()) {
+        want |= EPOLLOUT;
+    }
+    if (want != events) {
+        events = want;
+        loop.set_events(*sock, want);
+    }
+    return status;
+}
+
+} // namespace Netty
@@ -0,0 +1,33 @@
+// peer.hpp - the client end of a connection, for tools that run lots of them
+// (c) Saji Champlin 2022
+#pragma once
+#include "netty.hpp"
+#include "polly/polly.hpp"
+#include <cstdint>
+#include <memory>
+#include <vector>
+namespace Netty {
+
+// One connection to a server on an event loop, for the tools that play a lot
+// of clients at once (harness, loadgen, replay). Frames get queued, then
+// flush() sends what it can, and only asks the loop for EPOLLOUT while some of
+// them are still waiting. So a full socket buffer gets a wakeup once it
+// drains, and an empty one doesn't wake us up for nothing.
+//
+// The socket has to be added to the loop with EPOLLIN.
+struct Peer {
+    std::shared_ptr<Socket> sock;
+    FrameReader reader;
+    // what the loop's watching for, so it's only told when that changes.
+    std::uint32_t events = EPOLLIN;
+
+    // queue a frame, without sending anything yet.
+    void queue(std::vector<std::uint8_t> frame);
+
+    // send what's queued, and watch for EPOLLOUT if any of it's left. If it
+    // comes back send_status::closed the other end's gone, and the loop
+    // hasn't been touched. Other errors are thrown as std::system_error.
+    send_status flush(polly::EventLoop &loop);
+};
+
+} // namespace Netty
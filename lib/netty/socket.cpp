@@ -37,8 +37,8 @@ void Socket::bind() {
     }
 }
 
-void Socket::listen() {
-    int result = ::listen(fd, 20); // TODO: set a different backlog?
+void Socket::listen(int backlog) {
+    int result = ::listen(fd, backlog);
 
     if (result == -1) {
         throw std::system_error(errno, std::generic_category(),
@@ -56,6 +56,25 @@ Socket Socket::accept() {
     return Socket(result, move(new_info));
 }
 
+int Socket::accept4(int flags) {
+    while (true) {
+        int result = ::accept4(fd, nullptr, nullptr, flags);
+        if (result != -1) {
+            return result;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        // the connection died while it was waiting, or we got interrupted.
+        // Either way there might be more behind it.
+        if (errno == ECONNABORTED || errno == EINTR) {
+            continue;
+        }
+        throw std::system_error(errno, std::generic_category(),
+                                "accept4() failed");
+    }
+}
+
 void Socket::connect() {
     // TODO: traverse the linked list for more results if connection fails.
     int result = ::connect(fd, info->ai_addr, info->ai_addrlen);
@@ -76,6 +95,38 @@ std::vector<std::uint8_t> Socket::recv(int size) {
     return buf;
 }
 
+RecvResult Socket::recv_into(std::span<std::uint8_t> buf) {
+    RecvResult res;
+    while (res.bytes < buf.size()) {
+        ssize_t n = ::recv(fd, buf.data() + res.bytes, buf.size() - res.bytes,
+                           MSG_DONTWAIT);
+        if (n == 0) {
+            res.status = recv_status::closed;
+            return res;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                res.status = recv_status::again;
+                return res;
+            }
+            throw std::system_error(errno, std::generic_category(),
+                                    "recv() failed");
+        }
+        res.bytes += n;
+    }
+    res.status = recv_status::full;
+    return res;
+}
+
+RecvResult Socket::recv_into(FrameReader &reader) {
+    RecvResult res = recv_into(reader.space());
+    reader.commit(res.bytes);
+    return res;
+}
+
 std::vector<std::uint8_t> Socket::recv_all() {
     constexpr int block_size = 4096;
     std::vector<std::uint8_t> result;
@@ -119,15 +170,52 @@ int Socket::send(std::vector<std::uint8_t> const &buf) {
 
 constexpr char MAGIC_PACKET = 0xFE;
 int Socket::send_delimited(const std::vector<std::uint8_t> &buf) {
+    auto header_buf = surreal::DataBuf();
+    header_buf.serialize(MAGIC_PACKET);
+    header_buf.serialize(std::size(buf));
+    std::vector<std::uint8_t> header = header_buf;
+    // header and payload go out together in one sendmsg(), instead of two
+    // sends (and two packets, with TCP_NODELAY).
+    iovec iov[2] = {{header.data(), header.size()},
+                    {const_cast<std::uint8_t *>(buf.data()), buf.size()}};
+    std::size_t total = header.size() + buf.size();
+    std::size_t sent = 0;
+    while (sent < total) {
+        // skip over what already went out.
+        std::size_t skip = sent;
+        int first = 0;
+        if (skip >= iov[0].iov_len) {
+            skip -= iov[0].iov_len;
+            first = 1;
+        }
+        iovec rest[2] = {iov[0], iov[1]};
+        rest[first].iov_base =
+            static_cast<std::uint8_t *>(iov[first].iov_base) + skip;
+        rest[first].iov_len = iov[first].iov_len - skip;
+        msghdr msg = {};
+        msg.msg_iov = rest + first;
+        msg.msg_iovlen = 2 - first;
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(),
+                                    "sendmsg() failed:");
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+std::vector<std::uint8_t> delimit(const std::vector<std::uint8_t> &buf) {
     auto header = surreal::DataBuf();
 
     header.serialize(MAGIC_PACKET);
     header.serialize(std::size(buf));
 
-    int result = send(header);
-
-    result += send(buf);
-
+    std::vector<std::uint8_t> result = header;
+    result.insert(result.end(), buf.begin(), buf.end());
     return result;
 }
 
@@ -146,11 +234,63 @@ std::vector<std::uint8_t> Socket::recv_delimited() {
 }
 
 void Socket::setsockopt(int optname, int value) {
-    int result = ::setsockopt(fd, SOL_SOCKET, optname, &value, sizeof(value));
+    setsockopt(SOL_SOCKET, optname, value);
+}
+
+void Socket::setsockopt(int level, int optname, int value) {
+    int result = ::setsockopt(fd, level, optname, &value, sizeof(value));
     if (result == -1) {
         throw std::system_error(errno, std::generic_category(),
                                 "setsockopt() failed:");
     }
 }
 
+int Socket::getsockopt(int level, int optname) {
+    int value = 0;
+    socklen_t len = sizeof(value);
+    int result = ::getsockopt(fd, level, optname, &value, &len);
+    if (result == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "getsockopt() failed:");
+    }
+    return value;
+}
+
+void Socket::apply(const SocketProfile &profile) {
+    if (profile.nodelay) {
+        set(opt::nodelay, *profile.nodelay);
+    }
+    if (profile.notsent_lowat) {
+        set(opt::notsent_lowat, *profile.notsent_lowat);
+    }
+    if (profile.sndbuf) {
+        set(opt::sndbuf, *profile.sndbuf);
+    }
+    if (profile.rcvbuf) {
+        set(opt::rcvbuf, *profile.rcvbuf);
+    }
+    if (profile.keepalive) {
+        set(opt::keepalive, *profile.keepalive);
+    }
+    if (profile.keepidle) {
+        set(opt::keepidle, *profile.keepidle);
+    }
+    if (profile.keepintvl) {
+        set(opt::keepintvl, *profile.keepintvl);
+    }
+    if (profile.keepcnt) {
+        set(opt::keepcnt, *profile.keepcnt);
+    }
+    if (profile.busy_poll) {
+        set(opt::busy_poll, *profile.busy_poll);
+    }
+}
+
+void Socket::set_zerocopy(std::size_t threshold) {
+    if (threshold > 0) {
+        set(opt::zerocopy, true); // throws on kernels older than 4.14.
+    }
+    output.set_zerocopy(threshold);
+}
+
 } // namespace Netty
@@ -0,0 +1,40 @@
+#include "sockopt.hpp"
+#include <stdexcept>
+namespace Netty {
+
+SocketProfile SocketProfile::interactive() {
+    SocketProfile p;
+    p.nodelay = true;
+    p.notsent_lowat = 16 * 1024;
+    p.keepalive = true;
+    p.keepidle = std::chrono::seconds(60);
+    p.keepintvl = std::chrono::seconds(10);
+    p.keepcnt = 5;
+    return p;
+}
+
+SocketProfile SocketProfile::bulk() {
+    SocketProfile p;
+    p.sndbuf = 4 * 1024 * 1024;
+    p.rcvbuf = 4 * 1024 * 1024;
+    p.keepalive = true;
+    p.keepidle = std::chrono::seconds(60);
+    p.keepintvl = std::chrono::seconds(10);
+    p.keepcnt = 5;
+    return p;
+}
+
+SocketProfile SocketProfile::named(const std::string &name) {
+    if (name == "interactive") {
+        return interactive();
+    }
+    if (name == "bulk") {
+        return bulk();
+    }
+    if (name == "default") {
+        return SocketProfile{};
+    }
+    throw std::invalid_argument("unknown socket profile " + name);
+}
+
+} // namespace Netty
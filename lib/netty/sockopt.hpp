@@ -0,0 +1,100 @@
+// sockopt.hpp - typed socket options and tuning profiles for netty
+// (c) Saji Champlin 2022
+#pragma once
+#include <chrono>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <string>
+#include <sys/socket.h>
+namespace Netty {
+
+// setsockopt() takes a level, a name, and a void* to whatever type the option
+// wants, and it's on you to get all three right. An Option bundles the level
+// and name together with the type of the value, so Socket::set()/get() can
+// check it at compile time:
+//
+//     sock.set(Netty::opt::nodelay, true);
+//     int size = sock.get(Netty::opt::sndbuf);
+//
+// Everything here is stored as an int by the kernel; T is just what we
+// convert it to and from.
+template <typename T> struct Option {
+    int level;
+    int name;
+};
+
+namespace opt {
+// socket level
+inline constexpr Option<bool> reuseaddr{SOL_SOCKET, SO_REUSEADDR};
+inline constexpr Option<bool> keepalive{SOL_SOCKET, SO_KEEPALIVE};
+inline constexpr Option<int> sndbuf{SOL_SOCKET, SO_SNDBUF};
+inline constexpr Option<int> rcvbuf{SOL_SOCKET, SO_RCVBUF};
+// spin in recv/poll for this long before sleeping. Raising it past
+// net.core.busy_read needs CAP_NET_ADMIN.
+inline constexpr Option<std::chrono::microseconds> busy_poll{SOL_SOCKET,
+                                                             SO_BUSY_POLL};
+// allow MSG_ZEROCOPY sends, see Socket::set_zerocopy().
+inline constexpr Option<bool> zerocopy{SOL_SOCKET, SO_ZEROCOPY};
+
+// TCP level
+// turn off Nagle's algorithm, so small writes go out right away instead of
+// waiting for the previous one to be acked.
+inline constexpr Option<bool> nodelay{IPPROTO_TCP, TCP_NODELAY};
+// hold back partial frames until uncorked (or 200ms pass).
+inline constexpr Option<bool> cork{IPPROTO_TCP, TCP_CORK};
+// ack straight away instead of delaying. Not sticky, the kernel turns it
+// back off by itself.
+inline constexpr Option<bool> quickack{IPPROTO_TCP, TCP_QUICKACK};
+// only report writable once unsent data drops below this. Keeps the send
+// buffer from soaking up latency.
+inline constexpr Option<int> notsent_lowat{IPPROTO_TCP, TCP_NOTSENT_LOWAT};
+inline constexpr Option<std::chrono::seconds> keepidle{IPPROTO_TCP,
+                                                       TCP_KEEPIDLE};
+inline constexpr Option<std::chrono::seconds> keepintvl{IPPROTO_TCP,
+                                                        TCP_KEEPINTVL};
+inline constexpr Option<int> keepcnt{IPPROTO_TCP, TCP_KEEPCNT};
+inline constexpr Option<int> defer_accept{IPPROTO_TCP, TCP_DEFER_ACCEPT};
+} // namespace opt
+
+// converting option values to and from what the kernel stores.
+inline int to_sockopt(bool value) { return value ? 1 : 0; }
+inline int to_sockopt(int value) { return value; }
+template <typename Rep, typename Period>
+int to_sockopt(std::chrono::duration<Rep, Period> value) {
+    return int(value.count());
+}
+template <typename T> T from_sockopt(int value) { return T(value); }
+
+// A set of options to apply to a connection in one go. Anything left empty
+// is left alone.
+struct SocketProfile {
+    std::optional<bool> nodelay;
+    std::optional<int> notsent_lowat;
+    std::optional<int> sndbuf;
+    std::optional<int> rcvbuf;
+    std::optional<bool> keepalive;
+    std::optional<std::chrono::seconds> keepidle;
+    std::optional<std::chrono::seconds> keepintvl;
+    std::optional<int> keepcnt;
+    std::optional<std::chrono::microseconds> busy_poll;
+
+    // Chat traffic: lots of small frames where latency is what matters.
+    // No Nagle, a small unsent backlog, and keepalives so dead peers don't
+    // hang around.
+    static SocketProfile interactive();
+
+    // File transfers and the like: big socket buffers so a fast link can
+    // be kept full, Nagle left on.
+    static SocketProfile bulk();
+
+    // Either profile can also busy poll, by setting busy_poll. That burns
+    // CPU spinning on the socket to shave microseconds off each wakeup, so
+    // it's only worth it for latency-critical deployments.
+
+    // look up a profile by name ("interactive", "bulk", or "default" for no
+    // changes). Throws std::invalid_argument for anything else.
+    static SocketProfile named(const std::string &name);
+};
+
+} // namespace Netty
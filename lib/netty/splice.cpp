@@ -0,0 +1,62 @@
+#include "splice.hpp"
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <system_error>
+#include <unistd.h>
+namespace Netty {
+
+Pipe::Pipe(std::size_t size) {
+    if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "pipe2() failed");
+    }
+    // the default is 64K, which means a syscall every 16 pages. Growing it
+    // is only an optimization, so don't care if it doesn't work.
+    int got = ::fcntl(fds[1], F_SETPIPE_SZ, int(size));
+    if (got == -1) {
+        got = ::fcntl(fds[1], F_GETPIPE_SZ);
+    }
+    cap = got > 0 ? got : 65536;
+}
+
+Pipe::~Pipe() {
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+ssize_t splice(int from, int to, std::size_t len) {
+    while (true) {
+        ssize_t n = ::splice(from, nullptr, to, nullptr, len,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        throw std::system_error(errno, std::generic_category(),
+                                "splice() failed");
+    }
+}
+
+ssize_t sendfile(int to, int from, off_t &offset, std::size_t len) {
+    while (true) {
+        ssize_t n = ::sendfile(to, from, &offset, len);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        throw std::system_error(errno, std::generic_category(),
+                                "sendfile() failed");
+    }
+}
+
+} // namespace Netty
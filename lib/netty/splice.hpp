@@ -0,0 +1,42 @@
+// splice.hpp - moving bytes between descriptors without copying them through
+// user space
+// (c) Saji Champlin 2022
+#pragma once
+#include <cstddef>
+#include <sys/types.h>
+namespace Netty {
+
+// A non-blocking pipe, which is what splice() needs in the middle to move
+// bytes from one socket to another inside the kernel:
+//
+//     socket -> splice() -> pipe -> splice() -> socket
+//
+// The pipe only holds page references, so nothing actually gets copied.
+class Pipe {
+    int fds[2] = {-1, -1};
+    std::size_t cap;
+
+  public:
+    // asks the kernel for a pipe of (at least) size bytes. It might give us
+    // less if we're over the per-user pipe limit, capacity() says what we
+    // actually got.
+    explicit Pipe(std::size_t size = 1024 * 1024);
+    Pipe(const Pipe &other) = delete;
+    ~Pipe();
+
+    int read_fd() const { return fds[0]; }
+    int write_fd() const { return fds[1]; }
+    std::size_t capacity() const { return cap; }
+};
+
+// splice() up to len bytes from one descriptor to the other (one of them has
+// to be a pipe). Returns how much moved, 0 if from hit EOF, or -1 if either
+// end would block. Other errors are thrown as std::system_error.
+ssize_t splice(int from, int to, std::size_t len);
+
+// sendfile() up to len bytes of a file, starting from offset (which gets
+// moved along). Returns how much went out, or -1 if the socket would block.
+// Other errors are thrown as std::system_error.
+ssize_t sendfile(int to, int from, off_t &offset, std::size_t len);
+
+} // namespace Netty
@@ -0,0 +1,197 @@
+// coro.hpp - C++20 coroutine support for polly
+// (c) Saji Champlin 2022
+
+#pragma once
+#include "polly.hpp"
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <sys/epoll.h>
+namespace polly {
+
+// The callback style (set_handler + a big lambda) gets messy as soon as a
+// connection has more than one state, since the state has to be kept somewhere
+// by hand between events. Coroutines let the compiler do that for us: code
+// can just co_await until a descriptor is ready, and carry on from where it
+// left off.
+//
+// None of the awaitables here allocate. They live in the coroutine frame of
+// whoever is awaiting them, and all the event loop keeps is a pointer. The only
+// allocations are the coroutine frame itself and a spot for its exception, once
+// per Task.
+
+// A coroutine that starts running immediately and cleans up after itself when
+// it finishes. Nobody can wait on it, which is fine for the long-running
+// loops we use them for.
+//
+// If it throws, it finishes there (and still cleans up). Throwing on into
+// whoever resumed it would land in some other descriptor's handler, in the
+// middle of EventLoop::wait(), so the exception's kept for the owner of the
+// Task to check on instead, with rethrow().
+struct Task {
+    struct promise_type {
+        std::shared_ptr<std::exception_ptr> error =
+            std::make_shared<std::exception_ptr>();
+
+        Task get_return_object() { return {error}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { *error = std::current_exception(); }
+    };
+
+    std::shared_ptr<std::exception_ptr> error;
+
+    // throw what the coroutine threw, if it did.
+    void rethrow() const {
+        if (*error) {
+            std::rethrow_exception(*error);
+        }
+    }
+};
+
+// An operation a coroutine is suspended on. Whenever the descriptor becomes
+// ready, the Waiter calls step() to make progress on it (e.g to send some more
+// bytes), and once that returns true the coroutine is resumed.
+struct Op {
+    std::coroutine_handle<> handle;
+    virtual bool step() = 0;
+};
+
+// Connects a registered descriptor to the coroutines waiting on it. Call
+// handle() from the descriptor's handler. There can be one reader and one
+// writer waiting at a time.
+//
+// Interest in EPOLLIN/EPOLLOUT is added when someone starts waiting, but only
+// dropped when an event shows up that nobody wants. A coroutine that goes
+// straight back to waiting (the usual case) doesn't cost any epoll_ctl()
+// calls.
+class Waiter {
+    EventLoop &loop;
+    AbstractFileDes &item;
+    std::uint32_t interest = 0;
+    Op *reading = nullptr;
+    Op *writing = nullptr;
+
+    void want(std::uint32_t events) {
+        if ((interest & events) != events) {
+            interest |= events;
+            loop.set_events(item, interest);
+        }
+    }
+
+  public:
+    // item has to be registered with loop already (with no events).
+    Waiter(EventLoop &loop, AbstractFileDes &item) : loop(loop), item(item) {}
+    Waiter(const Waiter &other) = delete;
+
+    void suspend_read(Op *op) {
+        reading = op;
+        want(EPOLLIN | EPOLLRDHUP);
+    }
+    void suspend_write(Op *op) {
+        writing = op;
+        want(EPOLLOUT);
+    }
+
+    void handle(int events) {
+        std::coroutine_handle<> resume_read, resume_write;
+        std::uint32_t unwanted = 0;
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            if (writing == nullptr) {
+                unwanted |= EPOLLOUT;
+            } else if (writing->step()) {
+                resume_write = writing->handle;
+                writing = nullptr;
+            }
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+            if (reading == nullptr) {
+                unwanted |= EPOLLIN | EPOLLRDHUP;
+            } else if (reading->step()) {
+                resume_read = reading->handle;
+                reading = nullptr;
+            }
+        }
+        if (interest & unwanted) {
+            interest &= ~unwanted;
+            loop.set_events(item, interest);
+        }
+        // resuming might end up destroying us, so don't touch any members
+        // from here on.
+        if (resume_write) {
+            resume_write.resume();
+        }
+        if (resume_read) {
+            resume_read.resume();
+        }
+    }
+
+    // co_await waiter.readable() suspends until the descriptor is readable.
+    auto readable() {
+        struct Awaiter : Op {
+            Waiter &waiter;
+            Awaiter(Waiter &waiter) : waiter(waiter) {}
+            bool step() override { return true; }
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h) {
+                handle = h;
+                waiter.suspend_read(this);
+            }
+            void await_resume() {}
+        };
+        return Awaiter(*this);
+    }
+
+    // co_await waiter.writable() suspends until the descriptor is writable.
+    auto writable() {
+        struct Awaiter : Op {
+            Waiter &waiter;
+            Awaiter(Waiter &waiter) : waiter(waiter) {}
+            bool step() override { return true; }
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h) {
+                handle = h;
+                waiter.suspend_write(this);
+            }
+            void await_resume() {}
+        };
+        return Awaiter(*this);
+    }
+};
+
+// A flag one coroutine can wait on until someone else sets it. It resets
+// itself when the waiter wakes up. set() resumes the waiter right away, so it
+// runs before set() returns.
+class Event {
+    std::coroutine_handle<> waiter;
+    bool flag = false;
+
+  public:
+    void set() {
+        if (waiter) {
+            auto h = waiter;
+            waiter = nullptr;
+            h.resume();
+        } else {
+            flag = true;
+        }
+    }
+
+    auto operator co_await() {
+        struct Awaiter {
+            Event &event;
+            bool await_ready() {
+                bool was_set = event.flag;
+                event.flag = false;
+                return was_set;
+            }
+            void await_suspend(std::coroutine_handle<> h) { event.waiter = h; }
+            void await_resume() {}
+        };
+        return Awaiter{*this};
+    }
+};
+
+} // namespace polly
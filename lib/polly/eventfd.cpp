@@ -0,0 +1,38 @@
+#include "eventfd.hpp"
+#include <system_error>
+#include <unistd.h>
+namespace polly {
+
+EventFd::EventFd(unsigned int initval, int flags) {
+    fd = eventfd(initval, flags);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(),
+                                "eventfd() failed");
+}
+
+void EventFd::notify(uint64_t value) {
+    int result = ::write(fd, &value, sizeof(value));
+
+    // EAGAIN means the counter is about to overflow, but then it's already
+    // readable, so there's nothing left to do.
+    if (result == -1 && errno != EAGAIN) {
+        throw std::system_error(errno, std::generic_category(),
+                                "write() failed");
+    }
+}
+
+uint64_t EventFd::read() {
+    uint64_t value = 0;
+    int result = ::read(fd, &value, sizeof(value));
+
+    if (result == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    if (result == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "read() failed");
+    }
+    return value;
+}
+
+} // namespace polly
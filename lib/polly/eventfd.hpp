@@ -0,0 +1,31 @@
+// eventfd.hpp - polly-compatible eventfd wrapper
+// Saji Champlin 2022
+
+#pragma once
+#include "filedes.hpp"
+#include <cstdint>
+#include <sys/eventfd.h>
+
+namespace polly {
+
+// An EventFd is a counter that the kernel can wait on. Anything (another
+// thread, most importantly) can notify() it, which makes it readable and wakes
+// up the event loop it's registered with. It's the standard way to hand work
+// back to the loop without it having to poll for it.
+class EventFd : public FileDes<EventFd> {
+
+  public:
+    EventFd(unsigned int initval = 0, int flags = EFD_NONBLOCK | EFD_CLOEXEC);
+    // keep our copy ctor and move ctor (assignment is inherited)
+    EventFd(const EventFd &other) : FileDes(other){};
+
+    EventFd(EventFd &&other) : FileDes(other){};
+
+    // add value to the counter. Safe to call from any thread.
+    void notify(uint64_t value = 1);
+
+    // returns the counter and resets it to zero. For a non-blocking EventFd
+    // that hasn't been notified, that's 0.
+    uint64_t read();
+};
+} // namespace polly
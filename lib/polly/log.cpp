@@ -0,0 +1,156 @@
+#include "log.hpp"
+#include <cerrno>
+#include <csignal>
+#include <stdexcept>
+#include <unistd.h>
+namespace polly {
+
+Logger::Logger(int fd, std::size_t capacity) : fd(fd) {
+    std::size_t n = 2;
+    while (n < capacity) {
+        n *= 2;
+    }
+    slots = std::make_unique<Slot[]>(n);
+    mask = n - 1;
+    // each slot's seq says whose turn it is: equal to the position means
+    // it's free for whoever's writing that position, position + 1 means it's
+    // full and waiting to be read.
+    for (std::size_t i = 0; i < n; i++) {
+        slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    // signals are for the main thread (see signal.hpp). If the writer could
+    // take one, a SIGINT that landed on it would kill us without cleaning
+    // up, so it starts (and stays) with everything blocked.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    writer = std::thread([this] { run(); });
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+Logger::~Logger() {
+    stopping = true;
+    wakeups.fetch_add(1);
+    wakeups.notify_one();
+    writer.join();
+}
+
+Logger &Logger::get() {
+    static Logger logger;
+    return logger;
+}
+
+level Logger::named(const std::string &name) {
+    if (name == "debug") {
+        return level::debug;
+    }
+    if (name == "info") {
+        return level::info;
+    }
+    if (name == "warn") {
+        return level::warn;
+    }
+    if (name == "error") {
+        return level::error;
+    }
+    if (name == "off") {
+        return level::off;
+    }
+    throw std::invalid_argument("unknown log level " + name);
+}
+
+void Logger::write(level l, std::string text) {
+    if (!enabled(l)) {
+        return;
+    }
+    std::uint64_t pos = tail.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &slots[pos & mask];
+        std::uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            // free, if nobody beats us to it.
+            if (tail.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (seq < pos) {
+            // still holding a line from a lap ago, so we're full.
+            drops.fetch_add(1, std::memory_order_relaxed);
+            total_drops.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+    slot->time = std::time(nullptr);
+    slot->text = std::move(text);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    // only wake the writer if it's asleep. The fence pairs with the one in
+    // run(), so either it sees this line before going to sleep or we see
+    // that it's sleeping.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        wakeups.fetch_add(1);
+        wakeups.notify_one();
+    }
+}
+
+bool Logger::empty() const {
+    return slots[head & mask].seq.load(std::memory_order_acquire) != head + 1;
+}
+
+void Logger::run() {
+    std::string batch;
+    std::time_t stamped = -1;
+    char stamp[32] = {};
+    while (true) {
+        batch.clear();
+        while (!empty()) {
+            Slot &slot = slots[head & mask];
+            if (slot.time != stamped) {
+                struct tm tm;
+                localtime_r(&slot.time, &tm);
+                std::strftime(stamp, sizeof(stamp), "%F %T:", &tm);
+                stamped = slot.time;
+            }
+            batch += stamp;
+            batch += slot.text;
+            batch += '\n';
+            // don't hang on to big lines' memory.
+            std::string().swap(slot.text);
+            slot.seq.store(head + mask + 1, std::memory_order_release);
+            head++;
+        }
+        if (std::uint64_t n = drops.exchange(0, std::memory_order_relaxed)) {
+            batch += "log: dropped " + std::to_string(n) +
+                     " lines, logging faster than they could be written\n";
+        }
+        // the whole batch in as few write()s as it takes.
+        for (std::size_t off = 0; off < batch.size();) {
+            ssize_t n = ::write(fd, batch.data() + off, batch.size() - off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break; // nowhere to put it, so don't.
+            }
+            off += n;
+        }
+        if (!batch.empty()) {
+            continue;
+        }
+        if (stopping) {
+            return;
+        }
+        std::uint32_t w = wakeups.load();
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (empty() && !stopping) {
+            wakeups.wait(w);
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+} // namespace polly
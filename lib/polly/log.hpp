@@ -0,0 +1,88 @@
+// log.hpp - asynchronous logging for polly programs
+// (c) Saji Champlin 2022
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+namespace polly {
+
+enum class level : std::uint8_t { debug, info, warn, error, off };
+
+// Writing a line to stdout used to mean formatting the time with localtime(),
+// and then a write() (thanks to std::endl) right there on the event loop
+// thread. If stdout is a slow terminal or a full pipe, that's the whole server
+// waiting on it.
+//
+// Now the line goes into a ring, and a background thread takes everything
+// that's piled up, stamps it, and writes it out in one go. Putting a line in
+// is a compare-and-swap and a move, and never blocks. If the ring's full the
+// line is thrown out and counted instead, and the count shows up in the output
+// once there's room. Any thread can log (the ring is a Vyukov bounded queue,
+// so producers don't take a lock either).
+//
+// The timestamp is taken when the line is logged, but only formatted by the
+// writer thread, and only once per second rather than once per line.
+//
+// Lines still in the ring when the program exits normally (returning from
+// main() or exit()) are written out. A crash loses them.
+class Logger {
+    struct Slot {
+        std::atomic<std::uint64_t> seq;
+        std::time_t time;
+        std::string text;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::uint64_t mask;
+    std::atomic<std::uint64_t> tail = 0; // next slot to write into.
+    std::uint64_t head = 0;              // next to read, writer thread only.
+
+    std::atomic<level> min = level::info;
+    std::atomic<std::uint64_t> drops = 0; // since the writer last looked.
+    std::atomic<std::uint64_t> total_drops = 0;
+
+    // the writer sleeps on wakeups when there's nothing to do.
+    std::atomic<std::uint32_t> wakeups = 0;
+    std::atomic<bool> sleeping = false;
+    std::atomic<bool> stopping = false;
+    int fd;
+    std::thread writer;
+
+    void run();
+    bool empty() const;
+
+  public:
+    // capacity is rounded up to a power of two.
+    explicit Logger(int fd = 1, std::size_t capacity = 16384);
+    Logger(const Logger &other) = delete;
+    // writes out everything that's left.
+    ~Logger();
+
+    // the one print() uses, started the first time it's needed.
+    static Logger &get();
+
+    // whether lines at l get written. Cheap enough to check before building
+    // a line, so nothing's formatted if it's just going to be thrown out.
+    bool enabled(level l) const {
+        return l >= min.load(std::memory_order_relaxed);
+    }
+    void set_level(level l) { min.store(l, std::memory_order_relaxed); }
+
+    // log a line (without the newline).
+    void write(level l, std::string text);
+
+    // lines thrown out because the ring was full, ever.
+    std::uint64_t dropped() const {
+        return total_drops.load(std::memory_order_relaxed);
+    }
+
+    // "debug", "info" and so on. Throws std::invalid_argument for anything
+    // else.
+    static level named(const std::string &name);
+};
+
+} // namespace polly
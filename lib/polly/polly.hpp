@@ -5,6 +5,7 @@
 // But I will say that this is deeply flawed code, and it's not *all*
 // my fault
 #include "filedes.hpp"
+#include "stats.hpp"
 #include <any>
 #include <map>
 #include <memory>
@@ -46,13 +47,37 @@ namespace polly {
 // code must be structured in an odd way, and we must extend one of the file
 // descriptor classes to add custom behavior.
 
+// The interface shared by the event loop backends (Epoll and Ring). Event
+// masks always use the EPOLL* constants, regardless of the backend, so code
+// written against an EventLoop doesn't need to know which one it's running on.
+class EventLoop {
+  protected:
+    LoopStats loop_stats;
+
+  public:
+    virtual void add_item(std::shared_ptr<AbstractFileDes> item,
+                          uint32_t events) = 0;
+    virtual void delete_item(AbstractFileDes &item) = 0;
+    virtual void set_events(AbstractFileDes &item, int events) = 0;
+    virtual void set_events(int item_fd, int events) = 0;
+    virtual void wait(int timeout) = 0;
+    virtual ~EventLoop() = default;
+
+    // Wakeups, handler timings and so on. See stats.hpp.
+    const LoopStats &stats() const { return loop_stats; }
+};
+
 // A simplified Epoll wrapper. It uses a file descriptor wrapper class that has
 // a get_fd() method. It doesn't support modification of the existing fds
 // stored.
-class Epoll : public FileDes<Epoll> {
+class Epoll : public FileDes<Epoll>, public EventLoop {
     int fd = -1;
+    struct Entry {
+        std::shared_ptr<AbstractFileDes> item;
+        unsigned kind; // for the stats.
+    };
     // the lut contains a bunch of weak_ptrs to the wrappers.
-    std::map<int, std::shared_ptr<AbstractFileDes>> lut;
+    std::map<int, Entry> lut;
 
     // A response from wait(). It just has a pointer to the
     // original instance as well as the events that have happened
@@ -75,7 +100,8 @@ class Epoll : public FileDes<Epoll> {
         ::close(fd);
     };
 
-    void add_item(std::shared_ptr<AbstractFileDes> item, uint32_t events) {
+    void add_item(std::shared_ptr<AbstractFileDes> item,
+                  uint32_t events) override {
         int item_fd =
             item->get_fd(); // this is where the next addition will go.
         epoll_event ev;
@@ -86,8 +112,9 @@ class Epoll : public FileDes<Epoll> {
             throw std::system_error(errno, std::generic_category(),
                                     "epoll_ctl() failed");
         }
+        bump(loop_stats.ctl_add);
         // it didn't fail, so we add our new guy to the lut.
-        lut.emplace(item_fd, item);
+        lut.emplace(item_fd, Entry{item, loop_stats.kind_of(*item)});
     };
 
     // same as add_item, but for a vector of items. uses the same events list
@@ -104,31 +131,54 @@ class Epoll : public FileDes<Epoll> {
     // Will return a list of structs containing a pointer to the original
     // object, as well as the event that occured. See Epoll::event_result for
     // more details.
-    void wait(int timeout) {
+    void wait(int timeout) override {
         std::array<struct epoll_event, 100>
             events; // We can change this value later, but I doubt it will be
                     // needed.
+        auto before = LoopStats::clock::now();
         int nevents = epoll_wait(fd, events.data(), 100, timeout);
 
+        if (nevents == -1 && errno == EINTR) {
+            // a signal (or io_uring task work, once the process has made a
+            // ring, even one that's gone again). Nothing happened, come back.
+            return;
+        }
         if (nevents == -1) {
             throw std::system_error(errno, std::generic_category(),
                                     "epoll_wait() failed");
         }
+        auto woke = LoopStats::clock::now();
+        loop_stats.record_wakeup(LoopStats::since(before, woke), nevents);
         // we have events! let's turn them into a list of event_results.
+        auto last = woke;
         for (int i = 0; i < nevents; i++) {
             auto evnt = events.at(i);
-            lut.at(evnt.data.fd)->handle(evnt.events);
+            auto it = lut.find(evnt.data.fd);
+            if (it == lut.end()) {
+                // an earlier handler in this batch deleted it.
+                continue;
+            }
+            Entry &entry = it->second;
+            // grab the kind first, the handler might delete the entry.
+            unsigned kind = entry.kind;
+            entry.item->handle(evnt.events);
+            auto now = LoopStats::clock::now();
+            loop_stats.record_handler(kind, evnt.data.fd,
+                                      LoopStats::since(last, now));
+            last = now;
         }
+        loop_stats.busy_ns.record(LoopStats::since(woke, last));
     }
     // TODO: Modify item? not sure how that'd work.
 
     // Removes an item from the epoll interest list. If it's already gone, it
     // won't throw an exeception.
-    void delete_item(AbstractFileDes &item) {
+    void delete_item(AbstractFileDes &item) override {
         // NOTE: we have to remove from epoll before clearing from lut, since
         // the lut removal might cause the fd wrapper to destruct, making the
         // fd invalid.
         int result = epoll_ctl(fd, EPOLL_CTL_DEL, item.get_fd(), nullptr);
+        bump(loop_stats.ctl_del);
 
         if (result == -1 &&
             errno != ENOENT) { // if there's no entry, we don't care.
@@ -138,16 +188,17 @@ class Epoll : public FileDes<Epoll> {
         lut.erase(item.get_fd());
     };
 
-    void set_events(AbstractFileDes &item, int events) {
+    void set_events(AbstractFileDes &item, int events) override {
 	    int item_fd = item.get_fd();
 	    set_events(item_fd, events);
     }
     // dangerous and bad don't do this.
-    void set_events(int item_fd, int events) {
+    void set_events(int item_fd, int events) override {
         epoll_event ev;
         ev.events = events;
         ev.data.fd = item_fd;
         int result = epoll_ctl(fd, EPOLL_CTL_MOD, item_fd, &ev);
+        bump(loop_stats.ctl_mod);
         if (result == -1) {
             throw std::system_error(errno, std::generic_category(),
                                     "epoll_ctl() failed");
@@ -0,0 +1,753 @@
+#include "ring.hpp"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+namespace polly {
+
+// glibc doesn't wrap the io_uring syscalls, so we do it ourselves.
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void *arg, std::size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Ring::Ring(unsigned entries, unsigned buf_count, unsigned buf_size)
+    : buf_count(buf_count), buf_size(buf_size) {
+    if (buf_count == 0 || (buf_count & (buf_count - 1)) != 0 ||
+        buf_count > 32768) {
+        throw std::invalid_argument("buf_count must be a power of two");
+    }
+    io_uring_params params = {};
+    fd = io_uring_setup(entries, &params);
+    if (fd == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "io_uring_setup() failed");
+    }
+    // single mmap (5.4), no dropped completions (5.5) and timeouts passed to
+    // io_uring_enter (5.11).
+    constexpr unsigned required =
+        IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        unmap();
+        throw std::system_error(ENOSYS, std::generic_category(),
+                                "io_uring is missing required features");
+    }
+
+    std::size_t sq_len =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    std::size_t cq_len =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring_len = std::max(sq_len, cq_len);
+    ring_mem = mmap(nullptr, ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring_mem == MAP_FAILED) {
+        ring_mem = nullptr;
+        int err = errno;
+        unmap();
+        throw std::system_error(err, std::generic_category(),
+                                "mmap() failed");
+    }
+    sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqe_mem = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqe_mem == MAP_FAILED) {
+        int err = errno;
+        unmap();
+        throw std::system_error(err, std::generic_category(),
+                                "mmap() failed");
+    }
+    sqes = static_cast<io_uring_sqe *>(sqe_mem);
+
+    auto *base = static_cast<char *>(ring_mem);
+    sq_head = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+    // we always fill sqes in order, so the index array is just identity.
+    for (unsigned i = 0; i < sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    // set up the provided buffer ring (5.19).
+    buf_ring_len = buf_count * sizeof(io_uring_buf);
+    void *br_mem = mmap(nullptr, buf_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br_mem == MAP_FAILED) {
+        int err = errno;
+        unmap();
+        throw std::system_error(err, std::generic_category(),
+                                "mmap() failed");
+    }
+    buf_ring = static_cast<io_uring_buf *>(br_mem);
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring);
+    reg.ring_entries = buf_count;
+    reg.bgid = buf_group;
+    if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        int err = errno;
+        munmap(buf_ring, buf_ring_len);
+        buf_ring = nullptr;
+        unmap();
+        throw std::system_error(err, std::generic_category(),
+                                "io_uring_register() failed");
+    }
+    buffers.resize(std::size_t(buf_count) * buf_size);
+    for (unsigned i = 0; i < buf_count; i++) {
+        recycle(i);
+    }
+    try {
+        probe();
+    } catch (std::system_error &e) {
+        unmap();
+        throw;
+    }
+}
+
+// The feature flags don't cover everything. Which opcodes there are can be
+// asked (IORING_REGISTER_PROBE, 5.6), but multishot recv (6.0) is only a flag
+// on IORING_OP_RECV, and a kernel without it doesn't say so until a recv
+// using it fails with EINVAL. By then every connection would be getting
+// closed, so try one here, on a socketpair with a byte waiting in it. The
+// same goes for updating a poll's events (IORING_POLL_UPDATE_EVENTS, 5.13),
+// which set_events() relies on: it's a flag on IORING_OP_POLL_REMOVE.
+void Ring::probe() {
+    std::vector<std::uint8_t> mem(sizeof(io_uring_probe) +
+                                  256 * sizeof(io_uring_probe_op));
+    auto *p = reinterpret_cast<io_uring_probe *>(mem.data());
+    if (io_uring_register(fd, IORING_REGISTER_PROBE, p, 256) == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "io_uring_register() failed");
+    }
+    for (std::uint8_t op : {IORING_OP_POLL_ADD, IORING_OP_ACCEPT,
+                            IORING_OP_RECV, IORING_OP_SEND,
+                            IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL}) {
+        if (op > p->last_op || !(p->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            throw std::system_error(ENOSYS, std::generic_category(),
+                                    "io_uring is missing an operation");
+        }
+    }
+
+    int pair[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "socketpair() failed");
+    }
+    auto next_cqe = [this] {
+        while (*cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            enter(1, nullptr);
+        }
+        io_uring_cqe cqe = cqes[*cq_head & *cq_mask];
+        __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        return cqe;
+    };
+    int err = 0;
+    const char *what = "poll update";
+    try {
+        // a poll for input that isn't coming, updated to output, which is
+        // ready straight away. If the update fails, the poll is still there
+        // and has to be cancelled before we carry on.
+        std::uint64_t poll = make_data(OP_POLL, 0, 0);
+        std::uint64_t update = make_data(OP_IGNORE, 0, 1);
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = pair[0];
+        sqe->poll32_events = EPOLLIN;
+        sqe->user_data = poll;
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = poll;
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+        sqe->poll32_events = EPOLLOUT;
+        sqe->user_data = update;
+        for (int left = 2; left > 0; left--) {
+            io_uring_cqe cqe = next_cqe();
+            if (cqe.user_data == update && cqe.res < 0) {
+                err = -cqe.res;
+                cancel(poll);
+                left++; // the cancel's own completion.
+            }
+        }
+        if (err != 0) {
+            throw std::system_error(err, std::generic_category(),
+                                    "poll update failed");
+        }
+
+        what = "multishot recv";
+        if (::send(pair[1], "x", 1, MSG_NOSIGNAL) == -1) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "send() failed");
+        }
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = pair[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buf_group;
+        sqe->user_data = make_data(OP_IGNORE, 0, 0);
+        io_uring_cqe cqe = next_cqe();
+        if (cqe.res < 0) {
+            err = -cqe.res;
+        } else if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            err = ENOSYS; // took the byte, but didn't stay armed.
+        } else {
+            // hanging up ends it. Wait for that, so nothing's left over
+            // pointing at the socketpair.
+            ::close(pair[1]);
+            pair[1] = -1;
+            while (next_cqe().flags & IORING_CQE_F_MORE) {
+            }
+        }
+    } catch (std::system_error &e) {
+        err = e.code().value();
+    }
+    ::close(pair[0]);
+    if (pair[1] != -1) {
+        ::close(pair[1]);
+    }
+    if (err != 0) {
+        throw std::system_error(err, std::generic_category(),
+                                std::string("io_uring ") + what +
+                                    " isn't supported");
+    }
+}
+
+Ring::~Ring() { close(); }
+
+void Ring::unmap() {
+    if (buf_ring != nullptr) {
+        munmap(buf_ring, buf_ring_len);
+        buf_ring = nullptr;
+    }
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_len);
+        sqes = nullptr;
+    }
+    if (ring_mem != nullptr) {
+        munmap(ring_mem, ring_len);
+        ring_mem = nullptr;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+// closing the ring fd cancels everything in flight, so it's safe to drop the
+// buffers and our bookkeeping afterwards.
+void Ring::close() {
+    unmap();
+    lut.clear();
+    reaped = {};
+    orphans.clear();
+}
+
+io_uring_sqe *Ring::get_sqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sq_local_tail - head >= sq_entries) {
+        // queue is full, push what we have to the kernel first.
+        enter(0, nullptr);
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sq_local_tail - head >= sq_entries) {
+            throw std::system_error(EBUSY, std::generic_category(),
+                                    "io_uring submission queue full");
+        }
+    }
+    io_uring_sqe *sqe = &sqes[sq_local_tail & *sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_local_tail++;
+    return sqe;
+}
+
+int Ring::enter(unsigned min_complete, __kernel_timespec *ts) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit =
+        sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+    unsigned flags = 0;
+    io_uring_getevents_arg arg = {};
+    void *argp = nullptr;
+    std::size_t argsz = 0;
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (ts != nullptr) {
+        arg.ts = reinterpret_cast<std::uint64_t>(ts);
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    int result =
+        io_uring_enter(fd, to_submit, min_complete, flags, argp, argsz);
+    if (result == -1 && errno != ETIME && errno != EBUSY) {
+        throw std::system_error(errno, std::generic_category(),
+                                "io_uring_enter() failed");
+    }
+    return result;
+}
+
+void Ring::recycle(std::uint16_t bid) {
+    unsigned mask = buf_count - 1;
+    io_uring_buf &buf = buf_ring[buf_tail & mask];
+    buf.addr = reinterpret_cast<std::uint64_t>(buffers.data() +
+                                               std::size_t(bid) * buf_size);
+    buf.len = buf_size;
+    buf.bid = bid;
+    buf_tail++;
+    // the tail lives in the reserved field of the first buffer.
+    __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+}
+
+Ring::Entry &Ring::register_item(std::shared_ptr<AbstractFileDes> item) {
+    int item_fd = item->get_fd();
+    auto it = lut.find(item_fd);
+    if (it != lut.end() && it->second.dead) {
+        // deleted from inside its own handler, and the fd's been closed and
+        // reused since. The handler's still running, so take the entry out
+        // without destroying it; wait() frees it once the handler returns.
+        reaped = lut.extract(it);
+        it = lut.end();
+    }
+    if (it != lut.end()) {
+        return it->second;
+    }
+    Entry &e = lut[item_fd];
+    e.item = item;
+    e.gen = next_gen++;
+    e.kind = loop_stats.kind_of(*item);
+    bump(loop_stats.ctl_add);
+    return e;
+}
+
+void Ring::arm_poll(int item_fd, Entry &e) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = item_fd;
+    sqe->poll32_events = e.events;
+    sqe->user_data = make_data(OP_POLL, e.gen, item_fd);
+    e.poll_armed = true;
+}
+
+void Ring::arm_accept(int item_fd, Entry &e) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = item_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_data(OP_ACCEPT, e.gen, item_fd);
+    e.accept_armed = true;
+}
+
+void Ring::arm_recv(int item_fd, Entry &e) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = item_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buf_group;
+    sqe->user_data = make_data(OP_RECV, e.gen, item_fd);
+    e.recv_armed = true;
+}
+
+void Ring::arm_send(int item_fd, Entry &e) {
+    PendingSend &ps = e.sends.front();
+    io_uring_sqe *sqe = get_sqe();
+    sqe->fd = item_fd;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_data(OP_SEND, e.gen, item_fd);
+    if (ps.offset < ps.head_size && !ps.body->empty()) {
+        // some of the head and all of the body.
+        ps.iov[0] = {ps.head.data() + ps.offset, ps.head_size - ps.offset};
+        ps.iov[1] = {const_cast<std::uint8_t *>(ps.body->data()),
+                     ps.body->size()};
+        ps.msg = {};
+        ps.msg.msg_iov = ps.iov;
+        ps.msg.msg_iovlen = 2;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = reinterpret_cast<std::uint64_t>(&ps.msg);
+        sqe->len = 1;
+    } else if (ps.offset < ps.head_size) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = reinterpret_cast<std::uint64_t>(ps.head.data() + ps.offset);
+        sqe->len = ps.head_size - ps.offset;
+    } else {
+        std::size_t at = ps.offset - ps.head_size;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = reinterpret_cast<std::uint64_t>(ps.body->data() + at);
+        sqe->len = ps.body->size() - at;
+    }
+    e.send_armed = true;
+}
+
+void Ring::cancel(std::uint64_t user_data) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->user_data = make_data(OP_IGNORE, 0, 0);
+}
+
+void Ring::add_item(std::shared_ptr<AbstractFileDes> item, uint32_t events) {
+    int item_fd = item->get_fd();
+    auto it = lut.find(item_fd);
+    if (it != lut.end() && !it->second.dead) {
+        throw std::system_error(EEXIST, std::generic_category(),
+                                "Ring::add_item() failed");
+    }
+    Entry &e = register_item(item);
+    e.events = events;
+    if (events != 0) {
+        arm_poll(item_fd, e);
+    }
+}
+
+void Ring::delete_item(AbstractFileDes &item) {
+    int item_fd = item.get_fd();
+    auto it = lut.find(item_fd);
+    if (it == lut.end() || it->second.dead) {
+        return; // already gone, same as epoll.
+    }
+    Entry &e = it->second;
+    bump(loop_stats.ctl_del);
+    if (e.poll_armed) {
+        cancel(make_data(OP_POLL, e.gen, item_fd));
+    }
+    if (e.accept_armed) {
+        cancel(make_data(OP_ACCEPT, e.gen, item_fd));
+    }
+    if (e.recv_armed) {
+        cancel(make_data(OP_RECV, e.gen, item_fd));
+    }
+    if (e.send_armed) {
+        auto user_data = make_data(OP_SEND, e.gen, item_fd);
+        cancel(user_data);
+        orphans[user_data] = std::move(e.sends);
+    }
+    // the cancellations have to reach the kernel before the fd is closed and
+    // its number gets reused, so submit them right away.
+    enter(0, nullptr);
+    if (item_fd == dispatching_fd && reaped.empty()) {
+        e.dead = true;
+        e.poll_armed = e.accept_armed = e.recv_armed = e.send_armed = false;
+        e.events = 0;
+        return;
+    }
+    lut.erase(it);
+}
+
+void Ring::set_events(AbstractFileDes &item, int events) {
+    set_events(item.get_fd(), events);
+}
+
+void Ring::set_events(int item_fd, int events) {
+    auto it = lut.find(item_fd);
+    if (it == lut.end()) {
+        throw std::system_error(ENOENT, std::generic_category(),
+                                "Ring::set_events() failed");
+    }
+    Entry &e = it->second;
+    e.events = events;
+    bump(loop_stats.ctl_mod);
+    if (!e.poll_armed) {
+        if (events != 0) {
+            arm_poll(item_fd, e);
+        }
+        return;
+    }
+    // update the mask of the poll already in flight. If it has fired in the
+    // meantime the update fails harmlessly, and the completion gets masked
+    // and re-armed with the new events in dispatch().
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = make_data(OP_POLL, e.gen, item_fd);
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = events;
+    sqe->user_data = make_data(OP_IGNORE, 0, 0);
+}
+
+void Ring::accept_multishot(std::shared_ptr<AbstractFileDes> listener,
+                            accept_handler_t handler) {
+    int item_fd = listener->get_fd();
+    Entry &e = register_item(listener);
+    e.on_accept = handler;
+    if (!e.accept_armed) {
+        arm_accept(item_fd, e);
+    }
+}
+
+void Ring::recv_multishot(std::shared_ptr<AbstractFileDes> item,
+                          recv_handler_t handler) {
+    int item_fd = item->get_fd();
+    Entry &e = register_item(item);
+    e.on_recv = handler;
+    if (!e.recv_armed) {
+        arm_recv(item_fd, e);
+    }
+}
+
+void Ring::pause_recv(int item_fd) {
+    auto it = lut.find(item_fd);
+    if (it == lut.end() || it->second.dead || it->second.recv_paused) {
+        return;
+    }
+    Entry &e = it->second;
+    e.recv_paused = true;
+    if (e.recv_armed) {
+        cancel(make_data(OP_RECV, e.gen, item_fd));
+    }
+}
+
+void Ring::resume_recv(int item_fd) {
+    auto it = lut.find(item_fd);
+    if (it == lut.end() || it->second.dead || !it->second.recv_paused) {
+        return;
+    }
+    Entry &e = it->second;
+    e.recv_paused = false;
+    // if the cancel hasn't come back yet, it gets re-armed when it does.
+    if (!e.recv_armed) {
+        arm_recv(item_fd, e);
+    }
+}
+
+void Ring::send(int item_fd, Bytes body, std::span<const std::uint8_t> head) {
+    auto it = lut.find(item_fd);
+    if (it == lut.end()) {
+        throw std::system_error(ENOENT, std::generic_category(),
+                                "Ring::send() failed");
+    }
+    if (head.size() > max_head) {
+        throw std::system_error(EINVAL, std::generic_category(),
+                                "Ring::send() failed");
+    }
+    if (head.empty() && body->empty()) {
+        return;
+    }
+    Entry &e = it->second;
+    PendingSend &ps = e.sends.emplace_back();
+    std::copy(head.begin(), head.end(), ps.head.begin());
+    ps.head_size = head.size();
+    ps.body = std::move(body);
+    e.unsent += ps.size();
+    if (!e.send_armed) {
+        arm_send(item_fd, e);
+    }
+}
+
+std::size_t Ring::unsent(int item_fd) const {
+    auto it = lut.find(item_fd);
+    return it == lut.end() ? 0 : it->second.unsent;
+}
+
+void Ring::on_sent(int item_fd, sent_handler_t handler) {
+    auto it = lut.find(item_fd);
+    if (it == lut.end()) {
+        throw std::system_error(ENOENT, std::generic_category(),
+                                "Ring::on_sent() failed");
+    }
+    it->second.on_sent = std::move(handler);
+}
+
+void Ring::wait(int timeout) {
+    __kernel_timespec ts = {};
+    __kernel_timespec *tsp = nullptr;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    // don't block if there are completions we haven't looked at yet.
+    unsigned head = *cq_head;
+    bool ready = head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    auto before = LoopStats::clock::now();
+    enter(ready ? 0 : 1, tsp);
+    auto woke = LoopStats::clock::now();
+
+    auto last = woke;
+    std::uint64_t n = 0;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe cqe = cqes[head & *cq_mask];
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        n++;
+        int item_fd = std::int32_t(cqe.user_data & 0xFFFFFFFF);
+        // map iterators survive other entries coming and going, and this
+        // one can't be erased while it's dispatching. It can be extracted
+        // into reaped if the fd gets reused, which keeps the entry itself
+        // where it is.
+        auto it = lut.find(item_fd);
+        Entry *e = it == lut.end() ? nullptr : &it->second;
+        dispatching_fd = item_fd;
+        dispatch(cqe);
+        dispatching_fd = -1;
+        auto now = LoopStats::clock::now();
+        if (e == nullptr) {
+            last = now;
+            continue;
+        }
+        if ((cqe.user_data >> 56) != OP_IGNORE) {
+            loop_stats.record_handler(e->kind, item_fd,
+                                      LoopStats::since(last, now));
+        }
+        last = now;
+        if (!reaped.empty()) {
+            reaped = {};
+        } else if (e->dead) {
+            lut.erase(it);
+        }
+    }
+    loop_stats.record_wakeup(LoopStats::since(before, woke), n);
+    loop_stats.busy_ns.record(LoopStats::since(woke, last));
+}
+
+void Ring::dispatch(const io_uring_cqe &cqe) {
+    auto op = static_cast<op_t>(cqe.user_data >> 56);
+    auto gen = std::uint32_t(cqe.user_data >> 32) & 0xFFFFFF;
+    int item_fd = std::int32_t(cqe.user_data & 0xFFFFFFFF);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    auto it = lut.find(item_fd);
+    bool stale = op == OP_IGNORE || it == lut.end() || it->second.dead ||
+                 (it->second.gen & 0xFFFFFF) != gen;
+    // re-fetches the entry after running a handler, which might have
+    // deleted it.
+    auto current = [&]() -> Entry * {
+        auto i = lut.find(item_fd);
+        if (i == lut.end() || i->second.dead ||
+            (i->second.gen & 0xFFFFFF) != gen) {
+            return nullptr;
+        }
+        return &i->second;
+    };
+
+    switch (op) {
+    case OP_IGNORE:
+        return;
+    case OP_POLL: {
+        if (stale) {
+            return;
+        }
+        Entry &e = it->second;
+        e.poll_armed = false;
+        // the mask might have changed since the poll was armed.
+        std::uint32_t events =
+            cqe.res < 0 ? EPOLLERR
+                        : cqe.res & (e.events | EPOLLERR | EPOLLHUP);
+        if (events != 0) {
+            e.item->handle(events);
+        }
+        Entry *after = current();
+        if (after && !after->poll_armed && after->events != 0) {
+            arm_poll(item_fd, *after);
+        }
+        return;
+    }
+    case OP_ACCEPT: {
+        if (stale) {
+            if (cqe.res >= 0) {
+                ::close(cqe.res); // nobody is listening anymore.
+            }
+            return;
+        }
+        Entry &e = it->second;
+        if (!more) {
+            e.accept_armed = false;
+        }
+        e.on_accept(cqe.res);
+        Entry *after = current();
+        bool transient = cqe.res >= 0 || cqe.res == -EINTR ||
+                         cqe.res == -ECONNABORTED;
+        if (after && !after->accept_armed && transient) {
+            arm_accept(item_fd, *after);
+        }
+        return;
+    }
+    case OP_RECV: {
+        int bid = -1;
+        std::span<const std::uint8_t> view;
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0) {
+                view = std::span<const std::uint8_t>(
+                    buffers.data() + std::size_t(bid) * buf_size, cqe.res);
+            }
+        }
+        if (!stale) {
+            Entry &e = it->second;
+            if (!more) {
+                e.recv_armed = false;
+            }
+            // ENOBUFS just means we ran out of buffers for a moment, the
+            // request is re-armed below. ECANCELED is pause_recv().
+            if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+                e.on_recv(cqe.res, view);
+            }
+        }
+        if (bid >= 0) {
+            recycle(bid);
+        }
+        if (!stale && !more &&
+            (cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED)) {
+            Entry *after = current();
+            if (after && !after->recv_armed && !after->recv_paused) {
+                arm_recv(item_fd, *after);
+            }
+        }
+        return;
+    }
+    case OP_SEND: {
+        if (stale) {
+            orphans.erase(cqe.user_data);
+            return;
+        }
+        Entry &e = it->second;
+        e.send_armed = false;
+        if (cqe.res == -EAGAIN || cqe.res == -EINTR) {
+            // nothing went out, try again.
+        } else if (cqe.res < 0) {
+            // the connection is broken. The receive side will find out and
+            // clean up, so just drop whatever is left.
+            e.sends.clear();
+            e.unsent = 0;
+        } else {
+            PendingSend &ps = e.sends.front();
+            ps.offset += cqe.res;
+            e.unsent -= cqe.res;
+            if (ps.offset >= ps.size()) {
+                e.sends.pop_front();
+            }
+        }
+        if (!e.sends.empty()) {
+            arm_send(item_fd, e);
+        }
+        if (e.on_sent) {
+            e.on_sent(e.unsent);
+        }
+        return;
+    }
+    }
+}
+
+} // namespace polly
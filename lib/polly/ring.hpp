@@ -0,0 +1,205 @@
+// ring.hpp - io_uring backed event loop for polly.
+// (c) Saji Champlin 2022
+#pragma once
+#include "polly.hpp"
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <linux/io_uring.h>
+#include <map>
+#include <memory>
+#include <span>
+#include <sys/socket.h>
+#include <vector>
+namespace polly {
+
+// Ring is a completion-based alternative to Epoll, built on io_uring. It
+// implements the same EventLoop interface so that every existing handler keeps
+// working: readiness is emulated with oneshot poll requests that get re-armed
+// after each dispatch (which gives us level-triggered behavior, just like the
+// default epoll mode). The difference is that re-arms, event mask changes and
+// sends are only queued, and the whole batch goes to the kernel with a single
+// io_uring_enter() at the top of the next wait(). Toggling EPOLLOUT no longer
+// costs an epoll_ctl() syscall every time.
+//
+// On top of that, there are completion-based operations that skip readiness
+// altogether:
+//   - accept_multishot(): one request that keeps accepting connections.
+//   - recv_multishot(): one request that keeps receiving into a ring of
+//     buffers provided by us, so there's no recv() per read.
+//   - send(): queued sends, submitted in batches with everything else.
+//
+// Note that io_uring takes O_NONBLOCK to mean "fail with EAGAIN instead of
+// waiting", so descriptors used with the completion-based operations should
+// be left in blocking mode. The ring never blocks on them either way.
+//
+// These need a fairly new kernel (6.0+). If anything we depend on is missing,
+// the constructor throws std::system_error so the caller can fall back to
+// Epoll.
+class Ring : public FileDes<Ring>, public EventLoop {
+  public:
+    // called with the new connection's fd, or -errno.
+    using accept_handler_t = std::function<void(int)>;
+    // called with the result of a receive, and a view of the received bytes.
+    // A result of 0 means the peer closed the connection, and a negative
+    // result is -errno. The view is only valid during the call, since the
+    // buffer is handed back to the kernel afterwards.
+    using recv_handler_t =
+        std::function<void(int, std::span<const std::uint8_t>)>;
+    // called each time a send finishes, with how many bytes are still queued
+    // on the fd.
+    using sent_handler_t = std::function<void(std::size_t)>;
+    // what send() sends. Shared, so the same bytes can go to many fds.
+    using Bytes = std::shared_ptr<const std::vector<std::uint8_t>>;
+    static constexpr std::size_t max_head = 16;
+
+  private:
+    // which operation a completion belongs to. Stored in the top byte of the
+    // user_data.
+    enum op_t : std::uint8_t {
+        OP_IGNORE = 0,
+        OP_POLL,
+        OP_ACCEPT,
+        OP_RECV,
+        OP_SEND,
+    };
+
+    // one send(). head is copied in here, body is whoever's.
+    struct PendingSend {
+        std::array<std::uint8_t, max_head> head;
+        std::size_t head_size = 0;
+        Bytes body;
+        std::size_t offset = 0; // into head, then body.
+        // for sending what's left of both in one go. The kernel reads these
+        // when the send starts, so they're here rather than on the stack.
+        iovec iov[2];
+        msghdr msg;
+        std::size_t size() const { return head_size + body->size(); }
+    };
+
+    // everything we know about a registered file descriptor.
+    struct Entry {
+        std::shared_ptr<AbstractFileDes> item;
+        // used to tell completions for a closed fd apart from the ones for
+        // a new fd that reused the same number.
+        std::uint32_t gen = 0;
+        unsigned kind = 0; // for the stats.
+        std::uint32_t events = 0; // readiness interest, 0 if none.
+        bool poll_armed = false;
+        accept_handler_t on_accept;
+        bool accept_armed = false;
+        recv_handler_t on_recv;
+        bool recv_armed = false;
+        bool recv_paused = false;
+        std::deque<PendingSend> sends;
+        std::size_t unsent = 0; // bytes left in sends.
+        bool send_armed = false;
+        sent_handler_t on_sent;
+        // deleted from inside one of its own handlers. It's erased once the
+        // handler returns so it doesn't destroy itself mid-call.
+        bool dead = false;
+    };
+
+    std::map<int, Entry> lut;
+    int dispatching_fd = -1;
+    // the dispatching entry, once it's dead and its fd has been reused.
+    std::map<int, Entry>::node_type reaped;
+    // send buffers the kernel may still be reading from after their entry
+    // was deleted. Freed when the (cancelled) completion arrives.
+    std::map<std::uint64_t, std::deque<PendingSend>> orphans;
+    std::uint32_t next_gen = 1;
+
+    // submission/completion queue state. See io_uring(7).
+    void *ring_mem = nullptr;
+    std::size_t ring_len = 0;
+    io_uring_sqe *sqes = nullptr;
+    std::size_t sqes_len = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+
+    // provided buffer ring for multishot recv. This is really an
+    // io_uring_buf_ring, but the kernel header's flexible array member ends up
+    // at the wrong offset when compiled as C++, so we index it by hand.
+    static constexpr std::uint16_t buf_group = 0;
+    io_uring_buf *buf_ring = nullptr;
+    std::size_t buf_ring_len = 0;
+    unsigned buf_count;
+    unsigned buf_size;
+    std::uint16_t buf_tail = 0;
+    std::vector<std::uint8_t> buffers;
+
+    static std::uint64_t make_data(op_t op, std::uint32_t gen, int fd) {
+        return (std::uint64_t(op) << 56) |
+               (std::uint64_t(gen & 0xFFFFFF) << 32) | std::uint32_t(fd);
+    }
+
+    void unmap();
+    // check that the kernel can do everything we're going to ask of it.
+    void probe();
+    io_uring_sqe *get_sqe();
+    // submit everything that is queued. If min_complete is set, also wait for
+    // that many completions (or until ts expires).
+    int enter(unsigned min_complete, __kernel_timespec *ts);
+    void dispatch(const io_uring_cqe &cqe);
+    void recycle(std::uint16_t bid);
+
+    void arm_poll(int fd, Entry &e);
+    void arm_accept(int fd, Entry &e);
+    void arm_recv(int fd, Entry &e);
+    void arm_send(int fd, Entry &e);
+    void cancel(std::uint64_t user_data);
+    Entry &register_item(std::shared_ptr<AbstractFileDes> item);
+
+  public:
+    // entries is the submission queue size. buf_count (a power of two) and
+    // buf_size set up the buffers that multishot receives land in.
+    Ring(unsigned entries = 256, unsigned buf_count = 256,
+         unsigned buf_size = 16384);
+    Ring(const Ring &other) = delete;
+    ~Ring();
+
+    void close() override;
+
+    void add_item(std::shared_ptr<AbstractFileDes> item,
+                  uint32_t events) override;
+    void delete_item(AbstractFileDes &item) override;
+    void set_events(AbstractFileDes &item, int events) override;
+    void set_events(int item_fd, int events) override;
+    void wait(int timeout) override;
+
+    // keep accepting connections on a listening socket until it is deleted.
+    // The listener is registered with the Ring if it isn't already.
+    void accept_multishot(std::shared_ptr<AbstractFileDes> listener,
+                          accept_handler_t handler);
+
+    // keep receiving from a connected socket until EOF, an error, or it is
+    // deleted. The socket is registered with the Ring if it isn't already.
+    void recv_multishot(std::shared_ptr<AbstractFileDes> item,
+                        recv_handler_t handler);
+
+    // stop (and start again) a recv_multishot(), e.g while the other end is
+    // sending faster than we want to read. A few receives that were already
+    // on their way can still arrive after pausing, but no more after that,
+    // and the kernel holds on to the rest like it would for a socket nobody
+    // reads.
+    void pause_recv(int item_fd);
+    void resume_recv(int item_fd);
+
+    // queue head (at most max_head bytes, e.g a frame header) and then body
+    // to be sent on a registered fd. body isn't copied, so it mustn't change
+    // until it's out. Sends to the same fd go out in order, and partial sends
+    // are resumed automatically.
+    void send(int item_fd, Bytes body, std::span<const std::uint8_t> head = {});
+    // bytes queued on an fd that haven't been sent yet. Nothing stops them
+    // piling up, so whoever's sending should keep an eye on it.
+    std::size_t unsent(int item_fd) const;
+    // have handler called every time one of item_fd's sends finishes, e.g to
+    // queue more once it's caught up.
+    void on_sent(int item_fd, sent_handler_t handler);
+};
+
+} // namespace polly
@@ -0,0 +1,39 @@
+#include "signal.hpp"
+#include <system_error>
+#include <unistd.h>
+namespace polly {
+
+Signal::Signal(std::initializer_list<int> signals, int flags) {
+    sigemptyset(&mask);
+    for (int sig : signals) {
+        sigaddset(&mask, sig);
+    }
+    // the signals have to be blocked, otherwise they get delivered the
+    // normal way and never show up on the fd.
+    int result = sigprocmask(SIG_BLOCK, &mask, nullptr);
+    if (result == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "sigprocmask() failed");
+    }
+
+    fd = signalfd(-1, &mask, flags);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(),
+                                "signalfd() failed");
+}
+
+std::optional<struct signalfd_siginfo> Signal::read() {
+    struct signalfd_siginfo info = {};
+    int result = ::read(fd, &info, sizeof(info));
+
+    if (result == -1 && errno == EAGAIN) {
+        return std::nullopt;
+    }
+    if (result == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "read() failed");
+    }
+    return info;
+}
+
+} // namespace polly
@@ -3,11 +3,34 @@
 
 #pragma once
 #include "filedes.hpp"
+#include <initializer_list>
+#include <optional>
+#include <signal.h>
 #include <sys/signalfd.h>
 
 namespace polly {
 
+// Signal turns signal delivery into ordinary epoll events. The signals it
+// watches are blocked for the calling thread (and any threads it creates
+// afterwards), so instead of interrupting whatever we're doing they queue up
+// on the descriptor until the handler reads them. That also means epoll_wait
+// never fails with EINTR because of them.
+//
+// Create it in main() before starting any threads, since the mask is
+// inherited.
 class Signal : public FileDes<Signal> {
+    sigset_t mask;
 
+  public:
+    Signal(std::initializer_list<int> signals,
+           int flags = SFD_NONBLOCK | SFD_CLOEXEC);
+    // keep our copy ctor and move ctor (assignment is inherited)
+    Signal(const Signal &other) : FileDes(other), mask(other.mask){};
+
+    Signal(Signal &&other) : FileDes(other), mask(other.mask){};
+
+    // returns the next pending signal, or nothing if there isn't one (only
+    // possible for a non-blocking Signal).
+    std::optional<struct signalfd_siginfo> read();
 };
 } // namespace polly
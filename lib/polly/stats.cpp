@@ -0,0 +1,133 @@
+#include "stats.hpp"
+#include "filedes.hpp"
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <typeinfo>
+namespace polly {
+
+unsigned Histogram::bucket(std::uint64_t value) {
+    if (value < sub_count) {
+        return value; // small values get a bucket each.
+    }
+    unsigned msb = 63 - std::countl_zero(value);
+    unsigned sub = (value >> (msb - sub_bits)) & (sub_count - 1);
+    return (msb - sub_bits + 1) * sub_count + sub;
+}
+
+std::uint64_t Histogram::lowest(unsigned bucket) {
+    if (bucket < sub_count) {
+        return bucket;
+    }
+    unsigned msb = bucket / sub_count + sub_bits - 1;
+    std::uint64_t sub = bucket % sub_count;
+    return (sub_count + sub) << (msb - sub_bits);
+}
+
+std::uint64_t Histogram::highest(unsigned bucket) {
+    if (bucket + 1 >= bucket_count) {
+        return UINT64_MAX;
+    }
+    return lowest(bucket + 1) - 1;
+}
+
+std::uint64_t Histogram::percentile(double p) const {
+    std::uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    // the rank of the sample we want, counting from 1.
+    std::uint64_t rank = std::uint64_t(p / 100.0 * double(n) + 0.5);
+    rank = std::max<std::uint64_t>(rank, 1);
+    std::uint64_t seen = 0;
+    for (unsigned b = 0; b < bucket_count; b++) {
+        seen += count_at(b);
+        if (seen >= rank) {
+            return std::min(highest(b), max());
+        }
+    }
+    return max();
+}
+
+unsigned LoopStats::kind_of(const AbstractFileDes &item) {
+    const char *mangled = typeid(item).name();
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(mangled, nullptr, nullptr, &status);
+    std::string name = status == 0 ? demangled : mangled;
+    std::free(demangled);
+
+    unsigned n = kind_count.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < n; i++) {
+        if (kinds[i].name == name) {
+            return i;
+        }
+    }
+    if (n == max_kinds) {
+        return max_kinds - 1;
+    }
+    kinds[n].name = name;
+    // publish the name before anyone can see the new kind.
+    kind_count.store(n + 1, std::memory_order_release);
+    return n;
+}
+
+// ns in a readable unit.
+static std::string duration(std::uint64_t ns) {
+    char buf[32];
+    if (ns < 1000) {
+        snprintf(buf, sizeof(buf), "%luns", (unsigned long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+static std::string spread(const Histogram &h, bool is_time) {
+    auto fmt = [is_time](std::uint64_t v) {
+        return is_time ? duration(v) : std::to_string(v);
+    };
+    return "p50 " + fmt(h.percentile(50)) + ", p90 " + fmt(h.percentile(90)) +
+           ", p99 " + fmt(h.percentile(99)) + ", max " + fmt(h.max());
+}
+
+std::string LoopStats::report() const {
+    std::uint64_t blocked = blocked_ns.sum();
+    std::uint64_t busy = busy_ns.sum();
+    double busy_pct =
+        blocked + busy == 0 ? 0.0 : 100.0 * double(busy) / double(blocked + busy);
+    char pct[16];
+    snprintf(pct, sizeof(pct), "%.2f%%", busy_pct);
+
+    std::string out;
+    out += "event loop: " + std::to_string(wakeups.load()) + " wakeups, " +
+           std::to_string(events.load()) + " events, blocked " +
+           duration(blocked) + ", in handlers " + duration(busy) + " (" +
+           pct + " busy)\n";
+    out += "  interest changes: " + std::to_string(ctl_add.load()) +
+           " add, " + std::to_string(ctl_mod.load()) + " mod, " +
+           std::to_string(ctl_del.load()) + " del\n";
+    out += "  events per wakeup: " + spread(events_per_wakeup, false) + "\n";
+    out += "  blocked per wakeup: " + spread(blocked_ns, true) + "\n";
+    out += "  handlers per wakeup: " + spread(busy_ns, true) + "\n";
+    out += "  each handler: " + spread(handler_ns, true) + "\n";
+    for (unsigned i = 0; i < kind_total(); i++) {
+        const KindStats &k = kinds[i];
+        std::uint64_t calls = k.calls.load();
+        if (calls == 0) {
+            continue;
+        }
+        out += "  " + k.name + ": " + std::to_string(calls) + " calls, avg " +
+               duration(k.total_ns.load() / calls) + ", slowest " +
+               duration(k.max_ns.load()) + " (fd " +
+               std::to_string(k.slowest_fd.load()) + ")\n";
+    }
+    out.pop_back(); // no trailing newline.
+    return out;
+}
+
+} // namespace polly
@@ -0,0 +1,158 @@
+// stats.hpp - event loop instrumentation for polly
+// (c) Saji Champlin 2022
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+namespace polly {
+
+class AbstractFileDes;
+
+// Everything in here is written by the thread running the event loop, and can
+// be read from anywhere (another thread, a signal handler callback, whatever)
+// without locks. Since there's only ever one writer, updates are a plain load
+// and store of a relaxed atomic rather than a locked read-modify-write, which
+// compiles down to the same instructions as a normal increment. A reader
+// might see a histogram that's one or two samples out of date, which is fine
+// for what it's for.
+
+// bump a single-writer counter.
+inline void bump(std::atomic<std::uint64_t> &counter, std::uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+// A log-linear histogram in the style of HdrHistogram. Every power of two
+// range is split into 16 equal buckets, so any value is stored with at most
+// ~6% error, and the whole 64 bit range fits in under a thousand counters. No
+// allocation, and recording a value is a couple of shifts and an add.
+class Histogram {
+    static constexpr unsigned sub_bits = 4;
+    static constexpr unsigned sub_count = 1 << sub_bits;
+
+  public:
+    static constexpr unsigned bucket_count = (64 - sub_bits + 1) * sub_count;
+
+  private:
+    std::array<std::atomic<std::uint64_t>, bucket_count> counts = {};
+    std::atomic<std::uint64_t> total = 0;
+    std::atomic<std::uint64_t> sum_ = 0;
+    std::atomic<std::uint64_t> max_ = 0;
+
+  public:
+    // which bucket a value lands in.
+    static unsigned bucket(std::uint64_t value);
+    // the smallest and largest value that land in a bucket.
+    static std::uint64_t lowest(unsigned bucket);
+    static std::uint64_t highest(unsigned bucket);
+
+    void record(std::uint64_t value) {
+        bump(counts[bucket(value)]);
+        bump(total);
+        bump(sum_, value);
+        if (value > max_.load(std::memory_order_relaxed)) {
+            max_.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    std::uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+    std::uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    std::uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    std::uint64_t count_at(unsigned bucket) const {
+        return counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    // the value below which p percent of the samples fall (rounded up to the
+    // top of its bucket). 0 if there are no samples.
+    std::uint64_t percentile(double p) const;
+};
+
+// Numbers about one kind of file descriptor (Socket, Timer, ...), so we can
+// tell which handlers are the expensive ones.
+struct KindStats {
+    std::string name;
+    std::atomic<std::uint64_t> calls = 0;
+    std::atomic<std::uint64_t> total_ns = 0;
+    std::atomic<std::uint64_t> max_ns = 0;
+    std::atomic<std::int64_t> slowest_fd = -1; // where max_ns happened.
+};
+
+// The instrumentation every EventLoop keeps about itself. Get at it with
+// EventLoop::stats(). It's always on; the cost is two clock reads per wakeup
+// plus one per handler call, which is tiny next to the syscalls around it.
+class LoopStats {
+  public:
+    using clock = std::chrono::steady_clock;
+    static constexpr unsigned max_kinds = 32;
+
+    std::atomic<std::uint64_t> wakeups = 0;
+    std::atomic<std::uint64_t> events = 0;
+    // interest list changes. On a Ring these are queued and ride along with
+    // the next submission instead of costing a syscall each.
+    std::atomic<std::uint64_t> ctl_add = 0;
+    std::atomic<std::uint64_t> ctl_mod = 0;
+    std::atomic<std::uint64_t> ctl_del = 0;
+
+    Histogram events_per_wakeup;
+    Histogram blocked_ns;  // time spent in the kernel waiting, per wakeup.
+    Histogram busy_ns;     // time spent running handlers, per wakeup.
+    Histogram handler_ns;  // time spent in each handler call.
+
+  private:
+    std::array<KindStats, max_kinds> kinds;
+    std::atomic<unsigned> kind_count = 0;
+
+  public:
+    static std::uint64_t since(clock::time_point start, clock::time_point end) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count();
+    }
+
+    // Find (or make) the kind for an item. Done once when it's registered
+    // with the loop, so the typeid lookup and demangling stay off the hot
+    // path. Kinds past max_kinds all get lumped into the last one.
+    unsigned kind_of(const AbstractFileDes &item);
+
+    const KindStats &kind(unsigned index) const { return kinds[index]; }
+    unsigned kind_total() const {
+        return kind_count.load(std::memory_order_acquire);
+    }
+
+    // a wakeup that blocked for blocked ns and returned n events.
+    void record_wakeup(std::uint64_t blocked, std::uint64_t n) {
+        bump(wakeups);
+        bump(events, n);
+        events_per_wakeup.record(n);
+        blocked_ns.record(blocked);
+    }
+
+    // one handler call for an item of kind on fd, which took ns.
+    void record_handler(unsigned kind, int fd, std::uint64_t ns) {
+        handler_ns.record(ns);
+        KindStats &k = kinds[kind];
+        bump(k.calls);
+        bump(k.total_ns, ns);
+        if (ns > k.max_ns.load(std::memory_order_relaxed)) {
+            k.max_ns.store(ns, std::memory_order_relaxed);
+            k.slowest_fd.store(fd, std::memory_order_relaxed);
+        }
+    }
+
+    // A human readable summary of everything, a few lines long (without a
+    // trailing newline).
+    std::string report() const;
+};
+
+// now on LoopStats::clock, in ns. Only good for comparing with another one
+// from the same machine (since boot, more or less).
+inline std::uint64_t now_ns() {
+    return LoopStats::since(LoopStats::clock::time_point(),
+                            LoopStats::clock::now());
+}
+
+} // namespace polly
@@ -42,6 +42,11 @@ void Timer::settime(long int seconds, long int nanos, bool oneshot) {
     }
 }
 
+void Timer::settime(std::chrono::nanoseconds time, bool oneshot) {
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(time);
+    settime(seconds.count(), (time - seconds).count(), oneshot);
+}
+
 void Timer::settime(struct itimerspec &spec) {
     int result = timerfd_settime(fd, 0, &spec, nullptr);
 
@@ -55,6 +60,9 @@ uint64_t Timer::read() {
     uint64_t exp = 0;
     int result = ::read(fd, &exp, sizeof(exp));
 
+    if (result == -1 && errno == EAGAIN) {
+        return 0;
+    }
     if (result == -1) {
         throw std::system_error(errno, std::generic_category(),
                                 "read() failed");
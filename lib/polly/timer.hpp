@@ -3,6 +3,7 @@
 
 #pragma once
 #include "filedes.hpp"
+#include <chrono>
 #include <memory>
 #include <sys/timerfd.h>
 namespace polly {
@@ -27,6 +28,10 @@ class Timer : public FileDes<Timer> {
     // once.
     void settime(long int seconds, long int nanos, bool oneshot);
 
+    // Same as above, but with a std::chrono duration so sub-second timers
+    // don't need to be split up by hand.
+    void settime(std::chrono::nanoseconds time, bool oneshot);
+
     // Set the timer spec.
     void settime(struct itimerspec &spec);
     // returns the current specifications of the timer, including time remaining
@@ -34,7 +39,8 @@ class Timer : public FileDes<Timer> {
     std::unique_ptr<struct itimerspec> gettime();
 
     // returns the number of expirations (triggers) that have occurred
-    // since the last read() or settime();
+    // since the last read() or settime(). For a non-blocking timer that
+    // hasn't expired, that's 0.
     uint64_t read();
 };
 
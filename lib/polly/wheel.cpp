@@ -0,0 +1,221 @@
+#include "wheel.hpp"
+#include <bit>
+namespace polly {
+
+TimerWheel::TimerWheel(EventLoop &loop, std::chrono::nanoseconds tick)
+    : nodes(first_timer), tick(tick), start(clock::now()), loop(loop),
+      timer(std::make_shared<Timer>(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC)) {
+    // list heads start out pointing at themselves (empty).
+    for (std::uint32_t i = 0; i < first_timer; i++) {
+        nodes[i].prev = i;
+        nodes[i].next = i;
+    }
+    timer->set_handler([this](Timer &t, int events) {
+        t.read();
+        advance();
+    });
+    loop.add_item(timer, EPOLLIN);
+}
+
+TimerWheel::~TimerWheel() { loop.delete_item(*timer); }
+
+std::uint64_t TimerWheel::current_tick() const {
+    return std::uint64_t((clock::now() - start) / tick);
+}
+
+void TimerWheel::link(std::uint32_t head, std::uint32_t index) {
+    Node &h = nodes[head];
+    Node &n = nodes[index];
+    n.prev = h.prev;
+    n.next = head;
+    nodes[h.prev].next = index;
+    h.prev = index;
+    if (head < pending_head) {
+        occupied[head / slots][(head % slots) / 64] |=
+            std::uint64_t(1) << (head % 64);
+    }
+}
+
+void TimerWheel::unlink(std::uint32_t index) {
+    Node &n = nodes[index];
+    std::uint32_t prev = n.prev;
+    std::uint32_t next = n.next;
+    nodes[prev].next = next;
+    nodes[next].prev = prev;
+    n.prev = nil;
+    n.next = nil;
+    // if that was the last one, both neighbours are the (now empty) head.
+    if (prev == next && prev < pending_head) {
+        occupied[prev / slots][(prev % slots) / 64] &=
+            ~(std::uint64_t(1) << (prev % 64));
+    }
+}
+
+// put a timer in the right slot for its expiry, relative to now.
+void TimerWheel::place(std::uint32_t index) {
+    std::uint64_t expires = nodes[index].expires;
+    std::uint64_t diff = expires > now ? expires - now : 0;
+    constexpr std::uint64_t horizon =
+        (std::uint64_t(1) << (slot_bits * levels)) - 1;
+    if (diff > horizon) {
+        // too far out. park it at the horizon, it'll come back around.
+        expires = now + horizon;
+        diff = horizon;
+    }
+    unsigned level = 0;
+    while (diff >= (std::uint64_t(1) << (slot_bits * (level + 1)))) {
+        level++;
+    }
+    unsigned slot = (expires >> (slot_bits * level)) & (slots - 1);
+    link(slot_head(level, slot), index);
+}
+
+// move everything in the current slot of level down to the lower levels.
+void TimerWheel::cascade(unsigned level) {
+    unsigned slot = (now >> (slot_bits * level)) & (slots - 1);
+    std::uint32_t head = slot_head(level, slot);
+    while (nodes[head].next != head) {
+        std::uint32_t index = nodes[head].next;
+        unlink(index);
+        place(index);
+    }
+}
+
+// the next tick at which a slot fires or cascades. UINT64_MAX if the wheel
+// is empty.
+std::uint64_t TimerWheel::next_expiry() const {
+    std::uint64_t best = UINT64_MAX;
+    for (unsigned level = 0; level < levels; level++) {
+        unsigned shift = slot_bits * level;
+        unsigned current = (now >> shift) & (slots - 1);
+        // search the slots after the current one, wrapping around.
+        for (unsigned dist = 1; dist <= slots;) {
+            unsigned slot = (current + dist) & (slots - 1);
+            std::uint64_t word = occupied[level][slot / 64] >> (slot % 64);
+            if (word == 0) {
+                // skip to the start of the next word.
+                dist += 64 - (slot % 64);
+                continue;
+            }
+            dist += std::countr_zero(word);
+            if (dist > slots) {
+                break;
+            }
+            std::uint64_t when = ((now >> shift) + dist) << shift;
+            best = std::min(best, when);
+            break;
+        }
+    }
+    return best;
+}
+
+void TimerWheel::rearm() {
+    std::uint64_t next = next_expiry();
+    if (next == armed_for) {
+        return;
+    }
+    armed_for = next;
+    if (next == UINT64_MAX) {
+        timer->disarm();
+        return;
+    }
+    auto remaining = start + std::int64_t(next) * tick - clock::now();
+    // a zero time would disarm the timer instead.
+    if (remaining <= clock::duration::zero()) {
+        remaining = std::chrono::nanoseconds(1);
+    }
+    timer->settime(remaining, true);
+}
+
+TimerWheel::Handle TimerWheel::add(std::chrono::nanoseconds delay,
+                                   callback_t callback) {
+    std::uint32_t index;
+    if (free_list != nil) {
+        index = free_list;
+        free_list = nodes[index].next;
+    } else {
+        index = nodes.size();
+        nodes.emplace_back();
+    }
+    // round the deadline up to a tick, so we never fire early.
+    auto deadline = clock::now() - start + delay;
+    std::uint64_t expires =
+        (deadline + tick - std::chrono::nanoseconds(1)) / tick;
+    Node &n = nodes[index];
+    n.active = true;
+    n.expires = std::max(expires, current_tick() + 1);
+    n.callback = std::move(callback);
+    place(index);
+    count++;
+    if (n.expires < armed_for) {
+        rearm();
+    }
+    return Handle{index, n.gen};
+}
+
+bool TimerWheel::pending(const Handle &handle) const {
+    return handle.index >= first_timer && handle.index < nodes.size() &&
+           nodes[handle.index].gen == handle.gen &&
+           nodes[handle.index].active;
+}
+
+bool TimerWheel::cancel(Handle &handle) {
+    bool was_pending = pending(handle);
+    if (was_pending) {
+        Node &n = nodes[handle.index];
+        unlink(handle.index);
+        n.active = false;
+        n.gen++;
+        n.callback = nullptr;
+        n.next = free_list;
+        free_list = handle.index;
+        count--;
+    }
+    handle = Handle{};
+    return was_pending;
+}
+
+void TimerWheel::advance() {
+    std::uint64_t target = current_tick();
+    while (true) {
+        std::uint64_t next = next_expiry();
+        if (next > target) {
+            break;
+        }
+        now = next;
+        // higher levels first, so their timers can trickle all the way down.
+        for (unsigned level = levels - 1; level > 0; level--) {
+            std::uint64_t mask =
+                (std::uint64_t(1) << (slot_bits * level)) - 1;
+            if ((now & mask) == 0) {
+                cascade(level);
+            }
+        }
+        // move the due timers off the wheel before running anything, so
+        // callbacks can add and cancel timers without upsetting us.
+        std::uint32_t head = slot_head(0, now & (slots - 1));
+        while (nodes[head].next != head) {
+            std::uint32_t index = nodes[head].next;
+            unlink(index);
+            link(pending_head, index);
+        }
+        while (nodes[pending_head].next != pending_head) {
+            std::uint32_t index = nodes[pending_head].next;
+            unlink(index);
+            Node &n = nodes[index];
+            callback_t callback = std::move(n.callback);
+            n.callback = nullptr;
+            n.active = false;
+            n.gen++;
+            n.next = free_list;
+            free_list = index;
+            count--;
+            callback();
+        }
+    }
+    now = target;
+    rearm();
+}
+
+} // namespace polly
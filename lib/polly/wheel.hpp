@@ -0,0 +1,134 @@
+// wheel.hpp - hierarchical timer wheel driven by a single polly::Timer
+// (c) Saji Champlin 2022
+
+#pragma once
+#include "polly.hpp"
+#include "timer.hpp"
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+namespace polly {
+
+// A Timer is a whole file descriptor, which is fine for one or two of them but
+// not for a timeout on every connection. The TimerWheel multiplexes any number
+// of timers onto one timerfd, with O(1) insertion and cancellation.
+//
+// It is a hierarchical timing wheel (Varghese & Lauck): 4 levels of 256 slots
+// each. Level 0 holds timers that expire within the next 256 ticks, one slot
+// per tick. Level 1 slots each cover 256 ticks, level 2 slots 65536 ticks, and
+// so on. When the lower level wraps around, the next slot of the level above
+// is "cascaded" down, re-inserting its timers closer to the bottom. With the
+// default 1ms tick, that covers about 49 days. Anything further out is clamped
+// and just gets cascaded again until it's due.
+//
+// The timerfd is only armed for the next tick where something actually
+// happens, so an idle wheel doesn't cause any wakeups.
+//
+// Timers live in a pool of nodes linked together by index, so there are no
+// allocations per timer once the pool has grown (apart from whatever the
+// callback itself needs).
+class TimerWheel {
+  public:
+    using callback_t = std::function<void()>;
+    using clock = std::chrono::steady_clock;
+
+    // Identifies a scheduled timer so it can be cancelled. A default
+    // constructed Handle never refers to a timer.
+    struct Handle {
+        std::uint32_t index = 0;
+        std::uint32_t gen = 0;
+    };
+
+  private:
+    static constexpr unsigned levels = 4;
+    static constexpr unsigned slot_bits = 8;
+    static constexpr unsigned slots = 1 << slot_bits;
+    static constexpr std::uint32_t nil = 0xFFFFFFFF;
+    // the first nodes in the pool are list heads: one per slot, plus one for
+    // timers that are about to fire.
+    static constexpr std::uint32_t pending_head = levels * slots;
+    static constexpr std::uint32_t first_timer = pending_head + 1;
+
+    struct Node {
+        std::uint32_t prev = nil;
+        std::uint32_t next = nil;
+        std::uint32_t gen = 0;
+        bool active = false;
+        std::uint64_t expires = 0; // in ticks.
+        callback_t callback;
+    };
+
+    std::vector<Node> nodes;
+    std::uint32_t free_list = nil;
+    std::size_t count = 0;
+    // one bit per non-empty slot, so we can find the next timer quickly.
+    std::array<std::array<std::uint64_t, slots / 64>, levels> occupied = {};
+
+    std::chrono::nanoseconds tick;
+    clock::time_point start;
+    std::uint64_t now = 0;                // the last tick we processed.
+    std::uint64_t armed_for = UINT64_MAX; // the tick the timerfd is set for.
+    EventLoop &loop;
+    std::shared_ptr<Timer> timer;
+
+    static std::uint32_t slot_head(unsigned level, unsigned slot) {
+        return level * slots + slot;
+    }
+    std::uint64_t current_tick() const;
+    void link(std::uint32_t head, std::uint32_t index);
+    void unlink(std::uint32_t index);
+    void place(std::uint32_t index);
+    void cascade(unsigned level);
+    std::uint64_t next_expiry() const;
+    void rearm();
+
+  public:
+    // Creates the wheel and registers its timer with the event loop. The
+    // loop has to outlive the wheel.
+    TimerWheel(EventLoop &loop,
+               std::chrono::nanoseconds tick = std::chrono::milliseconds(1));
+    TimerWheel(const TimerWheel &other) = delete;
+    ~TimerWheel();
+
+    // Run callback once, after (at least) delay. It's always called from the
+    // event loop, never from inside add(). Callbacks are free to add or cancel
+    // timers, including re-adding themselves to make a repeating timer.
+    Handle add(std::chrono::nanoseconds delay, callback_t callback);
+
+    // Cancel a timer. Returns false if it already fired or was cancelled.
+    // The handle is reset either way.
+    bool cancel(Handle &handle);
+
+    // Whether the timer is still waiting to fire.
+    bool pending(const Handle &handle) const;
+
+    // The number of timers waiting to fire.
+    std::size_t size() const { return count; }
+
+    // Fire everything that is due. Called by the timer's handler, but it
+    // doesn't hurt to call it more often.
+    void advance();
+
+    // co_await wheel.sleep(delay) suspends a coroutine for (at least) delay.
+    auto sleep(std::chrono::nanoseconds delay) {
+        struct Awaiter {
+            TimerWheel &wheel;
+            std::chrono::nanoseconds delay;
+            bool await_ready() {
+                return delay <= std::chrono::nanoseconds::zero();
+            }
+            void await_suspend(std::coroutine_handle<> h) {
+                // small enough for std::function to store inline.
+                wheel.add(delay, [h] { h.resume(); });
+            }
+            void await_resume() {}
+        };
+        return Awaiter{*this, delay};
+    }
+};
+
+} // namespace polly
@@ -1,18 +1,24 @@
 // Client main source.
 #include "libchat.hpp"
+#include "netty/async.hpp"
 #include "netty/netty.hpp"
+#include "polly/coro.hpp"
 #include "polly/polly.hpp"
-#include "polly/timer.hpp"
+#include "polly/signal.hpp"
+#include "polly/wheel.hpp"
 #include "surreal/surreal.hpp"
 #include <arpa/inet.h>
 #include <cstdio>
+#include <fcntl.h>
 #include <fstream>
+#include <getopt.h>
 #include <iomanip>
 #include <iostream>
-#include <csignal>
 #include <memory>
 #include <queue>
 #include <list>
+#include <sys/stat.h>
+#include <vector>
 // track if we are authenticated or not.
 struct AuthState {
     bool authed = false;
@@ -29,6 +35,13 @@ std::queue<std::pair<message_t, Packet_t>> ack_queue;
 // to prevent overrunning the unknown-size packet send buffer, we use our own
 // queue of frames.
 std::queue<Frame> send_queue;
+// set whenever something is added to send_queue, to wake up send_frames().
+polly::Event frames_queued;
+
+void queue_frame(const Frame &frame) {
+    send_queue.push(frame);
+    frames_queued.set();
+}
 
 
 // for sending files, we declare a "file job", which is the state for the sending of a file.
@@ -89,6 +102,15 @@ void run_file_jobs() {
     }
 }
 
+// private file transfers (SENDF2) are streamed instead: a StreamPacket
+// header and then the file itself, with sendfile(). These go one at a time,
+// since nothing else can go out on the connection in the middle of a body.
+struct StreamJob {
+    std::string filename;
+    std::string destination;
+};
+std::queue<StreamJob> stream_jobs;
+
 std::map<std::string, std::ofstream> output_files;
 
 // handles opening/writing/closing files.
@@ -113,31 +135,32 @@ void handle_files(const FilePacket& p) {
 
 }
 
-
-// file parser. returns an int, number of seconds to delay before calling again.
-// has 2 magic return values. -1 causes the parser to be run again, -2 disables the 
-// timer permanently.
-int parseFile(std::ifstream &file) {
-    std::string command;
-    file >> command;
-    if (file.eof()) {
-        print("reached end of file. client will remain connected");
-        return -2;
+// opens where a streamed file is going to go. If it can't be opened, the body
+// still has to be read, so it goes to /dev/null.
+int open_download(const StreamPacket &header) {
+    print("Starting to download " + header.filename + " from " +
+          header.username);
+    int file = open(header.filename.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file == -1) {
+        print("couldn't open " + header.filename + ": " + strerror(errno));
+        file = open("/dev/null", O_WRONLY | O_CLOEXEC);
     }
-    if (command == "DELAY") {
-        int delay;
-        file >> delay;
-        print("executing DELAY " + std::to_string(delay));
-        // breaks the parseFile Loop and sets the timer to the returned value.
-        return delay;
-    } else if (command == "REGISTER") {
+    return file;
+}
+
+
+// runs a single command from the command file (anything but DELAY, which
+// run_commands handles since it has to wait).
+void parseCommand(const std::string &command, std::ifstream &file) {
+    if (command == "REGISTER") {
         std::string username;
         std::string password;
         file >> username >> password;
         print("executing REGISTER " + username + " " + password);
         LoginPacket packet{.username = username, .password = password};
         auto f = make_frame(message_t::MSG_REGISTER, packet);
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_REGISTER, packet));
     } else if (command == "LOGIN") {
         std::string username;
@@ -146,12 +169,12 @@ int parseFile(std::ifstream &file) {
         print("executing LOGIN " + username + " " + password);
         LoginPacket packet{.username = username, .password = password};
         auto f = make_frame(message_t::MSG_LOGIN, packet);
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_LOGIN, packet));
     } else if (command == "LOGOUT") {
         auto f = make_frame(message_t::MSG_LOGOUT);
 	print("executing LOGOUT");
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_LOGOUT, std::monostate()));
     } else if (command == "SEND") {
         std::string message;
@@ -160,7 +183,7 @@ int parseFile(std::ifstream &file) {
         MessagePacket packet{.message = message,
                              .username = auth_state.username};
         auto f = make_frame(message_t::MSG_SEND, packet);
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_SEND, packet));
     } else if (command == "SEND2") {
         std::string destination;
@@ -172,7 +195,7 @@ int parseFile(std::ifstream &file) {
                              .username = auth_state.username,
                              .destination = destination};
         auto f = make_frame(message_t::MSG_SEND, packet);
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_SEND, packet));
     } else if (command == "SENDA") {
         std::string message;
@@ -180,7 +203,7 @@ int parseFile(std::ifstream &file) {
         MessagePacket packet{.message = message};
 	print("executing SENDA " + message);
         auto f = make_frame(message_t::MSG_SEND, packet);
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_SEND, packet));
     } else if (command == "SENDA2") {
         std::string destination;
@@ -190,7 +213,7 @@ int parseFile(std::ifstream &file) {
 	print("executing SENDA2 " + destination + " " + message);
         MessagePacket packet{.message = message, .destination = destination};
         auto f = make_frame(message_t::MSG_SEND, packet);
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_SEND, packet));
     } else if (command == "SENDF") { // both this and sendf2 are printed by the filejob handler
         std::string filename;
@@ -199,56 +222,94 @@ int parseFile(std::ifstream &file) {
         FileJob fj {};
 	fj.filename = filename;
 	f_jobs.push_back(std::move(fj));
-	run_file_jobs();
+	frames_queued.set();
     } else if (command == "SENDF2") {
         std::string destination;
         std::string filename;
         file >> destination;
         // std::getline(file, filename);
 	file >> filename;
-	FileJob fj;
-	fj.filename = filename;
-	fj.destination = destination;
-	f_jobs.push_back(std::move(fj));
-	run_file_jobs();
+	stream_jobs.push(StreamJob{filename, destination});
+	frames_queued.set();
+    } else if (command == "JOIN" || command == "PART") {
+        RoomPacket packet;
+        file >> packet.room;
+        print("executing " + command + " " + packet.room);
+        auto type =
+            command == "JOIN" ? message_t::MSG_JOIN : message_t::MSG_PART;
+        queue_frame(make_frame(type, packet));
+        ack_queue.push(std::pair(type, packet));
+    } else if (command == "SENDR") {
+        RoomPacket packet;
+        file >> packet.room;
+        std::getline(file >> std::ws, packet.message);
+        print("executing SENDR " + packet.room + " " + packet.message);
+        queue_frame(make_frame(message_t::MSG_ROOM, packet));
+        ack_queue.push(std::pair(message_t::MSG_ROOM, packet));
     } else if (command == "LIST") {
         auto f = make_frame(message_t::MSG_GETLIST);
-        send_queue.push(f);
+        queue_frame(f);
         ack_queue.push(std::pair(message_t::MSG_GETLIST, std::monostate()));
     } else {
         print("Invalid command detected, skipping line...");
         
     }
-    return -1; // in the timer callback, a -1 means continue calling parseFile.
+}
+
+// works through the command file. DELAY just suspends us on the timer
+// wheel, everything else is handed to parseCommand.
+polly::Task run_commands(std::ifstream &file, polly::TimerWheel &timers) {
+    co_await timers.sleep(std::chrono::seconds(1));
+    while (true) {
+        std::string command;
+        file >> command;
+        if (file.eof()) {
+            print("reached end of file. client will remain connected");
+            co_return;
+        }
+        if (command == "DELAY") {
+            int delay;
+            file >> delay;
+            print("executing DELAY " + std::to_string(delay));
+            co_await timers.sleep(std::chrono::seconds(delay));
+            continue;
+        }
+        parseCommand(command, file);
+    }
 }
 
 // handles server responses. uses ack_queue to track association to the message
 // we sent. can update state this way, since it also tracks the contents of the
 // sent packet. Handles printing out messages and stuff.
 std::optional<Frame> serverHandler(message_t resp, Packet_t pkt) {
-    message_t msg_ack = ack_queue.front().first;
-    Packet_t msg_pkt = ack_queue.front().second;
-    auto sent_name = message_names.find(msg_ack);
-    if (resp == message_t::MSG_OK) {
-        // print(sent_name->second + " OK!");
-        // if the message we sent was a login, we know it worked now and can set
-        // our username
-        if (msg_ack == message_t::MSG_LOGIN) {
-            auto p = std::get<LoginPacket>(msg_pkt);
-            auth_state.username = p.username;
-            auth_state.authed = true;
+    // messages from other people turn up whenever, including when we aren't
+    // waiting on anything, so only replies get matched up with ack_queue.
+    bool reply = resp == message_t::MSG_OK || resp == message_t::MSG_LIST ||
+                 error_meanings.contains(resp);
+    if (reply && !ack_queue.empty()) {
+        message_t msg_ack = ack_queue.front().first;
+        Packet_t msg_pkt = ack_queue.front().second;
+        auto sent_name = message_names.find(msg_ack);
+        if (resp == message_t::MSG_OK) {
+            // print(sent_name->second + " OK!");
+            // if the message we sent was a login, we know it worked now and
+            // can set our username
+            if (msg_ack == message_t::MSG_LOGIN) {
+                auto p = std::get<LoginPacket>(msg_pkt);
+                auth_state.username = p.username;
+                auth_state.authed = true;
+            }
+        }
+        auto error_name = error_meanings.find(resp);
+        if (error_name != error_meanings.end() &&
+            sent_name != message_names.end()) {
+            // we have an error response and the sent type can be printed, so
+            // print generic.
+            print(sent_name->second + " failed: " + error_name->second);
         }
         // pop the ack queue.
         ack_queue.pop();
     }
-    auto error_name = error_meanings.find(resp);
-    if (error_name != error_meanings.end() &&
-        sent_name != message_names.end()) {
-        // we have an error response and the sent type can be printed, so print
-        // generic.
-        print(sent_name->second + " failed: " + error_name->second);
-        ack_queue.pop();
-    }
 
     if (resp == message_t::MSG_SEND) {
         // display the message.
@@ -259,6 +320,11 @@ std::optional<Frame> serverHandler(message_t resp, Packet_t pkt) {
         }
         print(username + " said: " + message.message);
     }
+    if (resp == message_t::MSG_ROOM) {
+        auto message = std::get<RoomPacket>(pkt);
+        print("[" + message.room + "] " + message.username +
+              " said: " + message.message);
+    }
     if (resp == message_t::MSG_LIST) {
         // print list of members
         auto message = std::get<ListPacket>(pkt);
@@ -267,28 +333,171 @@ std::optional<Frame> serverHandler(message_t resp, Packet_t pkt) {
             users.append("\t" + u + "\n");
         }
         print("Currently (" + std::to_string(message.users.size()) + ") users online:\n" + users); 
-	ack_queue.pop();
     }
     if (resp == message_t::MSG_XFER) {
         auto message = std::get<FilePacket>(pkt);
         handle_files(message);
     }
+    if (resp == message_t::MSG_STREAM) {
+        // the body itself is handled by receive_frames. This only shows up
+        // here on its own if the sender went away halfway through.
+        auto message = std::get<StreamPacket>(pkt);
+        if (message.aborted) {
+            print(message.filename + " from " + message.username +
+                  " was cut off, deleting it");
+            unlink(message.filename.c_str());
+        }
+    }
     return std::nullopt;
 }
+// reads frames from the server and hands them to serverHandler.
+polly::Task receive_frames(Netty::AsyncSocket &conn) {
+    Netty::FrameReader reader;
+    Netty::Pipe pipe; // for streamed files.
+    while (true) {
+        auto res = co_await conn.receive(reader);
+        while (auto payload = reader.next()) {
+            auto message = get_frame(
+                std::vector<std::uint8_t>(payload->begin(), payload->end()));
+            auto type = std::get<message_t>(message);
+            auto packet = std::get<Packet_t>(message);
+            auto response = serverHandler(type, packet);
+            if (response.has_value()) {
+                queue_frame(response.value());
+            }
+            if (type == message_t::MSG_STREAM &&
+                !std::get<StreamPacket>(packet).aborted) {
+                // the raw file comes next. Whatever of it the reader already
+                // pulled in gets written out, and the rest is spliced
+                // straight from the socket into the file.
+                auto header = std::get<StreamPacket>(packet);
+                int file = open_download(header);
+                reader.expect_raw(header.size);
+                auto leftovers = reader.take(header.size);
+                if (write(file, leftovers.data(), leftovers.size()) == -1) {
+                    print("couldn't write " + header.filename + ": " +
+                          strerror(errno));
+                }
+                std::uint64_t left = reader.raw_left();
+                reader.expect_raw(0);
+                co_await conn.receive_file(file, left, pipe);
+                close(file);
+                print("Finished receiving " + header.filename + " from " +
+                      header.username);
+            }
+        }
+        if (res.status == Netty::recv_status::closed) {
+            print("ERROR: server connection closed. Exiting...");
+            exit(-1);
+        }
+    }
+}
+
+// sends queued frames to the server. When the queue runs dry it streams the
+// next file in stream_jobs, or tops the queue up from the running file jobs,
+// and if there's nothing at all it waits for more frames.
+// write_all only returns once the kernel took the whole frame, so a slow
+// server just slows us down here instead of filling up memory.
+polly::Task send_frames(Netty::AsyncSocket &conn) {
+    while (true) {
+        if (send_queue.size() == 0 && stream_jobs.size() > 0) {
+            // the header frame, then the whole file with sendfile().
+            StreamJob job = stream_jobs.front();
+            stream_jobs.pop();
+            int file = open(job.filename.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (file == -1 || fstat(file, &st) == -1) {
+                print(job.filename + " in bad state, terminating: " +
+                      strerror(errno));
+                if (file != -1) {
+                    close(file);
+                }
+                continue;
+            }
+            print("Starting to send " + job.filename);
+            StreamPacket header{.username = auth_state.username,
+                                .destination = job.destination,
+                                .filename = job.filename,
+                                .size = std::uint64_t(st.st_size)};
+            std::vector<std::uint8_t> bytes =
+                Netty::delimit(make_frame(message_t::MSG_STREAM, header));
+            co_await conn.write_all(bytes);
+            co_await conn.send_file(file, 0, header.size);
+            close(file);
+            print(job.filename + " finished sending.");
+            continue;
+        }
+        if (send_queue.size() == 0) {
+            run_file_jobs(); // try and get more frames.
+        }
+        if (send_queue.size() == 0) {
+            co_await frames_queued;
+            continue;
+        }
+        std::vector<std::uint8_t> bytes = Netty::delimit(send_queue.front());
+        send_queue.pop();
+        co_await conn.write_all(bytes);
+    }
+}
+
 int main(int argc, char * argv[]) {
 
-    if (argc != 4) {
+    // socket tuning, see Netty::SocketProfile.
+    std::string profile_name = "interactive";
+    int busy_poll = 0;
+    const struct option long_options[] = {
+        {"profile", required_argument, nullptr, 'p'},
+        {"busy-poll", required_argument, nullptr, 'u'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:u:", long_options, nullptr)) !=
+           -1) {
+        switch (opt) {
+        case 'p':
+            profile_name = optarg;
+            break;
+        case 'u':
+            busy_poll = std::atoi(optarg);
+            break;
+        default:
+            print("ERROR: usage: ./client <address> <port> <commands> "
+                  "[--profile=interactive|bulk|default] [--busy-poll=USEC]");
+            exit(-1);
+        }
+    }
+
+    if (argc - optind != 3) {
         print("ERROR: missing arguments. stopping.");
         exit(-1);
     }
 
-    std::string addr = argv[1];
-    std::string port = argv[2];
-    std::string command_filename = argv[3];
+    std::string addr = argv[optind];
+    std::string port = argv[optind + 1];
+    std::string command_filename = argv[optind + 2];
+
+    Netty::SocketProfile profile;
+    try {
+        profile = Netty::SocketProfile::named(profile_name);
+    } catch (std::invalid_argument &e) {
+        print(std::string("ERROR: ") + e.what());
+        exit(-1);
+    }
+    if (busy_poll > 0) {
+        profile.busy_poll = std::chrono::microseconds(busy_poll);
+    }
 
+    // "unix:/some/path" connects to the server's unix domain socket instead
+    // (see the server's --unix), and the port is ignored.
+    const std::string unix_prefix = "unix:";
+    bool local = addr.rfind(unix_prefix, 0) == 0;
     Netty::addrinfo_p address;
     try {
-        address = Netty::getaddrinfo(addr, port, false);
+        if (local) {
+            address = Netty::make_unix_addrinfo(addr.substr(unix_prefix.size()));
+        } else {
+            address = Netty::getaddrinfo(addr, port, false);
+        }
     } catch (std::runtime_error& e) {
         print("ERROR: couldn't resolve server address: ");
         print(e.what());
@@ -298,11 +507,16 @@ int main(int argc, char * argv[]) {
     auto sock = std::make_shared<Netty::Socket>(move(address));
 
     auto epoll = polly::Epoll();
-    auto timer2 = std::make_shared<polly::Timer>();
+    polly::TimerWheel timers(epoll);
     std::ifstream commands;
     commands.open(command_filename);
     // set up socket
     try {
+        // before connect(), so the buffer sizes count toward the window.
+        // (TCP options don't apply to unix sockets.)
+        if (!local) {
+            sock->apply(profile);
+        }
         sock->connect();
     } catch (std::system_error& e) {
         print("Error connecting, exiting...");
@@ -311,121 +525,34 @@ int main(int argc, char * argv[]) {
     }
     sock->setnonblocking(true);
 
-    // set up timer.
-    timer2->setnonblocking(true);
-    timer2->settime(1, 0, false);
-    timer2->set_handler([&](polly::Timer &t, int events) {
-        t.read(); // clear the timer.
-        int delay = -1;
-        while (delay == -1) { // run until we hit a real delay.
-            delay = parseFile(commands);
-            if (send_queue.size() > 0) {
-                epoll.set_events(*sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
-            }
-            if (delay == -2) {
-                t.disarm();
-                delay = 0;
-                break;
-            }
-        }
-        t.settime(delay, 0, false);
-    });
+    // sendfile() has no MSG_NOSIGNAL, so ignore SIGPIPE and get EPIPE
+    // instead.
+    signal(SIGPIPE, SIG_IGN);
 
-    // this function handles all the socket events and calls the correct helper
-    // functions. It is responsible for data serialization and sending queued
-    // messages.
-    sock->set_handler([&](Netty::Socket &s, int events) {
-        static recv_state r_state;
-        if (events & EPOLLRDHUP) {
-            // close the socket. error?
-            print("ERROR: server connection closed. Exiting...");
-            epoll.delete_item(s);
-            s.close();
-            exit(-1);
-        }
-        if (events & EPOLLIN) {
-            auto new_data = s.recv(1024);
-            r_state.data.insert(r_state.data.end(), new_data.begin(),
-                                new_data.end());
-            // std::cout << "got " << new_data.size() << " bytes, total " <<
-            // r_state.data.size() << "\n";
-            // // if the size of the buffer is greater than the size of our
-            // frame header, then std::cout << "awaiting " <<
-            // r_state.desired_bytes << " for a " << (r_state.await_header ?
-            // "header" : "frame") << "\n"; we decode the header and update our
-            // new thing.
-            while (r_state.data.size() >= r_state.desired_bytes) {
-                if (r_state.await_header) {
-                    // std::cout << "got enough data for a header\n";
-                    auto header = surreal::DataBuf(r_state.data.begin(),
-                                                   r_state.data.begin() +
-                                                       r_state.desired_bytes);
-                    r_state.data.erase(r_state.data.begin(),
-                                       r_state.data.begin() +
-                                           r_state.desired_bytes);
-                    unsigned char dummy;
-                    header.deserialize(dummy);
-                    if (dummy != 0xFE) {
-                        throw std::runtime_error(
-                            "frame misalignment. this should never happen");
-                    }
-                    std::size_t payload_size;
-                    header.deserialize(payload_size);
-                    r_state.await_header = false;
-                    r_state.desired_bytes = payload_size;
-                } else {
-                    // we have enough bytes for the intended frame.
-                    // std::cout << "got enough data for the frame\n";
-                    // copy the vector
-                    auto frame_buf = std::vector<uint8_t>(
-                        r_state.data.begin(),
-                        r_state.data.begin() + r_state.desired_bytes);
-                    r_state.data.erase(r_state.data.begin(),
-                                       r_state.data.begin() +
-                                           r_state.desired_bytes);
-                    auto message = get_frame(frame_buf);
-                    auto type = std::get<message_t>(message);
-                    auto payload = std::get<Packet_t>(message);
-                    auto response = serverHandler(type, payload);
-                    if (response.has_value()) {
-                        send_queue.push(response.value());
-                        epoll.set_events(s, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
-                    }
-
-                    // reset for the next header.
-                    r_state.await_header = true;
-                    r_state.desired_bytes = header_size;
-                }
-            }
-        }
-        if (events & EPOLLOUT) {
-	    if (send_queue.size() == 0) {
-		    run_file_jobs(); // try and get more frames.
-	    }
-	    // again but this time we know that there are no jobs running.
-            if (send_queue.size() == 0 && f_jobs.size() == 0) {
-                // disable epollout events for now.
-                epoll.set_events(s, EPOLLIN | EPOLLRDHUP);
-                return;
-            }
-            // pull frame from queue and send it.
-            s.send_delimited(send_queue.front());
-            send_queue.pop();
-            // we assume frames are always smaller than the kernel send buffer.
+    Netty::AsyncSocket conn(epoll, sock);
+    std::vector<polly::Task> tasks = {receive_frames(conn), send_frames(conn),
+                                      run_commands(commands, timers)};
+
+    bool running = true;
+    auto signals = std::make_shared<polly::Signal>(
+        std::initializer_list<int>{SIGINT, SIGTERM});
+    signals->set_handler([&running](polly::Signal &sig, int events) {
+        while (sig.read()) {
+            running = false;
         }
     });
-
-    // add both items to the epoll list.
-    epoll.add_item(timer2, EPOLLIN);
-    epoll.add_item(sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
-
-    std::signal(SIGINT, sighandler);
-    while (1) {
-        try {
-            epoll.wait(-1);
-        } catch (std::system_error& e) {
-            if (quit.load()) break;
-            else throw e;
+    epoll.add_item(signals, EPOLLIN);
+
+    while (running) {
+        epoll.wait(-1);
+        // one of them giving up (e.g the connection broke) means we're done.
+        for (auto &task : tasks) {
+            try {
+                task.rethrow();
+            } catch (std::exception &e) {
+                print(std::string("ERROR: ") + e.what() + ". Exiting...");
+                exit(-1);
+            }
         }
     }
 
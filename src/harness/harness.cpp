@@ -0,0 +1,340 @@
+// Throughput harness. Runs a ChatServer and a bunch of clients in the same
+// process, on the same event loop, connected by socketpair()s instead of TCP.
+// There's no network stack, no scheduler deciding who runs when, and no
+// other process to wait on, so the same run gives (pretty much) the same
+// numbers every time. Good for seeing whether a change to the server made it
+// faster or slower.
+//
+//     ./bin/harness --clients=64 --messages=10000 --workload=send2
+
+#include "../server/chatserver.hpp"
+#include "libchat.hpp"
+#include "netty/netty.hpp"
+#include "netty/peer.hpp"
+#include "polly/polly.hpp"
+#include "polly/stats.hpp"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+using polly::now_ns;
+using std::chrono::steady_clock;
+
+// one end of a socketpair, pretending to be a client.
+struct Client : Netty::Peer {
+    std::size_t index;
+    std::string name;
+    int replies = 0;            // to REGISTER and LOGIN.
+    std::size_t sent = 0;       // messages sent so far.
+    std::size_t in_flight = 0;  // deliveries we're still waiting on.
+    // the file being received, who it's from and when they sent it.
+    std::string stream_from;
+    std::uint64_t stream_t = 0;
+};
+
+enum class workload_t { send2, send, xfer, stream };
+
+struct Harness {
+    polly::EventLoop &loop;
+    std::vector<Client> clients;
+    workload_t workload;
+    std::size_t messages; // per client.
+    std::size_t size;     // of each message body.
+    std::size_t window;   // messages each client can have on the way.
+    std::size_t fanout;   // deliveries per message.
+
+    std::size_t ready = 0; // clients that are logged in.
+    bool started = false;
+    std::uint64_t start_ns = 0;
+    std::size_t delivered = 0;
+    std::size_t errors = 0;
+    polly::Histogram latency; // ns from sending to the recipient having it.
+    Netty::Payload body;      // the file, for stream.
+
+    Harness(polly::EventLoop &loop, workload_t workload, std::size_t messages,
+            std::size_t size, std::size_t window, std::size_t count)
+        : loop(loop), clients(count), workload(workload), messages(messages),
+          size(size), window(window),
+          fanout(workload == workload_t::send ? count - 1 : 1),
+          body(std::make_shared<const std::vector<std::uint8_t>>(size, 'x')) {
+    }
+
+    std::size_t expected() const {
+        return clients.size() * messages * fanout;
+    }
+    bool done() const { return started && delivered == expected(); }
+
+    void flush(Client &c) {
+        if (c.flush(loop) == Netty::send_status::closed) {
+            print("ERROR: server hung up on " + c.name);
+            exit(-1);
+        }
+    }
+
+    // send the next message. The send time rides along in the message (or
+    // the filename), so whoever gets it can work out the latency.
+    void send_one(Client &c) {
+        auto &to = clients[(c.index + 1) % clients.size()].name;
+        std::string stamp = std::to_string(now_ns());
+        switch (workload) {
+        case workload_t::send:
+        case workload_t::send2: {
+            MessagePacket m;
+            m.username = c.name;
+            m.destination = workload == workload_t::send ? "" : to;
+            m.message = stamp + " ";
+            m.message.resize(std::max(size, m.message.size()), 'x');
+            c.queue(make_frame(message_t::MSG_SEND, m));
+            break;
+        }
+        case workload_t::xfer: {
+            FilePacket f;
+            f.eof = true;
+            f.username = c.name;
+            f.destination = to;
+            f.filename = stamp;
+            f.data.resize(size, 'x');
+            c.queue(make_frame(message_t::MSG_XFER, f));
+            break;
+        }
+        case workload_t::stream: {
+            StreamPacket s;
+            s.destination = to;
+            s.filename = stamp;
+            s.size = size;
+            c.queue(make_frame(message_t::MSG_STREAM, s));
+            c.sock->queue_raw(body);
+            break;
+        }
+        }
+        c.sent++;
+        c.in_flight += fanout;
+    }
+
+    void fill_window(Client &c) {
+        while (c.sent < messages && c.in_flight + fanout <= window * fanout) {
+            send_one(c);
+        }
+        flush(c);
+    }
+
+    // from recipient's point of view, a message from `from` sent at `stamp`
+    // has arrived.
+    void arrived(const std::string &from, const std::string &stamp) {
+        latency.record(now_ns() - std::stoull(stamp));
+        delivered++;
+        auto &sender = clients[std::stoul(from.substr(4))];
+        sender.in_flight--;
+        fill_window(sender);
+    }
+
+    void handle(Client &c, std::span<const std::uint8_t> payload) {
+        auto [type, packet] =
+            get_frame(std::vector<std::uint8_t>(payload.begin(), payload.end()));
+        if (type == message_t::MSG_OK) {
+            if (c.replies < 2 && ++c.replies == 2) {
+                ready++;
+            }
+        } else if (type == message_t::MSG_SEND) {
+            auto &m = std::get<MessagePacket>(packet);
+            arrived(m.username, m.message.substr(0, m.message.find(' ')));
+        } else if (type == message_t::MSG_XFER) {
+            auto &f = std::get<FilePacket>(packet);
+            arrived(f.username, f.filename);
+        } else if (type == message_t::MSG_STREAM) {
+            auto &s = std::get<StreamPacket>(packet);
+            if (s.aborted) {
+                errors++;
+                return;
+            }
+            // the body's next, it's delivered once that's all here.
+            c.stream_t = std::stoull(s.filename);
+            c.reader.expect_raw(s.size);
+            if (s.size == 0) {
+                arrived(s.username, s.filename);
+            } else {
+                c.stream_from = s.username;
+            }
+        } else {
+            errors++;
+            if (c.replies < 2 && ++c.replies == 2) {
+                ready++;
+            }
+        }
+    }
+
+    void drain(Client &c) {
+        while (true) {
+            if (c.reader.raw_left() > 0) {
+                c.reader.take(c.reader.raw_left());
+                if (c.reader.raw_left() > 0) {
+                    return;
+                }
+                arrived(c.stream_from, std::to_string(c.stream_t));
+                continue;
+            }
+            auto payload = c.reader.next();
+            if (!payload) {
+                return;
+            }
+            handle(c, *payload);
+        }
+    }
+
+    void on_event(Client &c, int events) {
+        if (events & EPOLLOUT) {
+            flush(c);
+        }
+        if (events & (EPOLLIN | EPOLLHUP)) {
+            Netty::RecvResult res;
+            do {
+                res = c.sock->recv_into(c.reader);
+                drain(c);
+            } while (res.status == Netty::recv_status::full);
+            if (res.status == Netty::recv_status::closed) {
+                print("ERROR: server hung up on " + c.name);
+                exit(-1);
+            }
+        }
+    }
+};
+
+static std::string us(std::uint64_t ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1fus", ns / 1000.0);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    std::size_t count = 16;
+    std::size_t messages = 1000;
+    std::size_t size = 64;
+    std::size_t window = 8;
+    std::string workload_name = "send2";
+    int timeout = 60; // seconds.
+    const struct option long_options[] = {
+        {"clients", required_argument, nullptr, 'c'},
+        {"messages", required_argument, nullptr, 'm'},
+        {"size", required_argument, nullptr, 's'},
+        {"window", required_argument, nullptr, 'w'},
+        {"workload", required_argument, nullptr, 'W'},
+        {"timeout", required_argument, nullptr, 't'},
+        {nullptr, 0, nullptr, 0},
+    };
+    const std::string usage =
+        "ERROR: usage: ./harness [--clients=N] [--messages=N] [--size=BYTES] "
+        "[--window=N] [--workload=send2|send|xfer|stream] "
+        "[--timeout=SECONDS]";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:m:s:w:W:t:", long_options,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 'c':
+            count = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'm':
+            messages = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 's':
+            size = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'w':
+            window = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'W':
+            workload_name = optarg;
+            break;
+        case 't':
+            timeout = std::atoi(optarg);
+            break;
+        default:
+            print(usage);
+            exit(-1);
+        }
+    }
+    const std::map<std::string, workload_t> workloads{
+        {"send2", workload_t::send2},
+        {"send", workload_t::send},
+        {"xfer", workload_t::xfer},
+        {"stream", workload_t::stream},
+    };
+    auto w = workloads.find(workload_name);
+    if (w == workloads.end() || count < 2 || window < 1) {
+        print(usage);
+        exit(-1);
+    }
+
+    // a dead recipient shouldn't take the whole run down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    polly::Epoll loop;
+    // nothing hits the disk, so runs don't affect each other.
+    ChatServer server(loop, "");
+    server.quiet = true;
+    Harness h(loop, w->second, messages, size, window, count);
+
+    for (std::size_t i = 0; i < count; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                       sv) == -1) {
+            perror("socketpair");
+            exit(-1);
+        }
+        server.adopt(std::make_shared<Netty::Socket>(sv[0]));
+        auto &c = h.clients[i];
+        c.index = i;
+        c.name = "user" + std::to_string(i);
+        c.sock = std::make_shared<Netty::Socket>(sv[1]);
+        c.sock->set_handler(
+            [&h, &c](Netty::Socket &s, int events) { h.on_event(c, events); });
+        loop.add_item(c.sock, EPOLLIN);
+        LoginPacket login{.username = c.name, .password = "hunter2"};
+        c.queue(make_frame(message_t::MSG_REGISTER, login));
+        c.queue(make_frame(message_t::MSG_LOGIN, login));
+        h.flush(c);
+    }
+
+    auto deadline = steady_clock::now() + std::chrono::seconds(timeout);
+    while (!h.done() && steady_clock::now() < deadline) {
+        loop.wait(100);
+        server.flush();
+        if (!h.started && h.ready == count) {
+            // everyone's in, go.
+            h.started = true;
+            h.start_ns = now_ns();
+            for (auto &c : h.clients) {
+                h.fill_window(c);
+            }
+        }
+    }
+    double secs = (now_ns() - h.start_ns) / 1e9;
+    if (!h.done()) {
+        print("ERROR: timed out with " + std::to_string(h.delivered) + " of " +
+              std::to_string(h.expected()) + " delivered");
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%s: %zu clients, %zu messages each of %zu bytes, window %zu",
+             workload_name.c_str(), count, messages, size, window);
+    print(line);
+    snprintf(line, sizeof(line),
+             "delivered %zu in %.3fs: %.0f msg/s, %.1f MB/s, %zu errors",
+             h.delivered, secs, h.delivered / secs,
+             h.delivered * double(size) / secs / 1e6, h.errors);
+    print(line);
+    print("latency: p50 " + us(h.latency.percentile(50)) + ", p90 " +
+          us(h.latency.percentile(90)) + ", p99 " +
+          us(h.latency.percentile(99)) + ", max " + us(h.latency.max()));
+    // clients and server share the loop, so this is both of them.
+    print(loop.stats().report());
+    return h.done() ? 0 : 1;
+}
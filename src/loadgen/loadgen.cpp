@@ -0,0 +1,534 @@
+// Load generator. Opens lots of sessions to a running server from one
+// process, all on one event loop, and sends a mix of traffic at a fixed rate
+// for a while. Unlike the harness, the server's a separate process (maybe on
+// another machine), so this is for finding out how much a real deployment can
+// take, not for comparing one build against another.
+//
+//     ./bin/loadgen 127.0.0.1 8080 --clients=2000 --rate=20000 \
+//         --mix=send2:80,send:2,anon:3,list:5,stream:10 --duration=30
+//
+// The rate is open loop: messages are sent when they're due, whether or not
+// the earlier ones have been answered. If the server can't keep up the
+// latency goes up, instead of us quietly slowing down to match it. (The one
+// exception is a session whose socket is already full, which is skipped
+// until it drains. The report says how far behind that put us.)
+
+#include "libchat.hpp"
+#include "netty/netty.hpp"
+#include "netty/peer.hpp"
+#include "polly/polly.hpp"
+#include "polly/signal.hpp"
+#include "polly/stats.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <deque>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+using polly::now_ns;
+using std::chrono::steady_clock;
+
+// the kinds of traffic we can send.
+enum class op_t { send2, send, anon, list, xfer, stream };
+static const std::map<std::string, op_t> op_names{
+    {"send2", op_t::send2}, {"send", op_t::send},   {"anon", op_t::anon},
+    {"list", op_t::list},   {"xfer", op_t::xfer},   {"stream", op_t::stream},
+};
+constexpr std::size_t op_count = 6;
+
+struct Session : Netty::Peer {
+    std::size_t index;
+    std::string name;
+    enum { registering, logging_in, ready, dead } state = registering;
+    // what we've sent that the server replies to, and when, in order.
+    std::deque<std::pair<op_t, std::uint64_t>> waiting;
+    // when the file being received was sent.
+    std::uint64_t stream_t = 0;
+};
+
+struct LoadGen {
+    polly::EventLoop &loop;
+    std::vector<Session> sessions;
+    std::size_t size;      // of each message.
+    std::size_t file_size; // of each file.
+    Netty::Payload body;   // a file, for stream.
+    std::mt19937_64 rng;
+    std::discrete_distribution<int> mix;
+
+    std::size_t ready = 0;
+    std::size_t next = 0; // round robin over sessions.
+    // anything stamped before this was sent by an earlier run, and saved up
+    // for us while we were offline.
+    std::uint64_t born = now_ns();
+
+    // totals, and per kind of traffic.
+    std::uint64_t sent = 0;
+    std::uint64_t skipped = 0; // due, but there was nobody to send it to.
+    std::uint64_t behind = 0;  // due, but everyone's socket was full.
+    std::uint64_t delivered = 0;
+    std::uint64_t disconnects = 0;
+    std::array<std::uint64_t, op_count> sent_by = {};
+    std::array<polly::Histogram, op_count> latency;
+    std::map<std::string, std::uint64_t> errors;
+
+    LoadGen(polly::EventLoop &loop, std::size_t count, std::size_t size,
+            std::size_t file_size, const std::vector<double> &weights,
+            std::uint64_t seed)
+        : loop(loop), sessions(count), size(size), file_size(file_size),
+          body(std::make_shared<const std::vector<std::uint8_t>>(file_size,
+                                                                 'x')),
+          rng(seed), mix(weights.begin(), weights.end()) {}
+
+    void hang_up(Session &s) {
+        if (s.state == Session::ready) {
+            ready--;
+        }
+        s.state = Session::dead;
+        disconnects++;
+        loop.delete_item(*s.sock);
+    }
+
+    void flush(Session &s) {
+        if (s.flush(loop) == Netty::send_status::closed) {
+            hang_up(s);
+        }
+    }
+
+    // someone else who's logged in, for direct messages and files.
+    Session *pick_other(Session &from) {
+        for (int tries = 0; tries < 8; tries++) {
+            auto &to = sessions[rng() % sessions.size()];
+            if (&to != &from && to.state == Session::ready) {
+                return &to;
+            }
+        }
+        return nullptr;
+    }
+
+    // The send time rides along at the start of every message (or as the
+    // filename), so whoever gets it can work out how long it took. That
+    // works across sessions since they're all in this process.
+    void send_one(Session &s, op_t op) {
+        std::string stamp = std::to_string(now_ns());
+        switch (op) {
+        case op_t::send2:
+        case op_t::send:
+        case op_t::anon: {
+            MessagePacket m;
+            if (op == op_t::send2) {
+                auto *to = pick_other(s);
+                if (!to) {
+                    return;
+                }
+                m.destination = to->name;
+            }
+            m.username = op == op_t::anon ? "" : s.name;
+            m.message = stamp + " ";
+            m.message.resize(std::max(size, m.message.size()), 'x');
+            s.queue(make_frame(message_t::MSG_SEND, m));
+            s.waiting.emplace_back(op, now_ns());
+            break;
+        }
+        case op_t::list:
+            s.queue(make_frame(message_t::MSG_GETLIST));
+            s.waiting.emplace_back(op, now_ns());
+            break;
+        case op_t::xfer: {
+            auto *to = pick_other(s);
+            if (!to) {
+                return;
+            }
+            FilePacket f;
+            f.eof = true;
+            f.username = s.name;
+            f.destination = to->name;
+            f.filename = stamp;
+            f.data.resize(file_size, 'x');
+            s.queue(make_frame(message_t::MSG_XFER, f));
+            break;
+        }
+        case op_t::stream: {
+            auto *to = pick_other(s);
+            if (!to) {
+                return;
+            }
+            StreamPacket f;
+            f.destination = to->name;
+            f.filename = stamp;
+            f.size = file_size;
+            s.queue(make_frame(message_t::MSG_STREAM, f));
+            s.sock->queue_raw(body);
+            break;
+        }
+        }
+        sent++;
+        sent_by[std::size_t(op)]++;
+    }
+
+    // send whatever's due. Called often, from the main loop.
+    void pace(std::uint64_t due) {
+        std::size_t tries = 0;
+        while (sent + skipped < due) {
+            if (tries == sessions.size()) {
+                // everyone's full up. It'll still be due next time.
+                behind = due - sent - skipped;
+                return;
+            }
+            auto &s = sessions[next];
+            next = (next + 1) % sessions.size();
+            // a session with a backlog already has the server's attention.
+            if (s.state != Session::ready || !s.sock->flushed()) {
+                tries++;
+                continue;
+            }
+            tries = 0;
+            auto before = sent;
+            send_one(s, op_t(mix(rng)));
+            if (sent == before) {
+                skipped++; // nobody to send it to.
+            }
+            // straight away, like a real client would.
+            flush(s);
+        }
+        behind = 0;
+    }
+
+    // a message sent at stamp has arrived.
+    void arrived(op_t op, const std::string &stamp) {
+        // anyone else on the server can send us things too.
+        if (stamp.empty() || !std::isdigit(stamp[0])) {
+            return;
+        }
+        std::uint64_t t = std::stoull(stamp);
+        if (t < born) {
+            return;
+        }
+        latency[std::size_t(op)].record(now_ns() - t);
+        delivered++;
+    }
+
+    void reply(Session &s, message_t type) {
+        bool ok = type == message_t::MSG_OK || type == message_t::MSG_LIST;
+        if (s.state == Session::registering) {
+            // already registered from an earlier run is fine.
+            s.state = Session::logging_in;
+            return;
+        }
+        if (!ok) {
+            auto name = error_meanings.find(type);
+            errors[name != error_meanings.end() ? name->second
+                                                : std::to_string(int(type))]++;
+        }
+        if (s.state == Session::logging_in) {
+            if (ok) {
+                s.state = Session::ready;
+                ready++;
+            } else {
+                hang_up(s);
+            }
+            return;
+        }
+        if (s.waiting.empty()) {
+            return; // an error for a file, those don't get an OK.
+        }
+        auto [op, t] = s.waiting.front();
+        s.waiting.pop_front();
+        if (op == op_t::list && ok) {
+            latency[std::size_t(op)].record(now_ns() - t);
+            delivered++;
+        }
+    }
+
+    void handle(Session &s, std::span<const std::uint8_t> payload) {
+        auto [type, packet] =
+            get_frame(std::vector<std::uint8_t>(payload.begin(), payload.end()));
+        if (type == message_t::MSG_SEND) {
+            auto &m = std::get<MessagePacket>(packet);
+            auto stamp = m.message.substr(0, m.message.find(' '));
+            op_t op = m.username.empty()          ? op_t::anon
+                      : m.destination.empty()     ? op_t::send
+                                                  : op_t::send2;
+            arrived(op, stamp);
+        } else if (type == message_t::MSG_XFER) {
+            arrived(op_t::xfer, std::get<FilePacket>(packet).filename);
+        } else if (type == message_t::MSG_STREAM) {
+            auto &f = std::get<StreamPacket>(packet);
+            if (f.aborted) {
+                errors["STREAM aborted"]++;
+                return;
+            }
+            // the body's next, it's delivered once that's all here.
+            s.reader.expect_raw(f.size);
+            if (f.size == 0) {
+                arrived(op_t::stream, f.filename);
+            } else {
+                bool ours = !f.filename.empty() && std::isdigit(f.filename[0]);
+                s.stream_t = ours ? std::stoull(f.filename) : 0;
+            }
+        } else if (type == message_t::MSG_ROOM) {
+            // not something we send, but someone might.
+        } else {
+            reply(s, type);
+        }
+    }
+
+    void drain(Session &s) {
+        while (s.state != Session::dead) {
+            if (s.reader.raw_left() > 0) {
+                s.reader.take(s.reader.raw_left());
+                if (s.reader.raw_left() > 0) {
+                    return;
+                }
+                if (s.stream_t) {
+                    arrived(op_t::stream, std::to_string(s.stream_t));
+                }
+                continue;
+            }
+            auto payload = s.reader.next();
+            if (!payload) {
+                return;
+            }
+            handle(s, *payload);
+        }
+    }
+
+    void on_event(Session &s, int events) {
+        if (events & EPOLLOUT) {
+            flush(s);
+        }
+        if (s.state != Session::dead && events & (EPOLLIN | EPOLLHUP)) {
+            Netty::RecvResult res;
+            do {
+                res = s.sock->recv_into(s.reader);
+                drain(s);
+            } while (res.status == Netty::recv_status::full &&
+                     s.state != Session::dead);
+            if (res.status == Netty::recv_status::closed &&
+                s.state != Session::dead) {
+                hang_up(s);
+            }
+        }
+    }
+};
+
+static std::string ms(std::uint64_t ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3fms", ns / 1e6);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    std::size_t count = 100;
+    double rate = 1000; // messages per second, across every session.
+    std::string mix_spec = "send2:80,send:2,anon:3,list:5,stream:10";
+    std::size_t size = 64;
+    std::size_t file_size = 16384;
+    int duration = 10; // seconds.
+    std::string prefix = "load";
+    std::uint64_t seed = 1;
+    const struct option long_options[] = {
+        {"clients", required_argument, nullptr, 'c'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"mix", required_argument, nullptr, 'm'},
+        {"size", required_argument, nullptr, 's'},
+        {"file-size", required_argument, nullptr, 'f'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"prefix", required_argument, nullptr, 'p'},
+        {"seed", required_argument, nullptr, 'S'},
+        {nullptr, 0, nullptr, 0},
+    };
+    const std::string usage =
+        "ERROR: usage: ./loadgen <address> <port> [--clients=N] "
+        "[--rate=MSGS/SEC] [--mix=send2:W,send:W,anon:W,list:W,xfer:W,"
+        "stream:W] [--size=BYTES] [--file-size=BYTES] [--duration=SECONDS] "
+        "[--prefix=NAME] [--seed=N]";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:r:m:s:f:d:p:S:", long_options,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 'c':
+            count = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'r':
+            rate = std::strtod(optarg, nullptr);
+            break;
+        case 'm':
+            mix_spec = optarg;
+            break;
+        case 's':
+            size = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'f':
+            file_size = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'd':
+            duration = std::atoi(optarg);
+            break;
+        case 'p':
+            prefix = optarg;
+            break;
+        case 'S':
+            seed = std::strtoull(optarg, nullptr, 10);
+            break;
+        default:
+            print(usage);
+            exit(-1);
+        }
+    }
+    if (argc - optind != 2 || count < 2 || rate <= 0 || duration <= 0) {
+        print(usage);
+        exit(-1);
+    }
+    std::string addr = argv[optind];
+    std::string port = argv[optind + 1];
+
+    // "send2:80,list:20" -> a weight for each op, 0 for the ones left out.
+    std::vector<double> weights(op_count, 0);
+    for (std::size_t pos = 0; pos < mix_spec.size();) {
+        auto end = std::min(mix_spec.find(',', pos), mix_spec.size());
+        auto item = mix_spec.substr(pos, end - pos);
+        auto colon = item.find(':');
+        auto op = op_names.find(item.substr(0, colon));
+        if (colon == std::string::npos || op == op_names.end()) {
+            print("ERROR: bad --mix entry " + item);
+            exit(-1);
+        }
+        weights[std::size_t(op->second)] =
+            std::strtod(item.c_str() + colon + 1, nullptr);
+        pos = end + 1;
+    }
+    if (std::all_of(weights.begin(), weights.end(),
+                    [](double w) { return w <= 0; })) {
+        print("ERROR: --mix has nothing in it");
+        exit(-1);
+    }
+
+    // thousands of sessions is thousands of file descriptors, more than the
+    // usual soft limit. Take as many as we're allowed.
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    // the server hanging up shouldn't take us down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    polly::Epoll loop;
+    LoadGen g(loop, count, size, file_size, weights, seed);
+
+    // same as the client, "unix:/some/path" for the server's unix socket.
+    const std::string unix_prefix = "unix:";
+    bool local = addr.rfind(unix_prefix, 0) == 0;
+    print("connecting " + std::to_string(count) + " sessions...");
+    for (std::size_t i = 0; i < count; i++) {
+        auto &s = g.sessions[i];
+        s.index = i;
+        s.name = prefix + std::to_string(i);
+        try {
+            s.sock = std::make_shared<Netty::Socket>(
+                local ? Netty::make_unix_addrinfo(
+                            addr.substr(unix_prefix.size()))
+                      : Netty::getaddrinfo(addr, port, false));
+            s.sock->connect();
+        } catch (std::exception &e) {
+            print("ERROR: couldn't connect " + s.name + ": " + e.what());
+            exit(-1);
+        }
+        s.sock->setnonblocking(true);
+        s.sock->set_handler(
+            [&g, &s](Netty::Socket &, int events) { g.on_event(s, events); });
+        loop.add_item(s.sock, EPOLLIN);
+        LoginPacket login{.username = s.name, .password = "loadgen"};
+        s.queue(make_frame(message_t::MSG_REGISTER, login));
+        s.queue(make_frame(message_t::MSG_LOGIN, login));
+        g.flush(s);
+    }
+
+    // ^C stops early, and still reports what happened so far.
+    bool running = true;
+    auto signals = std::make_shared<polly::Signal>(
+        std::initializer_list<int>{SIGINT, SIGTERM});
+    signals->set_handler([&running](polly::Signal &sig, int) {
+        while (sig.read()) {
+            running = false;
+        }
+    });
+    loop.add_item(signals, EPOLLIN);
+
+    // wait for everyone to log in, or as many as are going to.
+    auto deadline = steady_clock::now() + std::chrono::seconds(10);
+    while (running && g.ready + g.disconnects < count &&
+           steady_clock::now() < deadline) {
+        loop.wait(100);
+    }
+    print(std::to_string(g.ready) + " of " + std::to_string(count) +
+          " sessions logged in");
+    if (g.ready < 2) {
+        print("ERROR: not enough sessions to send anything");
+        exit(-1);
+    }
+
+    // send for duration seconds, with a line every second about how it's
+    // going.
+    std::uint64_t start = now_ns();
+    std::uint64_t end = start + std::uint64_t(duration) * 1000000000;
+    std::uint64_t next_report = start + 1000000000;
+    std::uint64_t last_sent = 0, last_delivered = 0;
+    while (running && now_ns() < end) {
+        loop.wait(1);
+        std::uint64_t now = now_ns();
+        g.pace(std::uint64_t((now - start) / 1e9 * rate));
+        if (now >= next_report) {
+            char line[160];
+            snprintf(line, sizeof(line),
+                     "%3.0fs: sent %lu/s, delivered %lu/s, %zu sessions",
+                     (now - start) / 1e9, g.sent - last_sent,
+                     g.delivered - last_delivered, g.ready);
+            print(line);
+            last_sent = g.sent;
+            last_delivered = g.delivered;
+            next_report += 1000000000;
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+    // give whatever's still on the way a moment to turn up.
+    std::uint64_t grace = now_ns() + 2000000000;
+    while (running && now_ns() < grace) {
+        loop.wait(100);
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line),
+             "sent %lu in %.1fs (%.0f/s of %.0f/s asked for), %lu deliveries, "
+             "%lu with nobody to send to, %lu behind, %lu disconnects",
+             g.sent, secs, g.sent / secs, rate, g.delivered, g.skipped,
+             g.behind, g.disconnects);
+    print(line);
+    for (auto &[name, op] : op_names) {
+        auto &h = g.latency[std::size_t(op)];
+        if (g.sent_by[std::size_t(op)] == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line),
+                 "%-6s sent %8lu  delivered %9lu  p50 %s  p99 %s  p999 %s  "
+                 "max %s",
+                 name.c_str(), g.sent_by[std::size_t(op)], h.count(),
+                 ms(h.percentile(50)).c_str(), ms(h.percentile(99)).c_str(),
+                 ms(h.percentile(99.9)).c_str(), ms(h.max()).c_str());
+        print(line);
+    }
+    for (auto &[name, n] : g.errors) {
+        print("errors: " + std::to_string(n) + " " + name);
+    }
+    return g.disconnects == 0 ? 0 : 1;
+}
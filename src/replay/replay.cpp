@@ -0,0 +1,448 @@
+// Trace replay. Plays a trace recorded with the server's --trace back into a
+// server, one connection for each one in the trace, either at the original
+// pace (or some multiple of it) or as fast as the server will take it:
+//
+//     ./bin/server 8080 --trace=prod.trace      # on the old build
+//     ./bin/replay 127.0.0.1 8080 prod.trace --speed=0 --save=old.txt
+//     ./bin/replay 127.0.0.1 8080 prod.trace --speed=0 --baseline=old.txt
+//
+// Frames go out in the order they were recorded, across all connections. A
+// connection that's backed up holds up everything after it rather than
+// letting later frames overtake it. That's not enough on its own though: the
+// server reads each connection in turn, so a message can still get handled
+// before the LOGIN of the person it's for, if both arrive close together.
+// So anything that changes who's online or in which room has to be answered
+// before anything after it is sent. Those are rare once everyone's logged
+// in, so it hardly slows down the rest.
+//
+// It reports how fast the server got through it and how long replies took,
+// and with --baseline, how that compares to another run.
+//
+// The server should start from an empty store (./server reset), like the one
+// the trace was recorded on presumably did, or the REGISTERs won't go the
+// same way.
+
+#include "../server/metrics.hpp"
+#include "../server/trace.hpp"
+#include "libchat.hpp"
+#include "netty/netty.hpp"
+#include "netty/peer.hpp"
+#include "polly/polly.hpp"
+#include "polly/signal.hpp"
+#include "polly/stats.hpp"
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <unordered_map>
+#include <vector>
+
+using polly::now_ns;
+using std::chrono::steady_clock;
+
+// whether the server answers this with an OK, a LIST or an error. The files
+// don't get anything back unless something's wrong.
+static bool gets_reply(message_t type) {
+    return type != message_t::MSG_XFER && type != message_t::MSG_STREAM;
+}
+
+// whether later frames (from anyone) might depend on this one.
+static bool changes_state(message_t type) {
+    return type == message_t::MSG_REGISTER || type == message_t::MSG_LOGIN ||
+           type == message_t::MSG_LOGOUT || type == message_t::MSG_JOIN ||
+           type == message_t::MSG_PART;
+}
+
+struct Conn : Netty::Peer {
+    // the trace says to hang up once it's all sent and answered.
+    bool closing = false;
+    // when each frame still waiting on a reply was sent, and whether it
+    // changes_state().
+    std::deque<std::pair<std::uint64_t, bool>> waiting;
+};
+
+struct Replay {
+    polly::EventLoop &loop;
+    Netty::addrinfo_p (*address)();
+    std::vector<Conn> conns;
+    // for the bodies of streamed files, by size.
+    std::map<std::uint64_t, Netty::Payload> filler;
+
+    std::uint64_t frames = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t replies = 0;
+    std::uint64_t deliveries = 0;
+    std::uint64_t disconnects = 0;
+    std::uint64_t last_reply = 0;
+    std::size_t barriers = 0;   // changes_state() frames not answered yet.
+    std::size_t unanswered = 0; // and all of them.
+    polly::Histogram latency; // ns from sending a frame to its reply.
+    std::map<std::string, std::uint64_t> errors;
+
+    Replay(polly::EventLoop &loop, Netty::addrinfo_p (*address)(),
+           std::size_t count)
+        : loop(loop), address(address), conns(count) {}
+
+    void hang_up(Conn &c) {
+        loop.delete_item(*c.sock);
+        c.sock.reset();
+        for (auto &[t, barrier] : c.waiting) {
+            barriers -= barrier;
+        }
+        unanswered -= c.waiting.size();
+        c.waiting.clear();
+    }
+
+    void flush(Conn &c) {
+        if (c.flush(loop) == Netty::send_status::closed) {
+            disconnects++;
+            hang_up(c);
+        } else if (c.closing && c.sock->flushed() && c.waiting.empty()) {
+            hang_up(c);
+        }
+    }
+
+    void connect(Conn &c) {
+        c.sock = std::make_shared<Netty::Socket>(address());
+        c.sock->connect();
+        c.sock->setnonblocking(true);
+        c.reader = Netty::FrameReader();
+        c.events = EPOLLIN;
+        c.closing = false;
+        c.sock->set_handler(
+            [this, &c](Netty::Socket &, int events) { on_event(c, events); });
+        loop.add_item(c.sock, EPOLLIN);
+    }
+
+    // whether r has to wait: its connection has so much queued already, or
+    // it might depend on something that hasn't been answered. Hanging up
+    // waits for everything to be answered, so messages to whoever's leaving
+    // (sent before they left) don't get lost just because we're faster.
+    bool must_wait(const trace::Record &r, std::size_t index) const {
+        auto &c = conns[index];
+        if (c.sock && c.sock->unsent() > 1024 * 1024) {
+            return true;
+        }
+        if (r.k == trace::kind::closed) {
+            return unanswered > 0;
+        }
+        return barriers > 0 && !changes_state(Metrics::type_of(r.bytes));
+    }
+
+    void play(const trace::Record &r, std::size_t index) {
+        auto &c = conns[index];
+        if (r.k == trace::kind::closed) {
+            if (c.sock) {
+                c.closing = true;
+                flush(c);
+            }
+            return;
+        }
+        if (!c.sock) {
+            connect(c); // its first frame, or it came back.
+        }
+        auto type = Metrics::type_of(r.bytes);
+        c.queue({r.bytes.begin(), r.bytes.end()});
+        if (type == message_t::MSG_STREAM) {
+            // the body wasn't kept, so it's made up, the same size.
+            auto [t, packet] = get_frame(
+                std::vector<std::uint8_t>(r.bytes.begin(), r.bytes.end()));
+            auto size = std::get<StreamPacket>(packet).size;
+            auto &body = filler[size];
+            if (!body) {
+                body = std::make_shared<const std::vector<std::uint8_t>>(size);
+            }
+            c.sock->queue_raw(body);
+            bytes += size;
+        }
+        if (gets_reply(type)) {
+            c.waiting.emplace_back(now_ns(), changes_state(type));
+            barriers += changes_state(type);
+            unanswered++;
+        }
+        frames++;
+        bytes += r.bytes.size() + Netty::frame_header_size;
+        flush(c);
+    }
+
+    void handle(Conn &c, std::span<const std::uint8_t> payload) {
+        auto type = Metrics::type_of(payload);
+        if (type == message_t::MSG_SEND || type == message_t::MSG_XFER ||
+            type == message_t::MSG_ROOM) {
+            deliveries++;
+            return;
+        }
+        if (type == message_t::MSG_STREAM) {
+            auto [t, packet] = get_frame(
+                std::vector<std::uint8_t>(payload.begin(), payload.end()));
+            auto &f = std::get<StreamPacket>(packet);
+            if (f.aborted) {
+                errors["streamed file cut off"]++;
+                return; // and there's no body.
+            }
+            c.reader.expect_raw(f.size);
+            deliveries++;
+            return;
+        }
+        if (type != message_t::MSG_OK && type != message_t::MSG_LIST) {
+            auto name = error_meanings.find(type);
+            errors[name != error_meanings.end() ? name->second
+                                                : std::to_string(int(type))]++;
+        }
+        replies++;
+        last_reply = now_ns();
+        if (!c.waiting.empty()) {
+            auto [sent, barrier] = c.waiting.front();
+            latency.record(last_reply - sent);
+            barriers -= barrier;
+            unanswered--;
+            c.waiting.pop_front();
+        }
+    }
+
+    void on_event(Conn &c, int events) {
+        if (events & EPOLLOUT) {
+            flush(c);
+        }
+        if (!c.sock || !(events & (EPOLLIN | EPOLLHUP))) {
+            return;
+        }
+        Netty::RecvResult res;
+        do {
+            res = c.sock->recv_into(c.reader);
+            while (true) {
+                if (c.reader.raw_left() > 0) {
+                    c.reader.take(c.reader.raw_left());
+                    if (c.reader.raw_left() > 0) {
+                        break;
+                    }
+                    continue;
+                }
+                auto payload = c.reader.next();
+                if (!payload) {
+                    break;
+                }
+                handle(c, *payload);
+            }
+        } while (res.status == Netty::recv_status::full);
+        if (res.status == Netty::recv_status::closed) {
+            // expected if it's what the trace did.
+            if (!c.closing) {
+                disconnects++;
+            }
+            hang_up(c);
+        } else if (c.closing && c.waiting.empty()) {
+            flush(c); // and hang up, now it's been answered.
+        }
+    }
+
+    // everything's been answered.
+    bool settled() const {
+        for (auto &c : conns) {
+            if (c.sock && (!c.waiting.empty() || !c.sock->flushed())) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// results as "name value" lines, for --save and --baseline.
+using Results = std::vector<std::pair<std::string, double>>;
+
+static std::map<std::string, double> load_results(const std::string &path) {
+    std::map<std::string, double> out;
+    std::ifstream in(path);
+    std::string name;
+    double value;
+    while (in >> name >> value) {
+        out[name] = value;
+    }
+    return out;
+}
+
+static std::string server_addr, server_port;
+static Netty::addrinfo_p resolve() {
+    // same as the client, "unix:/some/path" for the server's unix socket.
+    const std::string unix_prefix = "unix:";
+    if (server_addr.rfind(unix_prefix, 0) == 0) {
+        return Netty::make_unix_addrinfo(server_addr.substr(unix_prefix.size()));
+    }
+    return Netty::getaddrinfo(server_addr, server_port, false);
+}
+
+int main(int argc, char *argv[]) {
+    double speed = 1; // 0 is as fast as possible.
+    int timeout = 10; // seconds to wait for replies once it's all sent.
+    std::string save_path, baseline_path;
+    const struct option long_options[] = {
+        {"speed", required_argument, nullptr, 's'},
+        {"timeout", required_argument, nullptr, 't'},
+        {"save", required_argument, nullptr, 'S'},
+        {"baseline", required_argument, nullptr, 'B'},
+        {nullptr, 0, nullptr, 0},
+    };
+    const std::string usage =
+        "ERROR: usage: ./replay <address> <port> <trace> [--speed=X] "
+        "[--timeout=SECONDS] [--save=FILE] [--baseline=FILE]";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:t:S:B:", long_options,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 's':
+            speed = std::strtod(optarg, nullptr);
+            break;
+        case 't':
+            timeout = std::atoi(optarg);
+            break;
+        case 'S':
+            save_path = optarg;
+            break;
+        case 'B':
+            baseline_path = optarg;
+            break;
+        default:
+            print(usage);
+            exit(-1);
+        }
+    }
+    if (argc - optind != 3 || speed < 0) {
+        print(usage);
+        exit(-1);
+    }
+    server_addr = argv[optind];
+    server_port = argv[optind + 1];
+
+    // read the whole thing first, so reading it doesn't get in the way of
+    // playing it.
+    std::unique_ptr<trace::Reader> reader;
+    std::vector<std::pair<trace::Record, std::size_t>> records;
+    std::unordered_map<std::uint64_t, std::size_t> ids;
+    try {
+        reader = std::make_unique<trace::Reader>(argv[optind + 2]);
+    } catch (std::exception &e) {
+        print(std::string("ERROR: ") + e.what());
+        exit(-1);
+    }
+    while (auto r = reader->next()) {
+        auto [it, added] = ids.try_emplace(r->conn, ids.size());
+        records.emplace_back(*r, it->second);
+    }
+    if (records.empty()) {
+        print("ERROR: the trace is empty");
+        exit(-1);
+    }
+    print("replaying " + std::to_string(records.size()) + " records over " +
+          std::to_string(ids.size()) + " connections");
+
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    polly::Epoll loop;
+    Replay replay(loop, resolve, ids.size());
+
+    bool running = true;
+    auto signals = std::make_shared<polly::Signal>(
+        std::initializer_list<int>{SIGINT, SIGTERM});
+    signals->set_handler([&running](polly::Signal &sig, int) {
+        while (sig.read()) {
+            running = false;
+        }
+    });
+    loop.add_item(signals, EPOLLIN);
+
+    std::uint64_t start = now_ns();
+    std::size_t next = 0;
+    try {
+        while (running && next < records.size()) {
+            std::uint64_t elapsed = now_ns() - start;
+            int wait = 0;
+            while (next < records.size()) {
+                auto &[r, index] = records[next];
+                if (speed > 0 && r.time_ns / speed > elapsed) {
+                    // not due yet. Come back when it is (or something
+                    // happens).
+                    wait = std::min<std::uint64_t>(
+                        100, (r.time_ns / speed - elapsed) / 1000000);
+                    break;
+                }
+                if (replay.must_wait(r, index)) {
+                    wait = 100; // until it drains, or the reply comes.
+                    break;
+                }
+                replay.play(r, index);
+                next++;
+            }
+            loop.wait(wait);
+        }
+    } catch (std::system_error &e) {
+        print(std::string("ERROR: ") + e.what());
+        exit(-1);
+    }
+    std::uint64_t sent_ns = now_ns() - start;
+    // then wait for the answers.
+    auto deadline = steady_clock::now() + std::chrono::seconds(timeout);
+    while (running && !replay.settled() && steady_clock::now() < deadline) {
+        loop.wait(100);
+    }
+    std::uint64_t end = std::max(replay.last_reply, start + sent_ns);
+    double secs = (end - start) / 1e9;
+
+    Results results = {
+        {"frames_per_sec", replay.frames / secs},
+        {"mb_per_sec", replay.bytes / secs / 1e6},
+        {"reply_p50_us", replay.latency.percentile(50) / 1e3},
+        {"reply_p99_us", replay.latency.percentile(99) / 1e3},
+        {"reply_p999_us", replay.latency.percentile(99.9) / 1e3},
+        {"reply_max_us", replay.latency.max() / 1e3},
+        {"deliveries", double(replay.deliveries)},
+        {"disconnects", double(replay.disconnects)},
+    };
+    char line[256];
+    snprintf(line, sizeof(line),
+             "sent %lu frames (%.1f MB) in %.3fs, %lu replies, %lu "
+             "deliveries, %lu disconnects",
+             replay.frames, replay.bytes / 1e6, secs, replay.replies,
+             replay.deliveries, replay.disconnects);
+    print(line);
+    if (next < records.size()) {
+        print("stopped early, " + std::to_string(records.size() - next) +
+              " records not played");
+    }
+    auto baseline = baseline_path.empty() ? std::map<std::string, double>()
+                                          : load_results(baseline_path);
+    for (auto &[name, value] : results) {
+        auto was = baseline.find(name);
+        if (was == baseline.end()) {
+            snprintf(line, sizeof(line), "%-15s %12.1f", name.c_str(), value);
+        } else {
+            double change = was->second == 0
+                                ? 0
+                                : (value - was->second) / was->second * 100;
+            snprintf(line, sizeof(line), "%-15s %12.1f  (was %.1f, %+.1f%%)",
+                     name.c_str(), value, was->second, change);
+        }
+        print(line);
+    }
+    for (auto &[name, n] : replay.errors) {
+        print("errors: " + std::to_string(n) + " " + name);
+    }
+    if (!save_path.empty()) {
+        std::ofstream out(save_path);
+        for (auto &[name, value] : results) {
+            out << name << " " << value << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1189 @@
+#include "chatserver.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+// serialize a frame once, so it can be queued for any number of sessions.
+static Netty::Payload make_payload(Frame frame) {
+    return std::make_shared<const std::vector<std::uint8_t>>(
+        std::vector<std::uint8_t>(frame));
+}
+
+ChatServer::ChatServer(polly::EventLoop &loop, const std::string &store_path)
+    : loop(loop), ring(dynamic_cast<polly::Ring *>(&loop)),
+      devnull(open("/dev/null", O_WRONLY | O_CLOEXEC)),
+      zeros(std::make_shared<const std::vector<std::uint8_t>>(65536)),
+      store(store_path) {
+    store.load();
+    // so the new snapshot gets swapped in here, rather than under our feet.
+    store.compacted->set_handler(
+        [this](polly::EventFd &, int) { store.finish_compaction(); });
+    loop.add_item(store.compacted, EPOLLIN);
+}
+
+ChatServer::~ChatServer() {
+    sessions.for_each(
+        [this](ClientSession &session) { loop.delete_item(*session.sock); });
+    loop.delete_item(*store.compacted);
+    close(devnull);
+}
+
+ClientSession &SessionTable::open(int fd) {
+    while (std::size_t(fd) / chunk_size >= chunks.size()) {
+        chunks.push_back(std::make_unique<Chunk>());
+    }
+    auto *s = slot(fd);
+    s->session.emplace();
+    s->session->fd = fd;
+    s->session->gen = ++s->gen;
+    live++;
+    return *s->session;
+}
+
+void SessionTable::close(ClientSession &session) {
+    session.closed = true;
+    closed.push_back(session.fd);
+    live--;
+}
+
+void SessionTable::reclaim() {
+    for (int fd : closed) {
+        slot(fd)->session.reset();
+    }
+    closed.clear();
+}
+
+ClientSession *ChatServer::online_session(std::string_view name) const {
+    auto it = username_sessions.find(name);
+    return it == username_sessions.end() ? nullptr : sessions.get(it->second);
+}
+
+void ChatServer::subscribe(ClientSession *session, const std::string &room) {
+    room_members[room].push_back(sessions.handle(*session));
+    session->rooms.push_back(room);
+}
+
+void ChatServer::unsubscribe(ClientSession *session,
+                             const std::string &room) {
+    auto it = room_members.find(room);
+    if (it != room_members.end()) {
+        // order doesn't matter, so swap it out.
+        auto &members = it->second;
+        for (auto &h : members) {
+            if (h.fd == session->fd && h.gen == session->gen) {
+                h = members.back();
+                members.pop_back();
+                break;
+            }
+        }
+        if (members.empty()) {
+            room_members.erase(it);
+        }
+    }
+    std::erase(session->rooms, room);
+}
+
+void ChatServer::subscribe_all(ClientSession *session) {
+    for (auto &room : store.data.rooms(session->username)) {
+        subscribe(session, room);
+    }
+}
+
+void ChatServer::unsubscribe_all(ClientSession *session) {
+    while (!session->rooms.empty()) {
+        unsubscribe(session, std::string(session->rooms.back()));
+    }
+}
+
+void ChatServer::queue_outgoing(ClientSession *session,
+                                Outgoing out) {
+    session->send_queue.push(std::move(out));
+    if (!session->dirty) {
+        session->dirty = true;
+        dirty_sessions.push_back(session);
+    }
+}
+
+// queue a frame to be sent to a session.
+void ChatServer::queue_frame(ClientSession *session,
+                             Netty::Payload payload) {
+    // broadcasts that went out before this have to get there before it. If
+    // they've still got a backlog, pulling those in now would just pile them
+    // up here, so it waits for them in the queue instead.
+    bool behind = session->authed && session->cursor != broadcasts.end() &&
+                  !caught_up(session);
+    if (behind || !session->waiting.empty()) {
+        session->waiting.emplace_back(broadcasts.end(), std::move(payload));
+        return;
+    }
+    if (pull_broadcasts(session)) {
+        push_frame(session, std::move(payload));
+    }
+}
+
+void ChatServer::push_frame(ClientSession *session, Netty::Payload payload) {
+    if (session->receiving) {
+        // can't cut into the middle of a file.
+        session->held.push_back(std::move(payload));
+        return;
+    }
+    queue_outgoing(session, {std::move(payload), false});
+}
+
+void ChatServer::queue_frame(ClientSession *session,
+                             const Frame &frame) {
+    queue_frame(session, make_payload(frame));
+}
+
+// applies the lag policy to a session that's missed some broadcasts.
+bool ChatServer::catch_up(ClientSession *session) {
+    if (session->cursor >= broadcasts.begin()) {
+        return true;
+    }
+    std::string missed = std::to_string(broadcasts.begin() - session->cursor);
+    if (lag_policy == LagPolicy::disconnect) {
+        log(session->username, " missed ", missed,
+            " broadcasts, disconnecting them");
+        close_connection(*session->sock);
+        return false;
+    }
+    // once per time they fall behind, not every time it gets worse.
+    if (!session->lagging) {
+        log(session->username, " missed ", missed,
+            " broadcasts, skipping ahead");
+        session->lagging = true;
+    }
+    session->cursor = broadcasts.begin();
+    return true;
+}
+
+bool ChatServer::pull_broadcasts(ClientSession *session) {
+    // the frames that were waiting for the broadcasts before up_to.
+    auto release = [&](std::uint64_t up_to) {
+        auto &waiting = session->waiting;
+        while (!waiting.empty() && waiting.front().first <= up_to) {
+            push_frame(session, std::move(waiting.front().second));
+            waiting.pop_front();
+        }
+    };
+    if (session->authed && session->cursor != broadcasts.end()) {
+        if (!catch_up(session)) {
+            return false;
+        }
+        auto me = sessions.handle(*session);
+        while (session->cursor < broadcasts.end()) {
+            release(session->cursor);
+            auto &e = broadcasts.at(session->cursor++);
+            if (e.from.fd != me.fd || e.from.gen != me.gen) {
+                push_frame(session, e.bytes);
+            }
+        }
+        session->lagging = false;
+    }
+    release(UINT64_MAX);
+    return true;
+}
+
+// queue part of a streamed file, for the session that's receiving it.
+void ChatServer::queue_raw(ClientSession *session,
+                           Netty::Payload bytes) {
+    queue_outgoing(session, {std::move(bytes), true});
+}
+
+std::optional<Frame> ChatServer::handle(message_t msg, Packet_t pkt,
+                                        ClientSession *session) {
+    if (msg == message_t::MSG_REGISTER) {
+        // check that username doesn't exist,
+        auto contents = std::get<LoginPacket>(pkt);
+        if (store.data.find_user(contents.username)) {
+            // user exists.
+            return make_frame(message_t::ERR_USEREXISTS);
+        }
+        // store password and return ok
+        store.apply({ServerData::Record::account, contents, {}});
+        log("Account registered: ", contents.username);
+        return make_frame(message_t::MSG_OK);
+    }
+    if (msg == message_t::MSG_LOGIN) {
+        auto contents = std::get<LoginPacket>(pkt);
+        auto pw = store.data.find_user(contents.username);
+        if (!pw) {
+	    log("Login attempt failed: ", contents.username, " not registered");
+            return make_frame(message_t::ERR_NOTREGISTERED);
+        }
+        if (pw->password != contents.password) {
+	    log("Login attempt failed: ", contents.username, " incorrect password");
+            return make_frame(message_t::ERR_PASSWRONG);
+        }
+        if (online_session(contents.username)) {
+	    log("Login attempt failed: ", contents.username, " already logged in");
+            return make_frame(message_t::ERR_ALREADYLOGGEDIN);
+        }
+        if (session->authed) {
+	    log("Login attempt failed: ", contents.username, " already logged in");
+            return make_frame(message_t::ERR_ALREADYLOGGEDIN);
+        }
+	log(contents.username, " logged in successfully");
+        // set authed and username.
+        session->authed = true;
+        session->username = contents.username;
+        // add username + session pointer.
+        username_sessions[contents.username] = sessions.handle(*session);
+        subscribe_all(session);
+        if (user_rate.any()) {
+            auto it = user_buckets.find(contents.username);
+            if (it == user_buckets.end()) {
+                Limits fresh(user_rate, limit_ticks_per_sec, limit_tick);
+                it = user_buckets.emplace(contents.username, UserLimits{fresh})
+                         .first;
+            }
+            it->second.sessions++;
+            session->user_limits = &it->second.limits;
+        }
+        // nothing that was said before they got here.
+        session->cursor = broadcasts.end();
+        // hand over what came in while they were away, and clear it.
+        auto box = store.data.mailbox(contents.username);
+        metrics.mailbox_size.record(box.size());
+        if (!box.empty()) {
+            for (auto &m : box) {
+                queue_frame(session, make_frame(message_t::MSG_SEND, m));
+            }
+            MessagePacket taken;
+            taken.destination = contents.username;
+            store.apply({ServerData::Record::taken, {}, taken});
+        }
+        return make_frame(message_t::MSG_OK);
+    }
+    if (msg == message_t::MSG_SEND) {
+        if (!session->authed) {
+	    log("Failed to send message: not logged in");
+            return make_frame(message_t::ERR_NOLOGIN);
+        }
+        // to broadcast, loop over username_sessions and put frame on send_queue
+        // if username not current user for DMs, try accessing the session
+        // directly.
+        auto contents = std::get<MessagePacket>(pkt);
+        if (contents.username != session->username && contents.username != "") {
+            // not an anonymous and not a message from us, so we respond with an
+            // error. NOPERMS. This means that some clients can have permissions
+            // to send as anyone. (admins).
+	    log(session->username, " tried to send a message as ", contents.username, ", but they don't have permission");
+            return make_frame(message_t::ERR_NOPERMS);
+        }
+        auto message = make_payload(make_frame(msg, contents));
+        if (contents.destination == "") {
+            // broadcast-type message.
+            
+            log(session->username, " sending ", (contents.username == "a" ? "an anonymous " : ""), "message to everyone");
+            // everyone picks it up from there, see flush().
+            broadcasts.publish(message, sessions.handle(*session));
+            metrics.broadcast_fanout.record(username_sessions.size() - 1);
+        } else {
+            log(session->username, " sending ", (contents.username == "a" ? "an anonymous " : ""), "message to ",
+                    contents.destination);
+            if (auto to = online_session(contents.destination)) {
+                queue_frame(to, message);
+            } else {
+                if (store.data.find_user(contents.destination)) {
+	           log("That user isn't online, so we will save the message");
+                   store.apply({ServerData::Record::mail, {}, contents});
+                   polly::bump(metrics.mail_stored);
+                } else {
+	            log("That user doesn't exist.");
+                    return make_frame(message_t::ERR_NOSUCHUSER);
+                }
+            }
+        }
+        return make_frame(message_t::MSG_OK);
+    }
+    if (msg == message_t::MSG_XFER) {
+        if (!session->authed) {
+            return make_frame(message_t::ERR_NOLOGIN);
+        }
+
+        auto contents = std::get<FilePacket>(pkt);
+        auto message = make_payload(make_frame(msg, contents));
+        if (contents.destination == "") {
+            // broadcast-type message.
+	    if (contents.eof)
+	    	log(contents.username, " sent file ", contents.filename, " to everyone");
+            broadcasts.publish(message, sessions.handle(*session));
+            metrics.broadcast_fanout.record(username_sessions.size() - 1);
+        } else {
+	    if (contents.eof)
+	    	log(contents.username, " sent file ", contents.filename, " to ", contents.destination);
+            if (auto to = online_session(contents.destination)) {
+                queue_frame(to, message);
+            }
+            // otherwise lmao i guess
+        }
+
+    }
+    if (msg == message_t::MSG_STREAM) {
+        // the body is coming whatever we say, so there's always a relay to
+        // take it off the connection, even if it just gets thrown out.
+        auto contents = std::get<StreamPacket>(pkt);
+        auto relay = std::make_shared<Relay>();
+        relay->from = session;
+        relay->remaining = contents.size;
+        session->sending = relay;
+        session->reader.expect_raw(contents.size);
+        if (!session->authed) {
+            return make_frame(message_t::ERR_NOLOGIN);
+        }
+        contents.username = session->username;
+        relay->header = contents;
+        auto to = online_session(contents.destination);
+        if (!to) {
+            // includes "everyone", we can only splice to one place.
+            log(session->username, " tried to stream ", contents.filename,
+                  " to ", contents.destination, ", throwing it out");
+            return std::nullopt;
+        }
+        log(session->username, " streaming file ", contents.filename,
+              " (", std::to_string(contents.size), " bytes) to ",
+              contents.destination);
+        relay->to = to;
+        offer_relay(relay);
+        return std::nullopt;
+    }
+    if (msg == message_t::MSG_JOIN || msg == message_t::MSG_PART) {
+        if (!session->authed) {
+            return make_frame(message_t::ERR_NOLOGIN);
+        }
+        auto contents = std::get<RoomPacket>(pkt);
+        if (!string_okay(contents.room)) {
+            return make_frame(message_t::ERR_BADNAME);
+        }
+        bool member = std::ranges::find(session->rooms, contents.room) !=
+                      session->rooms.end();
+        if (msg == message_t::MSG_PART && !member) {
+            return make_frame(message_t::ERR_NOTMEMBER);
+        }
+        if (msg == message_t::MSG_JOIN && member) {
+            // already there, nothing to do.
+            return make_frame(message_t::MSG_OK);
+        }
+        // same record layout as mail: who in username, where in destination.
+        MessagePacket change;
+        change.username = session->username;
+        change.destination = contents.room;
+        if (msg == message_t::MSG_JOIN) {
+            log(session->username, " joined ", contents.room);
+            store.apply({ServerData::Record::join, {}, change});
+            subscribe(session, contents.room);
+        } else {
+            log(session->username, " left ", contents.room);
+            store.apply({ServerData::Record::part, {}, change});
+            unsubscribe(session, contents.room);
+        }
+        return make_frame(message_t::MSG_OK);
+    }
+    if (msg == message_t::MSG_ROOM) {
+        if (!session->authed) {
+            return make_frame(message_t::ERR_NOLOGIN);
+        }
+        auto contents = std::get<RoomPacket>(pkt);
+        auto it = room_members.find(contents.room);
+        if (it == room_members.end() ||
+            std::ranges::find(session->rooms, contents.room) ==
+                session->rooms.end()) {
+            return make_frame(message_t::ERR_NOTMEMBER);
+        }
+        log(session->username, " sending message to room ", contents.room);
+        // no spoofing, whatever the client put there.
+        contents.username = session->username;
+        auto message = make_payload(make_frame(msg, contents));
+        // only the people in the room, not everyone online.
+        std::size_t sent = 0;
+        for (auto h : it->second) {
+            auto *to = sessions.get(h);
+            if (to && to != session) {
+                queue_frame(to, message);
+                sent++;
+            }
+        }
+        metrics.room_fanout.record(sent);
+        return make_frame(message_t::MSG_OK);
+    }
+    if (msg == message_t::MSG_LOGOUT) {
+        // TODO: if we are already logged out, should this fail with NOLOGIN?
+        session->authed = false;
+        if (session->username != "") {
+            log(session->username, " logged out");
+        }
+        username_sessions.erase(session->username);
+        unsubscribe_all(session);
+        release_user(session);
+        session->username = "";
+        return make_frame(message_t::MSG_OK);
+    }
+
+    if (msg == message_t::MSG_GETLIST) {
+        if (!session->authed) {
+            return make_frame(message_t::ERR_NOLOGIN);
+        }
+        log(session->username, " requested online user list.");
+        std::vector<std::string> users;
+        for (const auto& lp : username_sessions) {
+            users.push_back(lp.first);
+        }
+        // it's a hash map, so put them in order.
+        std::sort(users.begin(), users.end());
+
+        ListPacket pack { .users = users };
+
+        return make_frame(message_t::MSG_LIST, pack);
+     
+    }
+
+    return std::nullopt;
+}
+// hand a relay over to its recipient. If they're already getting another
+// file it waits its turn in held. Returns whether it started.
+bool ChatServer::offer_relay(std::shared_ptr<Relay> relay) {
+    auto to = relay->to;
+    if (to->receiving) {
+        to->held.push_back(relay);
+        return false;
+    }
+    queue_frame(to, make_frame(message_t::MSG_STREAM, relay->header));
+    to->receiving = relay;
+    relay->started = true;
+    return true;
+}
+
+// gets a relay going again after something it was waiting on changed. If the
+// sender's still there, that's done by processing its frames, since there
+// might be more of them after the body.
+void ChatServer::kick(std::shared_ptr<Relay> relay) {
+    if (relay->from) {
+        process_frames(relay->from);
+    } else {
+        advance(relay);
+    }
+}
+
+// the whole body has made it through (or been thrown out).
+void ChatServer::finish(std::shared_ptr<Relay> relay) {
+    relay->done = true;
+    if (auto from = relay->from) {
+        from->sending = nullptr;
+        from->reader.expect_raw(0);
+    }
+    auto to = relay->to;
+    if (!to) {
+        return;
+    }
+    to->receiving = nullptr;
+    if (relay->header.aborted) {
+        queue_frame(to, make_frame(message_t::MSG_STREAM, relay->header));
+    } else {
+        log(relay->header.username, " sent file ", relay->header.filename,
+            " to ", relay->header.destination);
+    }
+    // let through whatever was waiting, up to the next file.
+    while (!to->receiving && !to->held.empty()) {
+        auto item = std::move(to->held.front());
+        to->held.pop_front();
+        if (auto *next = std::get_if<std::shared_ptr<Relay>>(&item)) {
+            offer_relay(*next);
+            kick(*next);
+        } else {
+            queue_frame(to, std::get<Netty::Payload>(item));
+        }
+    }
+    // and any broadcasts that were waiting on the file.
+    if (!to->receiving) {
+        pull_broadcasts(to);
+    }
+}
+
+// moves as much of a relay's body along as can go without blocking.
+void ChatServer::advance(std::shared_ptr<Relay> relay) {
+    while (!relay->done) {
+        bool moved = false;
+        auto from = relay->from;
+        auto to = relay->to;
+        bool flowing = relay->started || !to;
+        // body bytes the sender's reader already pulled in along with the
+        // header.
+        if (from && flowing && relay->remaining > 0 &&
+            from->reader.buffered() > 0) {
+            auto bytes = from->reader.take(relay->remaining);
+            relay->remaining -= bytes.size();
+            if (to) {
+                queue_raw(to, std::make_shared<const std::vector<uint8_t>>(
+                                  bytes.begin(), bytes.end()));
+            }
+            moved = true;
+        }
+        // the sender left halfway through, so pad it out with zeros to keep
+        // the recipient's stream in one piece.
+        if (!from && flowing && relay->remaining > 0 && relay->in_pipe == 0) {
+            while (to && relay->remaining > 0) {
+                std::size_t n =
+                    std::min<std::uint64_t>(relay->remaining, zeros->size());
+                queue_raw(to, n == zeros->size()
+                                  ? zeros
+                                  : std::make_shared<
+                                        const std::vector<uint8_t>>(n));
+                relay->remaining -= n;
+            }
+            relay->remaining = 0;
+            moved = true;
+        }
+        if (!ring && relay->in_pipe > 0 && flowing) {
+            // pipe -> recipient, once everything queued ahead of the body is
+            // out.
+            ssize_t n = -1;
+            if (!to) {
+                n = Netty::splice(relay->pipe->read_fd(), devnull,
+                                  relay->in_pipe);
+            } else if (to->send_queue.empty() && to->sock->flushed()) {
+                try {
+                    n = Netty::splice(relay->pipe->read_fd(),
+                                      to->sock->get_fd(), relay->in_pipe);
+                    if (n > 0) {
+                        polly::bump(metrics.bytes_out, n);
+                    }
+                } catch (std::system_error &e) {
+                    // they're gone, the rest goes in the bin.
+                    relay->to = nullptr;
+                    to->receiving = nullptr;
+                    close_connection(*to->sock);
+                    moved = true;
+                }
+            }
+            if (n > 0) {
+                relay->in_pipe -= n;
+                moved = true;
+            }
+        }
+        if (!ring && from && relay->remaining > 0 &&
+            from->reader.buffered() == 0) {
+            // sender -> pipe. Everything from here on skips the reader.
+            if (!relay->pipe) {
+                relay->pipe = std::make_unique<Netty::Pipe>();
+            }
+            from->reader.expect_raw(0);
+            std::size_t room = relay->pipe->capacity() - relay->in_pipe;
+            ssize_t n = -1;
+            if (room > 0) {
+                try {
+                    n = Netty::splice(
+                        from->sock->get_fd(), relay->pipe->write_fd(),
+                        std::min<std::uint64_t>(relay->remaining, room));
+                } catch (std::system_error &e) {
+                    n = 0;
+                }
+            }
+            if (n == 0) {
+                // hung up halfway through.
+                relay->from = nullptr;
+                relay->header.aborted = true;
+                from->sending = nullptr;
+                close_connection(*from->sock);
+                moved = true;
+            } else if (n > 0) {
+                polly::bump(metrics.bytes_in, n);
+                relay->remaining -= n;
+                relay->in_pipe += n;
+                moved = true;
+            }
+        }
+        if ((relay->started || !relay->to) && relay->remaining == 0 &&
+            relay->in_pipe == 0) {
+            finish(relay);
+        } else if (!moved) {
+            break;
+        }
+    }
+    if (relay->from) {
+        update_interest(relay->from);
+    }
+    if (relay->to) {
+        update_interest(relay->to);
+    }
+}
+
+// turns EPOLLIN/EPOLLOUT on and off to match what the session is doing.
+// Reading stops while it's sending a file the pipe has no room for, and
+// EPOLLOUT stays on for as long as there's something waiting to go out.
+void ChatServer::update_interest(ClientSession *session) {
+    if (ring || session->closed) {
+        return;
+    }
+    std::uint32_t events = 0;
+    auto &in = session->sending;
+    // a file that's started has already been paid for, so it carries on
+    // even if they're throttled.
+    if (in ? session->reader.buffered() == 0 &&
+                 (!in->pipe || in->in_pipe < in->pipe->capacity())
+           : !session->throttled) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    auto &out = session->receiving;
+    if (!session->sock->flushed() || (out && out->in_pipe > 0)) {
+        events |= EPOLLOUT;
+    }
+    if (events != session->events) {
+        session->events = events;
+        loop.set_events(*session->sock, events);
+    }
+}
+
+// tears down a connection and the session attached to it.
+void ChatServer::close_connection(Netty::Socket &s) {
+    auto *session = sessions.find(s.get_fd());
+    if (!session || session->closed) {
+        return;
+    }
+    sessions.close(*session); // freed at the end of flush().
+    if (tracer) {
+        try {
+            tracer->closed(polly::now_ns(), trace_id(session));
+        } catch (std::system_error &e) {
+            print(std::string("ERROR: stopped tracing: ") + e.what());
+            tracer.reset();
+        }
+    }
+    log("Closing connection ", std::to_string(s.get_fd()),
+        (session->authed ? " (" + session->username + ")" : ""));
+    if (session->authed) {
+        username_sessions.erase(session->username);
+        unsubscribe_all(session);
+        release_user(session);
+    }
+    loop.delete_item(s);
+    // streamed files going through here. The ones from this session get
+    // padded out, the ones for it get thrown out.
+    if (auto relay = session->sending) {
+        session->sending = nullptr;
+        relay->from = nullptr;
+        relay->header.aborted = true;
+        advance(relay);
+    }
+    if (auto relay = session->receiving) {
+        session->receiving = nullptr;
+        relay->to = nullptr;
+        kick(relay);
+    }
+    for (auto &item : session->held) {
+        if (auto *relay = std::get_if<std::shared_ptr<Relay>>(&item)) {
+            (*relay)->to = nullptr;
+            kick(*relay);
+        }
+    }
+    session->held.clear();
+}
+
+// runs handle() on every complete frame the session has received, and moves
+// along any file it's sending us.
+void ChatServer::process_frames(ClientSession *session) {
+    // everything from one read gets the same time, it's near enough.
+    std::uint64_t now = tracer ? polly::now_ns() : 0;
+    while (!session->closed) {
+        if (auto relay = session->sending) {
+            advance(relay);
+            if (session->sending) {
+                return; // waiting on the socket, or the recipient.
+            }
+            continue;
+        }
+        if (session->throttled) {
+            return; // the rest waits, see limit_timer().
+        }
+        auto payload = session->reader.peek();
+        if (!payload) {
+            return;
+        }
+        auto message = get_frame(
+            std::vector<std::uint8_t>(payload->begin(), payload->end()));
+        auto type = std::get<message_t>(message);
+        auto packet = std::get<Packet_t>(message);
+        // before it's handled, so the frame that puts them over waits too
+        // (in the reader, where it's looked at again when they're let go).
+        if (!session->paid && (session_rate.any() || session->user_limits)) {
+            std::uint64_t size = payload->size() + Netty::frame_header_size;
+            if (type == message_t::MSG_STREAM) {
+                size += std::get<StreamPacket>(packet).size;
+            }
+            if (!charge(session, size)) {
+                session->paid = true;
+                return;
+            }
+        }
+        session->paid = false;
+        session->reader.next();
+        if (tracer) {
+            try {
+                tracer->frame(now, trace_id(session), *payload);
+            } catch (std::system_error &e) {
+                print(std::string("ERROR: stopped tracing: ") + e.what());
+                tracer.reset();
+            }
+        }
+        polly::bump(metrics.frames_in[Metrics::slot(type)]);
+        auto start = polly::LoopStats::clock::now();
+        auto response = handle(type, packet, session);
+        metrics.handler_ns.record(
+            polly::LoopStats::since(start, polly::LoopStats::clock::now()));
+        if (response.has_value()) {
+            queue_frame(session, response.value());
+        }
+    }
+}
+
+bool ChatServer::charge(ClientSession *session, std::uint64_t size) {
+    session->limits.refill(limit_tick);
+    session->limits.take(size);
+    bool over = session->limits.in_debt();
+    if (auto *user = session->user_limits) {
+        user->refill(limit_tick);
+        user->take(size);
+        over = over || user->in_debt();
+    }
+    if (!over) {
+        return true;
+    }
+    // once is enough to know who it is, metrics has how often.
+    if (session->throttles++ == 0) {
+        log(session->authed ? session->username
+                            : "Connection " + std::to_string(session->fd),
+            " is sending too fast, pausing them");
+    }
+    session->throttled = true;
+    throttled.push_back(sessions.handle(*session));
+    polly::bump(metrics.throttled);
+    if (ring) {
+        // or it'd keep receiving, and we'd keep buffering.
+        ring->pause_recv(session->fd);
+    }
+    update_interest(session);
+    return false;
+}
+
+void ChatServer::release_user(ClientSession *session) {
+    if (!session->user_limits) {
+        return;
+    }
+    session->user_limits = nullptr;
+    auto it = user_buckets.find(session->username);
+    if (--it->second.sessions > 0) {
+        return;
+    }
+    it->second.limits.refill(limit_tick);
+    if (it->second.limits.full()) {
+        user_buckets.erase(it);
+    } else {
+        idle_users.push_back(session->username); // see limit_timer().
+    }
+}
+
+void ChatServer::set_limits(Rate session, Rate user) {
+    session_rate = session;
+    user_rate = user;
+    if (!session.any() && !user.any()) {
+        return;
+    }
+    wheel = std::make_unique<polly::TimerWheel>(loop);
+    wheel->add(std::chrono::milliseconds(1000) / limit_ticks_per_sec,
+               [this] { limit_timer(); });
+}
+
+void ChatServer::limit_timer() {
+    limit_tick++;
+    // once a second, drop the buckets of users who left that have filled up
+    // since.
+    if (limit_tick % limit_ticks_per_sec == 0) {
+        auto idle = std::move(idle_users);
+        idle_users.clear();
+        for (auto &name : idle) {
+            auto it = user_buckets.find(name);
+            if (it == user_buckets.end() || it->second.sessions > 0) {
+                continue; // dropped already, or they're back.
+            }
+            it->second.limits.refill(limit_tick);
+            if (it->second.limits.full()) {
+                user_buckets.erase(it);
+            } else {
+                idle_users.push_back(std::move(name));
+            }
+        }
+    }
+    // only the throttled get refilled here. Everyone else is caught up when
+    // they next send something.
+    auto waiting = std::move(throttled);
+    throttled.clear();
+    for (auto h : waiting) {
+        auto *session = sessions.get(h);
+        if (!session) {
+            continue; // gone.
+        }
+        session->limits.refill(limit_tick);
+        bool over = session->limits.in_debt();
+        if (auto *user = session->user_limits) {
+            user->refill(limit_tick);
+            over = over || user->in_debt();
+        }
+        if (over) {
+            throttled.push_back(h);
+            continue;
+        }
+        session->throttled = false;
+        // whatever they sent before we stopped reading, then back to reading.
+        process_frames(session);
+        if (ring && !session->closed && !session->throttled) {
+            ring->resume_recv(session->fd);
+        }
+        update_interest(session);
+    }
+    wheel->add(std::chrono::milliseconds(1000) / limit_ticks_per_sec,
+               [this] { limit_timer(); });
+}
+
+// sends whatever the session's socket has queued. Once that's all out, a file
+// being spliced to it can carry on.
+void ChatServer::flush_session(ClientSession *session) {
+    Netty::send_status status;
+    try {
+        status = session->sock->flush();
+    } catch (std::system_error &e) {
+        status = Netty::send_status::closed;
+    }
+    if (status == Netty::send_status::closed) {
+        close_connection(*session->sock);
+        return;
+    }
+    metrics.unsent_bytes.record(session->sock->unsent());
+    if (status == Netty::send_status::done) {
+        if (session->receiving) {
+            kick(session->receiving);
+        } else if (!pull_broadcasts(session)) {
+            return;
+        }
+    }
+    update_interest(session);
+}
+
+// the client handler function. It will manage the lifetime of the connection
+// and receive messages from the socket.
+void ChatServer::client_handler(Netty::Socket &s, int events) {
+    auto *session = sessions.find(s.get_fd());
+    if (events & EPOLLERR) {
+        // usually just the kernel saying it's done with some zerocopy
+        // sends. It's only a real error if there's one pending.
+        try {
+            s.reap_zerocopy();
+            if (s.getsockopt(SOL_SOCKET, SO_ERROR) == 0) {
+                events &= ~EPOLLERR;
+            }
+        } catch (std::system_error &e) {
+        }
+    }
+    if (session->sending) {
+        // in the middle of a file, which gets spliced instead of read. If
+        // they hung up, that's noticed when the splice hits the end.
+        process_frames(session);
+    } else if (events & (EPOLLIN | EPOLLRDHUP)) {
+        // drain the socket, handling frames as they come in. Stop if a file
+        // starts, the rest of it gets spliced.
+        Netty::RecvResult res;
+        try {
+            do {
+                res = s.recv_into(session->reader);
+                polly::bump(metrics.bytes_in, res.bytes);
+                process_frames(session);
+            } while (res.status == Netty::recv_status::full &&
+                     !session->sending && !session->closed &&
+                     !session->throttled);
+        } catch (std::system_error &e) {
+            res.status = Netty::recv_status::closed; // e.g ECONNRESET
+        } catch (std::runtime_error &e) {
+            // what they sent isn't frames (or is one we'd never hold). There's
+            // no finding the next frame after that, so they go, nobody else.
+            log("Bad frames from ", std::to_string(s.get_fd()), ": ",
+                e.what());
+            res.status = Netty::recv_status::closed;
+        }
+        if (res.status == Netty::recv_status::closed && !session->closed) {
+            close_connection(s);
+            return;
+        }
+    }
+    if (session->closed) {
+        return;
+    }
+    if ((events & (EPOLLHUP | EPOLLERR)) ||
+        ((events & EPOLLRDHUP) && !session->sending)) {
+        close_connection(s);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        flush_session(session);
+    }
+}
+
+ClientSession &ChatServer::new_session(std::shared_ptr<Netty::Socket> sock) {
+    auto &session = sessions.open(sock->get_fd());
+    session.sock = std::move(sock);
+    session.limits = Limits(session_rate, limit_ticks_per_sec, limit_tick);
+    return session;
+}
+
+int ChatServer::adopt(std::shared_ptr<Netty::Socket> sock) {
+    int fd = sock->get_fd();
+    new_session(sock);
+    polly::bump(metrics.accepted);
+    if (ring) {
+        // completion-based path: one multishot recv per connection, nothing
+        // here waits for readiness. The ring owns the socket, so a raw
+        // pointer is fine.
+        Netty::Socket *s = sock.get();
+        ring->recv_multishot(
+            sock, [this, s](int res, std::span<const std::uint8_t> data) {
+                if (res <= 0) {
+                    close_connection(*s);
+                    return;
+                }
+                auto *session = sessions.find(s->get_fd());
+                polly::bump(metrics.bytes_in, data.size());
+                try {
+                    session->reader.append(data);
+                    process_frames(session);
+                } catch (std::runtime_error &e) {
+                    // same as client_handler().
+                    log("Bad frames from ", std::to_string(s->get_fd()), ": ",
+                        e.what());
+                    close_connection(*s);
+                }
+            });
+        // what flush_session() does when a socket drains on epoll.
+        ring->on_sent(fd, [this, s](std::size_t unsent) {
+            auto *session = sessions.find(s->get_fd());
+            metrics.unsent_bytes.record(unsent);
+            if (unsent < ring_backlog && !session->receiving) {
+                pull_broadcasts(session);
+            }
+        });
+        return fd;
+    }
+    if (zerocopy_min > 0) {
+        try {
+            sock->set_zerocopy(zerocopy_min);
+        } catch (std::system_error &e) {
+            // unix sockets and old kernels, just copy.
+        }
+    }
+    sock->set_handler(
+        [this](Netty::Socket &s, int events) { client_handler(s, events); });
+    loop.add_item(sock, EPOLLIN | EPOLLRDHUP);
+    return fd;
+}
+
+void ChatServer::accept_handler(Netty::Socket &s, int events) {
+    // take everyone who's waiting, not just one per wakeup.
+    while (true) {
+        int new_fd;
+        try {
+            new_fd = s.accept4();
+        } catch (std::system_error &e) {
+            // probably out of file descriptors. The rest will have to wait.
+            log("accept failed: ", e.what());
+            return;
+        }
+        if (new_fd == -1) {
+            return;
+        }
+        adopt(std::make_shared<Netty::Socket>(new_fd));
+    }
+}
+
+void ChatServer::listen(std::shared_ptr<Netty::Socket> listener) {
+    if (ring) {
+        ring->accept_multishot(listener, [this](int new_fd) {
+            if (new_fd >= 0) {
+                adopt(std::make_shared<Netty::Socket>(new_fd));
+            }
+        });
+        return;
+    }
+    listener->set_handler(
+        [this](Netty::Socket &s, int events) { accept_handler(s, events); });
+    loop.add_item(listener, EPOLLIN);
+}
+
+std::string ChatServer::metrics_text() {
+    Gauges g;
+    sessions.for_each([&](ClientSession &session) {
+        g.connections++;
+        if (session.authed) {
+            g.online++;
+        }
+        std::uint64_t unsent =
+            ring ? ring->unsent(session.fd) : session.sock->unsent();
+        g.unsent_bytes += unsent;
+        g.max_unsent_bytes = std::max(g.max_unsent_bytes, unsent);
+        g.held += session.held.size() + session.waiting.size();
+    });
+    g.rooms = room_members.size();
+    g.broadcasts = broadcasts.end();
+    g.broadcast_capacity = broadcasts.capacity();
+    g.log_dropped = polly::Logger::get().dropped();
+    return render_metrics(metrics, g, loop.stats());
+}
+
+void ChatServer::serve_metrics(std::shared_ptr<Netty::Socket> listener) {
+    listener->set_handler([this](Netty::Socket &s, int) {
+        while (true) {
+            int fd;
+            try {
+                fd = s.accept4();
+            } catch (std::system_error &e) {
+                log("admin accept failed: ", e.what());
+                return;
+            }
+            if (fd == -1) {
+                return;
+            }
+            auto sock = std::make_shared<Netty::Socket>(fd);
+            auto text = metrics_text();
+            sock->queue_raw(std::make_shared<const std::vector<std::uint8_t>>(
+                text.begin(), text.end()));
+            if (sock->flush() != Netty::send_status::again) {
+                continue; // all sent (or they left), and sock closes it.
+            }
+            // a big scrape into a small socket buffer. Finish it off when
+            // there's room.
+            sock->set_handler([this](Netty::Socket &s, int events) {
+                metrics_handler(s, events);
+            });
+            loop.add_item(sock, EPOLLOUT);
+            scrapers[fd] = sock;
+        }
+    });
+    loop.add_item(listener, EPOLLIN);
+}
+
+void ChatServer::metrics_handler(Netty::Socket &s, int events) {
+    auto status = Netty::send_status::closed;
+    if (!(events & (EPOLLERR | EPOLLHUP))) {
+        status = s.flush();
+    }
+    if (status == Netty::send_status::again) {
+        return;
+    }
+    loop.delete_item(s);
+    scrapers.erase(s.get_fd());
+}
+
+void ChatServer::flush() {
+    // anything that changed the store this time around is made durable
+    // before any of the replies saying it worked go out. One fdatasync()
+    // covers all of them. If that fails nothing gets sent: the error goes
+    // up to whoever's running us, with the OKs still sitting in the send
+    // queues.
+    store.commit();
+    // handling frames in here (when a relay gets unstuck) can broadcast
+    // more, so go around until everyone's been woken up for all of them.
+    do {
+        wake_broadcast_readers();
+        flush_dirty();
+    } while (broadcasts_seen != broadcasts.end());
+    // nothing's holding on to the sessions that closed any more.
+    sessions.reclaim();
+}
+
+bool ChatServer::caught_up(ClientSession *session) const {
+    if (ring) {
+        return ring->unsent(session->fd) < ring_backlog;
+    }
+    return session->sock->flushed();
+}
+
+// sessions that were idle when something was broadcast won't hear about it
+// from their socket, so they get it queued here. One pass over everyone
+// online per loop iteration, however many broadcasts there were. Anyone
+// who's still sending (or in the middle of a file) gets theirs when their
+// socket drains, in flush_session() (or the ring's on_sent()).
+void ChatServer::wake_broadcast_readers() {
+    if (broadcasts_seen == broadcasts.end()) {
+        return;
+    }
+    broadcasts_seen = broadcasts.end();
+    sessions.for_each([this](ClientSession &session) {
+        if (!session.authed || session.cursor == broadcasts.end()) {
+            return;
+        }
+        if (caught_up(&session) && !session.receiving) {
+            pull_broadcasts(&session);
+        } else {
+            // they'll pull them when they're ready, but if they're too far
+            // behind already there's no point waiting.
+            catch_up(&session);
+        }
+    });
+}
+
+void ChatServer::count_out(const Outgoing &out) {
+    if (out.raw) {
+        polly::bump(metrics.bytes_out, out.bytes->size());
+        return;
+    }
+    polly::bump(metrics.bytes_out, out.bytes->size() + Netty::frame_header_size);
+    polly::bump(metrics.frames_out[Metrics::slot(Metrics::type_of(*out.bytes))]);
+}
+
+void ChatServer::flush_dirty() {
+    // by index, since flushing can unstick a relay, which can queue frames
+    // for more sessions.
+    for (std::size_t i = 0; i < dirty_sessions.size(); i++) {
+        auto *ses = dirty_sessions[i];
+        ses->dirty = false;
+        // it might have disconnected since.
+        if (ses->closed || ses->send_queue.empty()) {
+            continue;
+        }
+        if (ring) {
+            // queued up here, and submitted in one batch on the next wait().
+            // The payloads go as they are, a broadcast isn't copied for
+            // everyone it goes to.
+            while (ses->send_queue.size() > 0) {
+                auto &out = ses->send_queue.front();
+                count_out(out);
+                if (out.raw) {
+                    ring->send(ses->fd, std::move(out.bytes));
+                } else {
+                    auto header = Netty::frame_header(out.bytes->size());
+                    ring->send(ses->fd, std::move(out.bytes), header);
+                }
+                ses->send_queue.pop();
+            }
+        } else {
+            // everything this session got this time around goes out in as
+            // few sendmsg() calls as possible. If it doesn't all fit,
+            // EPOLLOUT picks up the rest. If we're already waiting on
+            // EPOLLOUT there's no point trying now.
+            bool was_flushed = ses->sock->flushed();
+            while (ses->send_queue.size() > 0) {
+                auto &out = ses->send_queue.front();
+                count_out(out);
+                if (out.raw) {
+                    ses->sock->queue_raw(std::move(out.bytes));
+                } else {
+                    ses->sock->queue_frame(std::move(out.bytes));
+                }
+                ses->send_queue.pop();
+            }
+            if (was_flushed) {
+                flush_session(ses);
+            }
+        }
+    }
+    dirty_sessions.clear();
+}
@@ -0,0 +1,433 @@
+// chatserver.hpp - the server side of the chat protocol, minus main()
+// (c) Saji Champlin 2022
+#pragma once
+#include "datastore.hpp"
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+#include "serverdata.hpp"
+#include "trace.hpp"
+#include "libchat.hpp"
+#include "netty/netty.hpp"
+#include "polly/polly.hpp"
+#include "polly/ring.hpp"
+#include "polly/wheel.hpp"
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+struct Relay;
+
+// something waiting to go out to a client.
+struct Outgoing {
+    Netty::Payload bytes;
+    bool raw = false; // part of a streamed file, rather than a whole frame.
+};
+
+// A container for client connection state.
+// contains their username, whether or not they are authenticated,
+// as well as sending and recv queues.
+struct ClientSession {
+    int fd = -1;
+    std::uint32_t gen = 0; // see SessionHandle.
+    std::shared_ptr<Netty::Socket> sock;
+    bool authed = false;
+    bool closed = false;
+    std::string username;
+    // the rooms this session gets messages for (see room_members). Only
+    // while it's logged in.
+    std::vector<std::string> rooms;
+    // the next broadcast they get (see BroadcastLog). Only while logged in.
+    std::uint64_t cursor = 0;
+    bool lagging = false; // has had broadcasts skipped, see LagPolicy.
+    // frames for them that came up while they had a backlog, and the
+    // broadcast each one goes out in front of (see ChatServer::queue_frame()).
+    std::deque<std::pair<std::uint64_t, Netty::Payload>> waiting;
+    // how fast they're allowed to send (see ChatServer::set_limits()), on
+    // this connection and as whoever they're logged in as. Nothing more of
+    // theirs is read while throttled.
+    Limits limits;
+    Limits *user_limits = nullptr;
+    bool throttled = false;
+    bool paid = false; // for the frame they were throttled on.
+    std::uint64_t throttles = 0; // times they've been.
+    Netty::FrameReader reader;
+    std::queue<Outgoing> send_queue;
+    bool dirty = false; // in dirty_sessions, waiting to be flushed.
+    // what epoll is watching this connection for.
+    std::uint32_t events = EPOLLIN | EPOLLRDHUP;
+    // streamed files this client is in the middle of sending us, and of
+    // being sent. Nothing else can go out to them in the middle of a file,
+    // so frames (and other files) for them wait in held until it's done.
+    std::shared_ptr<Relay> sending;
+    std::shared_ptr<Relay> receiving;
+    std::deque<std::variant<Netty::Payload, std::shared_ptr<Relay>>> held;
+};
+
+// A streamed file on its way from one client to another (see StreamPacket).
+// The body is never cut up into frames. On epoll it gets spliced from the
+// sender's socket into a pipe and from there into the recipient's socket, so
+// it never comes up into user space at all. (The io_uring backend has already
+// received it by the time we hear about it, so there it gets queued as raw
+// bytes instead.)
+struct Relay {
+    StreamPacket header;
+    ClientSession *from = nullptr; // null once the sender's gone.
+    ClientSession *to = nullptr;   // null if nobody's getting it.
+    std::uint64_t remaining = 0; // body bytes still to come from the sender.
+    std::unique_ptr<Netty::Pipe> pipe; // made on the first splice.
+    std::size_t in_pipe = 0;
+    bool started = false; // the recipient has been sent the header.
+    bool done = false;
+};
+
+// A reference to a session that's safe to keep around after it's gone. Slots
+// get reused (along with their fd), so the generation tells an old handle
+// apart from whoever has the slot now.
+struct SessionHandle {
+    int fd = -1;
+    std::uint32_t gen = 0;
+};
+
+// All the sessions, in a slab indexed by fd. The kernel always hands out the
+// lowest free fd, so it stays dense. Looking a session up is indexing an
+// array, not walking a tree, and passing one around is passing a pointer, not
+// bumping a shared_ptr's (atomic) refcount. The slab grows in chunks that
+// never move, so a ClientSession * is good until the session is reclaimed.
+//
+// Closing a session doesn't free it straight away, since whatever closed it
+// is probably still holding it. It's marked closed, and reclaim() (once
+// nothing's running) frees it along with its socket. Until then the fd can't
+// be handed out again either.
+class SessionTable {
+    struct Slot {
+        std::optional<ClientSession> session;
+        std::uint32_t gen = 0;
+    };
+    static constexpr std::size_t chunk_size = 64;
+    using Chunk = std::array<Slot, chunk_size>;
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    std::vector<int> closed;
+    std::size_t live = 0;
+
+    Slot *slot(int fd) const {
+        std::size_t c = std::size_t(fd) / chunk_size;
+        return fd >= 0 && c < chunks.size()
+                   ? &(*chunks[c])[std::size_t(fd) % chunk_size]
+                   : nullptr;
+    }
+
+  public:
+    ClientSession &open(int fd);
+    // the session on fd, closed or not. nullptr if there isn't one.
+    ClientSession *find(int fd) const {
+        auto *s = slot(fd);
+        return s && s->session ? &*s->session : nullptr;
+    }
+    // the session a handle is for, if it's still open.
+    ClientSession *get(SessionHandle h) const {
+        auto *s = slot(h.fd);
+        return s && s->gen == h.gen && s->session && !s->session->closed
+                   ? &*s->session
+                   : nullptr;
+    }
+    SessionHandle handle(const ClientSession &session) const {
+        return {session.fd, session.gen};
+    }
+    void close(ClientSession &session);
+    // free everything that's been closed.
+    void reclaim();
+
+    template <typename F> void for_each(F fn) {
+        for (auto &chunk : chunks) {
+            for (auto &s : *chunk) {
+                if (s.session && !s.session->closed) {
+                    fn(*s.session);
+                }
+            }
+        }
+    }
+    std::size_t size() const { return live; }
+};
+
+// Messages to everyone. Publishing one is a single store into a ring, however
+// many people are online. Nobody gets it pushed to them; each session keeps a
+// cursor into the ring and pulls whatever it hasn't had yet once its socket
+// has room (or right before anything else is sent to it, so everything still
+// arrives in order). Only the last capacity() broadcasts are kept, so a
+// session that falls further behind than that has lost some, and what happens
+// to it then is up to the LagPolicy.
+class BroadcastLog {
+  public:
+    struct Entry {
+        Netty::Payload bytes;
+        SessionHandle from; // who sent it, they don't get it back.
+    };
+
+  private:
+    std::vector<Entry> entries; // a power of two of them.
+    std::uint64_t head = 0;     // number of the next one published.
+
+  public:
+    explicit BroadcastLog(std::size_t capacity = 8192) {
+        std::size_t n = 1;
+        while (n < capacity) {
+            n *= 2;
+        }
+        entries.resize(n);
+    }
+
+    void publish(Netty::Payload bytes, SessionHandle from) {
+        entries[head & (entries.size() - 1)] = {std::move(bytes), from};
+        head++;
+    }
+    // the oldest broadcast that's still here, and one past the newest.
+    std::uint64_t begin() const {
+        return head > entries.size() ? head - entries.size() : 0;
+    }
+    std::uint64_t end() const { return head; }
+    const Entry &at(std::uint64_t n) const {
+        return entries[n & (entries.size() - 1)];
+    }
+    std::size_t capacity() const { return entries.size(); }
+};
+
+// what to do with a session that's fallen so far behind on broadcasts that
+// some it hasn't had yet are gone.
+enum class LagPolicy {
+    disconnect, // hang up on them, so they know they missed something.
+    skip,       // carry on from the oldest one that's left.
+};
+
+// usernames (or room names) -> sessions. Transparent, so a string_view out of a
+// packet can be looked up without making a string.
+struct NameHash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view name) const {
+        return std::hash<std::string_view>{}(name);
+    }
+};
+using NameMap =
+    std::unordered_map<std::string, SessionHandle, NameHash, std::equal_to<>>;
+using RoomMap = std::unordered_map<std::string, std::vector<SessionHandle>,
+                                   NameHash, std::equal_to<>>;
+
+// Everything the server does with its connections, without the option
+// parsing and signal handling that live in main(). It doesn't care where the
+// connections come from, so besides listening on real sockets it can be
+// handed one end of a socketpair() and driven from the same process (see
+// src/harness). It runs on whatever event loop it's given, epoll or
+// io_uring:
+//
+//     ChatServer server(loop);
+//     server.listen(listener);
+//     while (running) {
+//         loop.wait(-1);
+//         server.flush();
+//     }
+class ChatServer {
+    polly::EventLoop &loop;
+    polly::Ring *ring; // null unless loop is a Ring.
+
+    // big state table. Maps connections (file descriptors) to sessions
+    // (connection state)
+    SessionTable sessions;
+    // a map of usernames to sessions, managed by login/logout
+    NameMap username_sessions;
+    // rooms -> the sessions in them that are logged in right now. Who's in
+    // a room for good is in the store, this is just who to send to.
+    RoomMap room_members;
+    // messages to everyone, and how far along it everyone's been woken up
+    // for (see flush()).
+    BroadcastLog broadcasts;
+    std::uint64_t broadcasts_seen = 0;
+    LagPolicy lag_policy = LagPolicy::disconnect;
+    // whether a session's sent enough of what it has to pull more
+    // broadcasts. On epoll that's when its socket is flushed. The ring takes
+    // sends whether or not the socket has room, so there it's when less than
+    // ring_backlog bytes are still waiting. Until then they're left in the
+    // log, where falling behind is up to the LagPolicy.
+    static constexpr std::size_t ring_backlog = 64 * 1024;
+    bool caught_up(ClientSession *session) const;
+    // sessions that got new frames queued during this loop iteration. They
+    // get their EPOLLOUT turned on (or their frames handed to the ring) in
+    // flush(), so we only ever touch the sessions that changed.
+    std::vector<ClientSession *> dirty_sessions;
+
+    // the session name is logged in on, or nullptr.
+    ClientSession *online_session(std::string_view name) const;
+
+    // adding and removing a session from room_members.
+    void subscribe(ClientSession *session, const std::string &room);
+    void unsubscribe(ClientSession *session, const std::string &room);
+    // everything a session is in, for when it logs in and out.
+    void subscribe_all(ClientSession *session);
+    void unsubscribe_all(ClientSession *session);
+
+    std::size_t zerocopy_min = 0;
+    // Rate limits (see set_limits()). Buckets are refilled from limit_tick,
+    // which a timer bumps, rather than by reading the clock for each frame.
+    // Users' buckets outlive their sessions, so reconnecting doesn't get
+    // anyone a fresh one. Once nobody's using them and they've filled back
+    // up they're no different from new ones, so they're dropped.
+    static constexpr std::uint64_t limit_ticks_per_sec = 20;
+    Rate session_rate, user_rate;
+    std::unique_ptr<polly::TimerWheel> wheel;
+    std::uint64_t limit_tick = 0;
+    struct UserLimits {
+        Limits limits;
+        std::size_t sessions = 0; // logged in with them.
+    };
+    std::unordered_map<std::string, UserLimits> user_buckets;
+    // users whose last session left before their buckets were full again.
+    std::vector<std::string> idle_users;
+    std::vector<SessionHandle> throttled;
+    void limit_timer();
+    // charge session for a frame of size bytes. If that puts it over, it
+    // stops being read from and this returns false: the frame has been paid
+    // for, but it waits until they're back under.
+    bool charge(ClientSession *session, std::uint64_t size);
+    // session isn't using its user's buckets any more.
+    void release_user(ClientSession *session);
+    // every frame that comes in, if we're recording (see set_trace()).
+    std::unique_ptr<trace::Writer> tracer;
+    std::uint64_t trace_id(ClientSession *session) const {
+        return std::uint64_t(session->gen) << 32 | std::uint32_t(session->fd);
+    }
+    // where relayed files nobody wants get spliced to.
+    int devnull;
+    // for padding out the files of senders who left halfway through.
+    Netty::Payload zeros;
+
+    // prints the parts of a line one after the other. They're only put
+    // together if it's actually going to be printed.
+    template <typename... Parts> void log(const Parts &...parts) {
+        if (quiet || !polly::Logger::get().enabled(polly::level::info)) {
+            return;
+        }
+        std::string line;
+        (line.append(parts), ...);
+        print(polly::level::info, std::move(line));
+    }
+
+    // queueing things up for a session.
+    void queue_outgoing(ClientSession *session, Outgoing out);
+    void queue_frame(ClientSession *session, Netty::Payload payload);
+    void queue_frame(ClientSession *session, const Frame &frame);
+    void queue_raw(ClientSession *session, Netty::Payload bytes);
+    // queue_frame() without catching up on broadcasts first.
+    void push_frame(ClientSession *session, Netty::Payload payload);
+    // queue all the broadcasts a session hasn't had yet. Returns false if
+    // it was too far behind and got disconnected.
+    bool pull_broadcasts(ClientSession *session);
+    // apply the lag policy if a session's missed some. Returns false if it
+    // got disconnected.
+    bool catch_up(ClientSession *session);
+
+    // takes an input frame and gives an appropriate response.
+    std::optional<Frame> handle(message_t msg, Packet_t pkt,
+                                ClientSession *session);
+
+    // streamed files, see Relay.
+    bool offer_relay(std::shared_ptr<Relay> relay);
+    void kick(std::shared_ptr<Relay> relay);
+    void advance(std::shared_ptr<Relay> relay);
+    void finish(std::shared_ptr<Relay> relay);
+
+    // connection handling.
+    void update_interest(ClientSession *session);
+    void close_connection(Netty::Socket &s);
+    void process_frames(ClientSession *session);
+    void flush_session(ClientSession *session);
+    void wake_broadcast_readers();
+    void flush_dirty();
+    void count_out(const Outgoing &out);
+    void client_handler(Netty::Socket &s, int events);
+    void accept_handler(Netty::Socket &s, int events);
+    ClientSession &new_session(std::shared_ptr<Netty::Socket> sock);
+
+    // admin connections that are still being sent the metrics.
+    std::map<int, std::shared_ptr<Netty::Socket>> scrapers;
+    void metrics_handler(Netty::Socket &s, int events);
+
+  public:
+    // accounts, offline messages and rooms. Loaded when the server starts. Changes
+    // are journaled, and committed at the start of each flush().
+    DataStore<ServerData> store;
+    // don't print anything about what clients are doing.
+    bool quiet = false;
+    // what's been going on, see metrics.hpp.
+    Metrics metrics;
+
+    // store_path is where the store lives on disk. Empty keeps it in
+    // memory only.
+    explicit ChatServer(polly::EventLoop &loop,
+                        const std::string &store_path = "serverdata.bin");
+    ChatServer(const ChatServer &other) = delete;
+    ~ChatServer();
+
+    // Send frames at least this big with MSG_ZEROCOPY (see
+    // Netty::Socket::set_zerocopy()). Only affects connections made after
+    // this, and only on epoll.
+    void set_zerocopy(std::size_t threshold) { zerocopy_min = threshold; }
+
+    // keep the last capacity broadcasts (see BroadcastLog), and deal with
+    // sessions that fall further behind than that this way. Call it before
+    // anyone's connected.
+    void set_broadcast(std::size_t capacity, LagPolicy policy) {
+        broadcasts = BroadcastLog(capacity);
+        broadcasts_seen = 0;
+        lag_policy = policy;
+    }
+
+    // Cap how much each connection (before and after logging in), and each
+    // user across all their connections, can send per second. Frames are
+    // charged before they're handled, and once someone's over, the frame
+    // that did it and everything after it waits until they're back under.
+    // Nothing gets thrown out: we stop reading from them (pausing EPOLLIN,
+    // or the multishot recv on io_uring), so their frames wait in their
+    // socket buffer and then TCP's window. Call it before anyone's
+    // connected.
+    void set_limits(Rate session, Rate user);
+
+    // record every frame clients send to a trace at path (see trace.hpp),
+    // to play back with bin/replay. Throws std::system_error if the file
+    // can't be made.
+    void set_trace(const std::string &path) {
+        tracer = std::make_unique<trace::Writer>(path);
+    }
+
+    // accept connections from a bound and listening socket. On epoll it has
+    // to be non-blocking, on io_uring it has to be blocking.
+    void listen(std::shared_ptr<Netty::Socket> listener);
+
+    // take on a connection that's already open, like one end of a
+    // socketpair(). Returns its fd. On epoll it has to be non-blocking.
+    int adopt(std::shared_ptr<Netty::Socket> sock);
+
+    // Whoever connects to this (bound and listening, non-blocking on either
+    // backend) gets sent metrics_text() and hung up on:
+    //
+    //     socat - UNIX-CONNECT:/tmp/gchat-admin.sock
+    void serve_metrics(std::shared_ptr<Netty::Socket> listener);
+    // everything in metrics, and the gauges, in Prometheus' text format.
+    std::string metrics_text();
+
+    // Hand everything queued up during the last loop.wait() to the
+    // sockets. Call it after every wait(). Throws std::system_error if the
+    // store couldn't be saved, before anything's been sent. Whatever those
+    // changes were is only in memory now, so stop the server: retrying after
+    // a failed fdatasync() can't tell us the data made it.
+    void flush();
+
+    std::size_t connections() const { return sessions.size(); }
+    std::size_t online() const { return username_sessions.size(); }
+};
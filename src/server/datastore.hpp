@@ -4,91 +4,228 @@
 
 #include "surreal/surreal.hpp"
 #include "libchat.hpp"
-#include <fstream>
-#include <sys/stat.h>
-#include <iostream>
-
+#include "journal.hpp"
+#include "polly/eventfd.hpp"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+// The data lives in two files: a snapshot of all of it (filename), and a
+// journal of the changes since (filename.journal). Changes go through
+// apply(), which makes them in memory and appends them to the journal, and
+// commit() makes everything applied so far durable in one go. Loading reads
+// the snapshot and replays the journal on top.
+//
+// Once the journal gets big it's compacted: it's set aside as
+// filename.journal.old, a fresh one is started, the data so far is frozen,
+// and a thread writes that out as the new snapshot, then deletes the old
+// journal. When it's done it pokes an EventFd, and the loop opens the new
+// snapshot in place of the frozen data (see finish_compaction()). Every
+// journal has a generation number and the snapshot remembers the last one it
+// includes, so a crash at any point in there still replays each change
+// exactly once.
+//
+// T decides what a snapshot looks like. It needs:
+//  - a Record type describing one change, and apply(const Record &) to make
+//    it.
+//  - freeze(), which returns a Frozen view of everything so far that won't
+//    change any more (later changes go on top of it), without copying it.
+//  - static make_snapshot(frozen, generation), which returns the bytes of a
+//    snapshot of a Frozen. It's called from the compaction thread.
+//  - open_snapshot(path), which loads (or maps) the snapshot at path in place
+//    of whatever was frozen for it, and returns its generation, or 0 if
+//    there isn't one.
 template<typename T>
 class DataStore {
+    using Record = typename T::Record;
+    using Frozen = typename T::Frozen;
 
     std::string filename;
+    std::uint64_t generation = 0; // of the journal being written.
+    std::unique_ptr<Journal> journal;
+    std::thread compactor;
+    std::atomic<bool> compacting = false;
+    std::atomic<bool> compact_failed = false;
+
+    std::string journal_path() const { return filename + ".journal"; }
+    std::string old_journal_path() const { return filename + ".journal.old"; }
+
+    static void write_snapshot(const std::string &path, const Frozen &frozen,
+                               std::uint64_t generation) {
+        replace_file(path, T::make_snapshot(frozen, generation));
+    }
+
+    // replay a journal file, if it has anything the snapshot doesn't.
+    // Returns its generation if it did.
+    std::optional<Journal::Contents> replay(const std::string &path,
+                                            std::uint64_t snapshot) {
+        auto contents = Journal::read(path);
+        if (!contents.exists || contents.generation <= snapshot) {
+            return std::nullopt;
+        }
+        for (auto &bytes : contents.records) {
+            Record record;
+            auto buf = surreal::DataBuf(bytes.begin(), bytes.end());
+            buf.deserialize(record);
+            data.apply(record);
+        }
+        return contents;
+    }
+
+    // the compaction thread is done, so its snapshot (if it managed to write
+    // one) has everything it froze.
+    void reopen() {
+        compactor.join();
+        if (compact_failed) {
+            return;
+        }
+        try {
+            data.open_snapshot(filename);
+        } catch (std::runtime_error &e) {
+            // the frozen changes are still there, but there can't be another
+            // freeze on top of them.
+            print(std::string("ERROR: couldn't open the new snapshot: ") +
+                  e.what());
+            compact_failed = true;
+        }
+    }
+
+    void compact() {
+        if (compactor.joinable()) {
+            reopen(); // nobody called finish_compaction().
+        }
+        journal->commit();
+        journal.reset();
+        if (std::rename(journal_path().c_str(),
+                        old_journal_path().c_str()) == -1) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "rename() failed");
+        }
+        std::uint64_t snapshot = generation++;
+        journal = std::make_unique<Journal>(journal_path(), generation);
+        // nothing gets copied here, serializing it and waiting on the disk
+        // happen over there.
+        compacting = true;
+        compactor = std::thread([this, frozen = data.freeze(), snapshot] {
+            try {
+                write_snapshot(filename, frozen, snapshot);
+                ::unlink(old_journal_path().c_str());
+            } catch (std::system_error &e) {
+                // the old journal has to stay, so no compacting again until
+                // a restart sorts it out.
+                print(std::string("ERROR: compaction failed: ") + e.what());
+                compact_failed = true;
+            }
+            compacting = false;
+            try {
+                compacted->notify();
+            } catch (std::system_error &e) {
+                // then the next compaction picks it up instead.
+            }
+        });
+    }
+
 public:
     T data;
+    // readable once a compaction has finished. Add it to the event loop and
+    // call finish_compaction() when it is, so the deltas it covers don't
+    // hang around until the next one.
+    std::shared_ptr<polly::EventFd> compacted =
+        std::make_shared<polly::EventFd>();
+    // compact once the journal is this big.
+    std::uint64_t compact_after = 16 * 1024 * 1024;
+
+    // an empty fname keeps everything in memory, nothing is saved.
     DataStore(std::string fname) {
         filename = fname;
     }
-
+    DataStore(const DataStore &other) = delete;
 
     ~DataStore() {
-        save();
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+        if (journal) {
+            try {
+                journal->commit();
+            } catch (std::system_error &e) {
+                print(std::string("ERROR: couldn't save: ") + e.what());
+            }
+        }
     }
+
+    // throw everything out, on disk as well.
     void reset() {
         data = T();
-        save();
+        if (filename.empty()) {
+            return;
+        }
+        journal.reset();
+        ::unlink(journal_path().c_str());
+        ::unlink(old_journal_path().c_str());
+        write_snapshot(filename, T().freeze(), 0);
     }
 
-    void save() {
-
-        std::vector<uint8_t> vec = surreal::DataBuf(data);
-
-        std::ofstream f(filename, std::ios::out | std::ios::binary | std::ios::trunc);
-
-        f.write(reinterpret_cast<char*>(vec.data()), vec.size());
-    }
     void load() {
-        // if file not exist, default initializer and return
-        // open the file at the end so that we can use tellg to get file size.
-        std::ifstream f(filename, std::ios::in | std::ios::binary | std::ios::ate);
-
-        if (!f.good()) {
-            data = T();
-            return;
+        data = T();
+        if (filename.empty()) {
+            return; // in-memory only.
+        }
+        std::uint64_t snapshot = data.open_snapshot(filename);
+        generation = snapshot + 1;
+        auto old = replay(old_journal_path(), snapshot);
+        auto current = replay(journal_path(), snapshot);
+        if (old) {
+            // we went down in the middle of compacting. Finish it now, so
+            // there's only ever one old journal.
+            generation = (current ? current->generation : old->generation);
+            write_snapshot(filename, data.freeze(), generation++);
+            data.open_snapshot(filename);
+            ::unlink(journal_path().c_str());
+            current.reset();
+        }
+        ::unlink(old_journal_path().c_str());
+        if (current) {
+            generation = current->generation;
+            journal = std::make_unique<Journal>(journal_path(), generation,
+                                                current->length);
+        } else {
+            journal = std::make_unique<Journal>(journal_path(), generation);
         }
-
-        auto fsize = f.tellg();
-        f.seekg(std::ios::beg);
-
-        std::vector<char> vec(fsize);
-
-        f.read(vec.data(),fsize);
-
-        auto buf = surreal::DataBuf(vec.begin(), vec.end());
-
-        buf.deserialize(data);
-        
     }
-};
-
 
-
-struct ServerData {
-    // this is a list of username:password that we use to authenticate.
-    std::vector<LoginPacket> user_database;
-
-
-    auto find_user(std::string user) {
-        auto lamb = [user](LoginPacket l) {
-            return l.username == user;
-        };
-        return std::find_if(user_database.begin(), user_database.end(), lamb);
+    // swap in the snapshot from a compaction that's finished, dropping the
+    // changes it has. Does nothing if there isn't one.
+    void finish_compaction() {
+        compacted->read();
+        if (!compacting && compactor.joinable()) {
+            reopen();
+        }
     }
 
-    std::vector<MessagePacket> offline_msgs;
-
-    auto get_user_msgs(std::string user) {
-        auto lamb = [user](MessagePacket m) {
-            return m.destination == user;
-        };
-        return std::find_if(offline_msgs.begin(), offline_msgs.end(), lamb);
+    // make a change, and log it so it survives a restart (once committed).
+    void apply(const Record &record) {
+        data.apply(record);
+        if (journal) {
+            std::vector<std::uint8_t> bytes = surreal::DataBuf(record);
+            journal->append(bytes);
+        }
     }
-    auto clear_user_msgs(std::string user) {
-        auto lamb = [user](MessagePacket m) {
-            return m.destination == user;
-        };
-        return offline_msgs.erase(std::remove_if(offline_msgs.begin(), offline_msgs.end(), lamb),
-                offline_msgs.end());
+
+    // make everything applied so far durable. Call it before telling anyone
+    // their change went through. Errors are thrown as std::system_error.
+    void commit() {
+        if (!journal) {
+            return;
+        }
+        journal->commit();
+        if (journal->size() >= compact_after && !compacting &&
+            !compact_failed) {
+            compact();
+        }
     }
-    MAKE_SERIAL(user_database, offline_msgs)
 };
-
-
@@ -0,0 +1,181 @@
+#include "journal.hpp"
+#include "netty/frames.hpp"
+#include "surreal/surreal.hpp"
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+bool read_file(const std::string &path, std::vector<std::uint8_t> &bytes) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        return false;
+    }
+    struct stat st;
+    if (fd == -1 || ::fstat(fd, &st) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "couldn't open " + path);
+    }
+    bytes.resize(st.st_size);
+    std::size_t done = 0;
+    while (done < bytes.size()) {
+        ssize_t n = ::read(fd, bytes.data() + done, bytes.size() - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            int err = n == 0 ? EIO : errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(),
+                                    "couldn't read " + path);
+        }
+        done += n;
+    }
+    ::close(fd);
+    return true;
+}
+
+Journal::Contents Journal::read(const std::string &path) {
+    Contents contents;
+    std::vector<std::uint8_t> bytes;
+    if (!read_file(path, bytes)) {
+        return contents;
+    }
+    contents.exists = true;
+
+    std::size_t at = 0;
+    bool header = true;
+    while (bytes.size() - at >= Netty::frame_header_size &&
+           bytes[at] == Netty::frame_magic) {
+        std::uint64_t size;
+        std::memcpy(&size, &bytes[at + 1], sizeof(size));
+        size = be64toh(size);
+        if (size > bytes.size() - at - Netty::frame_header_size) {
+            break; // cut off.
+        }
+        auto start = bytes.begin() + at + Netty::frame_header_size;
+        if (header) {
+            auto buf = surreal::DataBuf(start, start + size);
+            buf.deserialize(contents.generation);
+            header = false;
+        } else {
+            contents.records.emplace_back(start, start + size);
+        }
+        at += Netty::frame_header_size + size;
+    }
+    contents.length = header ? 0 : at;
+    return contents;
+}
+
+Journal::Journal(const std::string &path, std::uint64_t generation,
+                 std::uint64_t length) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "open() failed");
+    }
+    // anything past the last complete record is junk from a crash.
+    if (::ftruncate(fd, length) == -1 || ::lseek(fd, length, SEEK_SET) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "ftruncate() failed");
+    }
+    written = length;
+    if (length == 0) {
+        std::vector<std::uint8_t> header = surreal::DataBuf(generation);
+        append(header);
+        commit();
+    }
+}
+
+Journal::~Journal() { ::close(fd); }
+
+void Journal::append(std::span<const std::uint8_t> record) {
+    std::uint64_t size = htobe64(record.size());
+    pending.push_back(Netty::frame_magic);
+    auto *p = reinterpret_cast<const std::uint8_t *>(&size);
+    pending.insert(pending.end(), p, p + sizeof(size));
+    pending.insert(pending.end(), record.begin(), record.end());
+}
+
+void Journal::commit() {
+    std::size_t done = 0;
+    while (done < pending.size()) {
+        ssize_t n = ::write(fd, pending.data() + done, pending.size() - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            int err = errno;
+            // put the file back how it was, so a retry doesn't leave half a
+            // record in the middle.
+            if (::ftruncate(fd, written) == 0) {
+                ::lseek(fd, written, SEEK_SET);
+            }
+            throw std::system_error(err, std::generic_category(),
+                                    "write() failed");
+        }
+        done += n;
+    }
+    if (done == 0) {
+        return;
+    }
+    written += done;
+    pending.clear();
+    if (::fdatasync(fd) == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "fdatasync() failed");
+    }
+}
+
+void replace_file(const std::string &path,
+                  const std::vector<std::uint8_t> &bytes) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+    if (fd == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "open() failed");
+    }
+    std::size_t done = 0;
+    while (done < bytes.size()) {
+        ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(),
+                                    "write() failed");
+        }
+        done += n;
+    }
+    if (::fsync(fd) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "fsync() failed");
+    }
+    ::close(fd);
+    if (::rename(tmp.c_str(), path.c_str()) == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "rename() failed");
+    }
+    // the rename itself isn't on disk until the directory is.
+    auto slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    if (dir.empty()) {
+        dir = "/";
+    }
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd != -1) {
+        ::fsync(dfd);
+        ::close(dfd);
+    }
+}
@@ -0,0 +1,64 @@
+// journal.hpp - append-only log of changes, for DataStore
+// (c) Saji Champlin 2022
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// A Journal is a file that records only ever get added to the end of. Each one
+// is framed the same way as on the wire (magic byte, 64 bit big endian size,
+// payload), and the first one is a header holding the file's generation.
+//
+// Appending just buffers the record. commit() writes everything appended
+// since the last one in a single write() and then fdatasync()s once, so a
+// whole batch of changes costs one disk flush (group commit). Whoever called
+// commit() can tell people their changes are safe once it returns.
+//
+// If we crash halfway through a write, the last record can be cut off. read()
+// stops at the last complete record, and opening the file again cuts off
+// whatever came after it.
+class Journal {
+    int fd = -1;
+    std::vector<std::uint8_t> pending; // appended but not written yet.
+    std::uint64_t written = 0;         // bytes in the file.
+
+  public:
+    // what's in a journal file.
+    struct Contents {
+        bool exists = false;
+        std::uint64_t generation = 0;
+        std::vector<std::vector<std::uint8_t>> records;
+        std::uint64_t length = 0; // how much of the file is complete records.
+    };
+    // Throws std::system_error if the file exists but can't be read.
+    static Contents read(const std::string &path);
+
+    // open path to add records to. If it's there already, length is how much
+    // of it to keep (from read()); otherwise it's created with a header for
+    // generation.
+    Journal(const std::string &path, std::uint64_t generation,
+            std::uint64_t length = 0);
+    Journal(const Journal &other) = delete;
+    ~Journal();
+
+    void append(std::span<const std::uint8_t> record);
+
+    // write and fdatasync() what's been appended. Does nothing if there's
+    // nothing new. Errors are thrown as std::system_error, and the records
+    // stay pending so the next commit() tries them again.
+    void commit();
+
+    // bytes in the file once everything pending is written.
+    std::uint64_t size() const { return written + pending.size(); }
+};
+
+// the whole of a file, for snapshots and journals. Returns false if it
+// doesn't exist, other errors are thrown as std::system_error.
+bool read_file(const std::string &path, std::vector<std::uint8_t> &bytes);
+
+// replace the file at path with bytes, so that after a crash it's either all
+// the old contents or all the new ones: write a temporary file, fsync() it,
+// rename() it over the old one and fsync() the directory.
+void replace_file(const std::string &path,
+                  const std::vector<std::uint8_t> &bytes);
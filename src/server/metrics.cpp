@@ -0,0 +1,160 @@
+#include "metrics.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <utility>
+
+message_t Metrics::type_of(std::span<const std::uint8_t> frame) {
+    // a Frame is serialized as its version (one byte) and then its type, a
+    // 32 bit big endian int. See Frame and surreal::DataBuf.
+    std::uint32_t type = 0;
+    if (frame.size() >= 1 + sizeof(type)) {
+        std::memcpy(&type, frame.data() + 1, sizeof(type));
+    }
+    return message_t(be32toh(type));
+}
+
+// every type, for the labels.
+static const std::pair<message_t, const char *> type_names[] = {
+    {message_t::MSG_OK, "OK"},
+    {message_t::MSG_REGISTER, "REGISTER"},
+    {message_t::MSG_LOGIN, "LOGIN"},
+    {message_t::MSG_LOGOUT, "LOGOUT"},
+    {message_t::MSG_SEND, "SEND"},
+    {message_t::MSG_XFER, "XFER"},
+    {message_t::MSG_GETLIST, "GETLIST"},
+    {message_t::MSG_LIST, "LIST"},
+    {message_t::MSG_STREAM, "STREAM"},
+    {message_t::MSG_JOIN, "JOIN"},
+    {message_t::MSG_PART, "PART"},
+    {message_t::MSG_ROOM, "ROOM"},
+    {message_t::ERR_NOLOGIN, "ERR_NOLOGIN"},
+    {message_t::ERR_NOTREGISTERED, "ERR_NOTREGISTERED"},
+    {message_t::ERR_ALREADYLOGGEDIN, "ERR_ALREADYLOGGEDIN"},
+    {message_t::ERR_USEREXISTS, "ERR_USEREXISTS"},
+    {message_t::ERR_NOSUCHUSER, "ERR_NOSUCHUSER"},
+    {message_t::ERR_PASSWRONG, "ERR_PASSWRONG"},
+    {message_t::ERR_NOPERMS, "ERR_NOPERMS"},
+    {message_t::ERR_NOTMEMBER, "ERR_NOTMEMBER"},
+    {message_t::ERR_BADNAME, "ERR_BADNAME"},
+};
+
+namespace {
+// builds up the text, one metric at a time.
+struct Writer {
+    std::string out;
+
+    void header(const char *name, const char *type, const char *help) {
+        out += std::string("# HELP ") + name + " " + help + "\n";
+        out += std::string("# TYPE ") + name + " " + type + "\n";
+    }
+    void value(const std::string &name, double v) {
+        char buf[64];
+        // counts come out as plain integers, however big they get.
+        if (v == std::floor(v) && std::fabs(v) < 1e15) {
+            snprintf(buf, sizeof(buf), " %.0f\n", v);
+        } else {
+            snprintf(buf, sizeof(buf), " %.9g\n", v);
+        }
+        out += name + buf;
+    }
+    void single(const char *name, const char *type, const char *help,
+                double v) {
+        header(name, type, help);
+        value(name, v);
+    }
+    // scale turns whatever was recorded into the unit in the name, e.g 1e-9
+    // for nanoseconds into seconds.
+    void summary(const char *name, const char *help, const polly::Histogram &h,
+                 double scale = 1) {
+        header(name, "summary", help);
+        std::string n = name;
+        for (double q : {0.5, 0.9, 0.99}) {
+            char label[32];
+            snprintf(label, sizeof(label), "{quantile=\"%g\"}", q);
+            value(n + label, h.percentile(q * 100) * scale);
+        }
+        value(n + "_sum", h.sum() * scale);
+        value(n + "_count", h.count());
+    }
+    void by_type(const char *name, const char *help,
+                 const std::array<std::atomic<std::uint64_t>,
+                                  Metrics::type_slots> &counts) {
+        header(name, "counter", help);
+        for (auto &[type, label] : type_names) {
+            auto n = counts[Metrics::slot(type)].load(std::memory_order_relaxed);
+            if (n > 0) {
+                value(std::string(name) + "{type=\"" + label + "\"}", n);
+            }
+        }
+    }
+};
+} // namespace
+
+std::string render_metrics(const Metrics &m, const Gauges &g,
+                           const polly::LoopStats &loop) {
+    auto get = [](const std::atomic<std::uint64_t> &a) {
+        return double(a.load(std::memory_order_relaxed));
+    };
+    Writer w;
+    w.by_type("gchat_frames_in_total", "Frames received, by type.",
+              m.frames_in);
+    w.by_type("gchat_frames_out_total", "Frames sent, by type.", m.frames_out);
+    w.single("gchat_bytes_in_total", "counter",
+             "Bytes received, including streamed files.", get(m.bytes_in));
+    w.single("gchat_bytes_out_total", "counter",
+             "Bytes sent, including streamed files.", get(m.bytes_out));
+    w.single("gchat_connections_accepted_total", "counter",
+             "Connections taken on since the server started.",
+             get(m.accepted));
+    w.single("gchat_mail_stored_total", "counter",
+             "Messages saved for users who were offline.",
+             get(m.mail_stored));
+    w.single("gchat_throttled_total", "counter",
+             "Times a client went over its rate limit and was paused.",
+             get(m.throttled));
+    w.single("gchat_connections", "gauge", "Open connections.", g.connections);
+    w.single("gchat_online_users", "gauge", "Logged in users.", g.online);
+    w.single("gchat_active_rooms", "gauge",
+             "Rooms with at least one member online.", g.rooms);
+    w.single("gchat_unsent_bytes", "gauge",
+             "Bytes queued on sockets and not sent yet, all sessions.",
+             g.unsent_bytes);
+    w.single("gchat_max_session_unsent_bytes", "gauge",
+             "The most bytes queued for any one session.", g.max_unsent_bytes);
+    w.single("gchat_held_frames", "gauge",
+             "Frames waiting for a streamed file or a backlog.", g.held);
+    w.single("gchat_broadcasts_total", "counter",
+             "Messages published to everyone.", g.broadcasts);
+    w.single("gchat_broadcast_log_capacity", "gauge",
+             "Broadcasts kept for sessions that are behind.",
+             g.broadcast_capacity);
+    w.single("gchat_log_dropped_total", "counter",
+             "Log lines dropped because the logger couldn't keep up.",
+             g.log_dropped);
+    w.summary("gchat_handler_seconds", "Time spent handling each frame.",
+              m.handler_ns, 1e-9);
+    w.summary("gchat_session_unsent_bytes",
+              "Bytes left queued on a session's socket after each flush.",
+              m.unsent_bytes);
+    w.summary("gchat_broadcast_fanout",
+              "Users online for each message to everyone.",
+              m.broadcast_fanout);
+    w.summary("gchat_room_fanout", "Users sent each room message.",
+              m.room_fanout);
+    w.summary("gchat_mailbox_size",
+              "Offline messages handed over when someone logs in.",
+              m.mailbox_size);
+    // and the event loop's own numbers, see polly::LoopStats.
+    w.single("gchat_loop_wakeups_total", "counter",
+             "Times the event loop woke up.", get(loop.wakeups));
+    w.single("gchat_loop_events_total", "counter",
+             "Events the event loop handled.", get(loop.events));
+    w.summary("gchat_loop_blocked_seconds",
+              "Time spent waiting in the kernel, per wakeup.", loop.blocked_ns,
+              1e-9);
+    w.summary("gchat_loop_busy_seconds",
+              "Time spent running handlers, per wakeup.", loop.busy_ns, 1e-9);
+    return w.out;
+}
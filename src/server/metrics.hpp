@@ -0,0 +1,68 @@
+// metrics.hpp - counters about what the server's doing, for the admin socket
+// (c) Saji Champlin 2022
+#pragma once
+#include "libchat.hpp"
+#include "polly/stats.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <string>
+
+// Everything here is only written from the loop thread, so like
+// polly::LoopStats it's relaxed atomics bumped with polly::bump(): the same
+// instructions as a plain increment, and safe to read from anywhere. Keeping
+// them up to date costs a few adds per frame. Anything that would mean
+// walking every session (queue depths and so on) is worked out when someone
+// asks instead, see Gauges.
+struct Metrics {
+    // frames are counted by message_t. The types aren't contiguous (errors
+    // start at 400), so they're squashed into slots first.
+    static constexpr std::size_t type_slots = 32;
+    static std::size_t slot(message_t type) {
+        auto n = std::size_t(type);
+        if (n < 16) {
+            return n;
+        }
+        if (n >= 400 && n < 400 + type_slots - 17) {
+            return 16 + (n - 400);
+        }
+        return type_slots - 1; // anything else.
+    }
+    // the type of a serialized Frame, without deserializing all of it.
+    static message_t type_of(std::span<const std::uint8_t> frame);
+
+    std::array<std::atomic<std::uint64_t>, type_slots> frames_in = {};
+    std::array<std::atomic<std::uint64_t>, type_slots> frames_out = {};
+    // on the wire, frame headers and streamed files included.
+    std::atomic<std::uint64_t> bytes_in = 0;
+    std::atomic<std::uint64_t> bytes_out = 0;
+    std::atomic<std::uint64_t> accepted = 0;
+    std::atomic<std::uint64_t> mail_stored = 0;
+    std::atomic<std::uint64_t> throttled = 0; // times someone was over.
+
+    polly::Histogram handler_ns;       // handle(), per frame.
+    polly::Histogram unsent_bytes;     // left on a session's socket per flush.
+    polly::Histogram broadcast_fanout; // people online for each broadcast.
+    polly::Histogram room_fanout;      // people sent each room message.
+    polly::Histogram mailbox_size;     // offline messages handed over a login.
+};
+
+// Numbers that are cheaper to work out when they're asked for than to keep
+// up to date.
+struct Gauges {
+    std::uint64_t connections = 0;
+    std::uint64_t online = 0;
+    std::uint64_t rooms = 0;
+    std::uint64_t unsent_bytes = 0; // across every session's socket.
+    std::uint64_t max_unsent_bytes = 0;
+    std::uint64_t held = 0; // frames waiting on a file to finish.
+    std::uint64_t broadcasts = 0;
+    std::uint64_t broadcast_capacity = 0;
+    std::uint64_t log_dropped = 0;
+};
+
+// All of it in the Prometheus text exposition format, histograms as
+// summaries (quantiles, sum and count).
+std::string render_metrics(const Metrics &m, const Gauges &g,
+                           const polly::LoopStats &loop);
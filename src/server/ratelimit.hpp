@@ -0,0 +1,80 @@
+// ratelimit.hpp - token buckets, for clients that send too much
+// (c) Saji Champlin 2022
+#pragma once
+#include <algorithm>
+#include <cstdint>
+
+// How much someone's allowed to send, per second. 0 is no limit.
+struct Rate {
+    std::uint64_t messages = 0;
+    std::uint64_t bytes = 0;
+
+    bool any() const { return messages > 0 || bytes > 0; }
+};
+
+// A token bucket that never looks at the clock. Time is counted in ticks by
+// whoever owns it (a timer, see ChatServer::set_limits()), and the bucket
+// works out what it's owed from how many ticks went by since it was last
+// refilled. So taking tokens is a subtraction, not a clock read.
+//
+// Taking can go past empty: whatever it was for has already arrived, and the
+// owner's meant to stop reading until the debt's paid off (see in_debt()),
+// not throw anything away. It holds up to a second's worth, so a burst right
+// after being quiet goes through.
+//
+// Everything's kept in 1/ticks_per_sec of a token, so slow rates don't get
+// rounded down to nothing per tick.
+class TokenBucket {
+    std::int64_t tokens = 0;
+    std::int64_t burst = 0; // 0 for no limit.
+    std::uint64_t filled = 0;
+    std::uint64_t scale = 1;
+    std::uint64_t rate = 0;
+
+  public:
+    TokenBucket() = default;
+    TokenBucket(std::uint64_t per_sec, std::uint64_t ticks_per_sec,
+                std::uint64_t now)
+        : tokens(per_sec * ticks_per_sec), burst(per_sec * ticks_per_sec),
+          filled(now), scale(ticks_per_sec), rate(per_sec) {}
+
+    void refill(std::uint64_t now) {
+        if (burst == 0 || now <= filled) {
+            return;
+        }
+        // no overflow even after a long quiet spell, it'd be full anyway.
+        std::uint64_t ticks = std::min<std::uint64_t>(now - filled, scale);
+        tokens = std::min<std::int64_t>(burst, tokens + ticks * rate);
+        filled = now;
+    }
+    void take(std::uint64_t n) {
+        if (burst > 0) {
+            tokens -= n * scale;
+        }
+    }
+    bool in_debt() const { return tokens < 0; }
+    // as good as a new one.
+    bool full() const { return tokens >= burst; }
+};
+
+// a message bucket and a byte bucket, which is what gets limited.
+struct Limits {
+    TokenBucket messages;
+    TokenBucket bytes;
+
+    Limits() = default;
+    Limits(Rate rate, std::uint64_t ticks_per_sec, std::uint64_t now)
+        : messages(rate.messages, ticks_per_sec, now),
+          bytes(rate.bytes, ticks_per_sec, now) {}
+
+    void refill(std::uint64_t now) {
+        messages.refill(now);
+        bytes.refill(now);
+    }
+    void take(std::uint64_t size) {
+        messages.take(1);
+        bytes.take(size);
+    }
+    bool in_debt() const { return messages.in_debt() || bytes.in_debt(); }
+    bool full() const { return messages.full() && bytes.full(); }
+};
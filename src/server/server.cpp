@@ -1,203 +1,189 @@
 // Server main source
 
+#include "chatserver.hpp"
 #include "libchat.hpp"
 #include "netty/netty.hpp"
 #include "polly/polly.hpp"
-#include "polly/timer.hpp"
-#include "surreal/surreal.hpp"
-#include "datastore.hpp"
-#include <arpa/inet.h>
-#include <cstdio>
-#include <ios>
-#include <iostream>
+#include "polly/ring.hpp"
+#include "polly/signal.hpp"
+#include <getopt.h>
 #include <memory>
-#include <queue>
 #include <stdlib.h>
-#include <csignal>
-#include <time.h>
+#include <system_error>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// A container for client connection state.
-// contains their username, whether or not they are authenticated,
-// as well as sending and recv queues.
-struct ClientSession {
-    bool authed = false;
-    std::string username;
-    recv_state r_state;
-    std::queue<Frame> send_queue;
-};
-
-// big state table. Maps connections (file descriptors) to sessions (connection
-// state)
-auto socket_sessions = std::map<int, std::shared_ptr<ClientSession>>{};
-// a map of usernames to sessions, managed by login/logout
-auto username_sessions =
-    std::map<std::string, std::shared_ptr<ClientSession>>{};
-
-// on-disk stuff.
-
-auto store = DataStore<ServerData>("serverdata.bin");
-
-// takes an input frame and gives an appropriate response.
-std::optional<Frame> clientHandler(message_t msg, Packet_t pkt,
-                                   std::shared_ptr<ClientSession> session) {
-    if (msg == message_t::MSG_REGISTER) {
-        // check that username doesn't exist,
-        auto contents = std::get<LoginPacket>(pkt);
-        if (store.data.find_user(contents.username) != store.data.user_database.end()) {
-            // user exists.
-            return make_frame(message_t::ERR_USEREXISTS);
-        }
-        // store password and return ok
-        store.data.user_database.push_back(contents);
-        print("Account registered: " + contents.username);
-        return make_frame(message_t::MSG_OK);
+// "MSGS" or "MSGS,BYTES" (per second) for --session-limit and --user-limit.
+static Rate parse_rate(const char *arg) {
+    char *end;
+    Rate rate;
+    rate.messages = std::strtoull(arg, &end, 10);
+    if (*end == ',') {
+        rate.bytes = std::strtoull(end + 1, &end, 10);
     }
-    if (msg == message_t::MSG_LOGIN) {
-        auto contents = std::get<LoginPacket>(pkt);
-        auto pw = store.data.find_user(contents.username);
-        if (pw == store.data.user_database.end()) {
-	    print("Login attempt failed: " + contents.username + " not registered");
-            return make_frame(message_t::ERR_NOTREGISTERED);
-        }
-        if (pw->password != contents.password) {
-	    print("Login attempt failed: " + contents.username + " incorrect password");
-            return make_frame(message_t::ERR_PASSWRONG);
-        }
-        if (username_sessions.find(contents.username) !=
-            username_sessions.end()) {
-	    print("Login attempt failed: " + contents.username + " already logged in");
-            return make_frame(message_t::ERR_ALREADYLOGGEDIN);
-        }
-        if (session->authed) {
-	    print("Login attempt failed: " + contents.username + " already logged in");
-            return make_frame(message_t::ERR_ALREADYLOGGEDIN);
-        }
-	print(contents.username + " logged in successfully");
-        // set authed and username.
-        session->authed = true;
-        session->username = contents.username;
-        // add username + session pointer.
-        username_sessions[contents.username] = session;
-        // restore messages and clear them.
-        std::for_each(store.data.get_user_msgs(contents.username), store.data.offline_msgs.end(),
-                [&session](const MessagePacket& m){
-                    session->send_queue.push(make_frame(message_t::MSG_SEND, m));
-                });
-        store.data.clear_user_msgs(contents.username);
-        return make_frame(message_t::MSG_OK);
+    if (*end != '\0') {
+        throw std::invalid_argument(std::string("bad rate ") + arg);
     }
-    if (msg == message_t::MSG_SEND) {
-        if (!session->authed) {
-	    print("Failed to send message: not logged in");
-            return make_frame(message_t::ERR_NOLOGIN);
-        }
-        // to broadcast, loop over username_sessions and put frame on send_queue
-        // if username not current user for DMs, try accessing the session
-        // directly.
-        auto contents = std::get<MessagePacket>(pkt);
-        if (contents.username != session->username && contents.username != "") {
-            // not an anonymous and not a message from us, so we respond with an
-            // error. NOPERMS. This means that some clients can have permissions
-            // to send as anyone. (admins).
-	    print(session->username + " tried to send a message as " + contents.username + ", but they don't have permission");
-            return make_frame(message_t::ERR_NOPERMS);
-        }
-        auto message = make_frame(msg, contents);
-        if (contents.destination == "") {
-            // broadcast-type message.
-            
-            print(session->username + " sending " + (contents.username == "a" ? "an anonymous " : "") + "message to everyone");
-            for (const auto &[name, ses] : username_sessions) {
-                if (name != session->username) {
-                    ses->send_queue.push(message);
-                }
-            }
-        } else {
-            print(session->username + " sending " + (contents.username == "a" ? "an anonymous " : "") + "message to " +
-                    contents.destination);
-            try {
-                username_sessions.at(contents.destination)
-                    ->send_queue.push(message);
-            } catch (std::out_of_range &e) {
-                if (store.data.find_user(contents.destination) != store.data.user_database.end()) {
-	           print("That user isn't online, so we will save the message");
-                   store.data.offline_msgs.push_back(contents); 
-                } else {
-	            print("That user doesn't exist.");
-                    return make_frame(message_t::ERR_NOSUCHUSER);
-                }
-            }
-        }
-        return make_frame(message_t::MSG_OK);
+    return rate;
+}
+
+// a listening unix domain socket at path. Exits if it can't.
+static std::shared_ptr<Netty::Socket> listen_unix(const std::string &path,
+                                                  int backlog) {
+    // clear out a socket file left over from last time, or bind() fails.
+    // Only if it really is a socket though, we don't want to delete
+    // someone's files because of a typo.
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
     }
-    if (msg == message_t::MSG_XFER) {
-        if (!session->authed) {
-            return make_frame(message_t::ERR_NOLOGIN);
-        }
+    try {
+        auto sock =
+            std::make_shared<Netty::Socket>(Netty::make_unix_addrinfo(path));
+        sock->bind();
+        sock->listen(backlog);
+        return sock;
+    } catch (std::exception &e) {
+        print("ERROR: couldn't listen on " + path + ": " + e.what());
+        exit(-1);
+    }
+}
 
-        auto contents = std::get<FilePacket>(pkt);
-        auto message = make_frame(msg, contents);
-        if (contents.destination == "") {
-            // broadcast-type message.
-	    if (contents.eof)
-	    	print(contents.username + " sent file " + contents.filename + " to everyone");
-            for (const auto& [name, ses] : username_sessions) {
-                if (name != session->username) {
-                    ses->send_queue.push(message);
-                }
-            }
-        } else {
-	    if (contents.eof)
-	    	print(contents.username + " sent file " + contents.filename + " to " + contents.destination);
+int main(int argc, char* argv[]) {
+
+    // which event loop to use. io_uring is opt-in since it needs a recent
+    // kernel, and we fall back to epoll if it isn't available.
+    std::string backend = "epoll";
+    // how many connections the kernel queues up for us while we're busy.
+    // When everyone reconnects after a restart, a small backlog means
+    // dropped SYNs and clients waiting out retransmit timeouts.
+    int backlog = SOMAXCONN;
+    // if set, the kernel holds on to new connections until they send
+    // something (or this many seconds pass), so we don't wake up for
+    // connections that aren't ready to talk yet.
+    int defer_accept = 0;
+    // socket tuning for every connection, see Netty::SocketProfile.
+    std::string profile_name = "interactive";
+    int busy_poll = 0;
+    // also listen on a unix domain socket here, for clients on the same
+    // machine.
+    std::string unix_path;
+    // frames at least this big are sent with MSG_ZEROCOPY (epoll only, the
+    // ring copies into its own buffers anyway). 0 turns it off.
+    std::size_t zerocopy = 65536;
+    // how many broadcasts are kept for people who haven't got them yet, and
+    // what happens to anyone who falls further behind than that.
+    std::size_t broadcast_log = 8192;
+    std::string lag = "disconnect";
+    // how much to log. info is what clients are doing, warn and error leave
+    // just the problems.
+    std::string log_level = "info";
+    // where to serve metrics from, for whoever can reach the socket file.
+    std::string admin_path;
+    // record every frame clients send here, for bin/replay.
+    std::string trace_path;
+    // how much each connection, and each user, can send per second.
+    Rate session_limit, user_limit;
+    const struct option long_options[] = {
+        {"backend", required_argument, nullptr, 'b'},
+        {"backlog", required_argument, nullptr, 'l'},
+        {"defer-accept", required_argument, nullptr, 'd'},
+        {"profile", required_argument, nullptr, 'p'},
+        {"busy-poll", required_argument, nullptr, 'u'},
+        {"unix", required_argument, nullptr, 'x'},
+        {"zerocopy", required_argument, nullptr, 'z'},
+        {"broadcast-log", required_argument, nullptr, 'g'},
+        {"lag", required_argument, nullptr, 'L'},
+        {"log-level", required_argument, nullptr, 'v'},
+        {"admin", required_argument, nullptr, 'a'},
+        {"trace", required_argument, nullptr, 'T'},
+        {"session-limit", required_argument, nullptr, 's'},
+        {"user-limit", required_argument, nullptr, 'U'},
+        {nullptr, 0, nullptr, 0},
+    };
+    const std::string usage =
+        "ERROR: usage: ./server <port> [--backend=epoll|uring] "
+        "[--backlog=N] [--defer-accept=SECONDS] "
+        "[--profile=interactive|bulk|default] [--busy-poll=USEC] "
+        "[--unix=PATH] [--zerocopy=BYTES] [--broadcast-log=N] "
+        "[--lag=disconnect|skip] [--log-level=debug|info|warn|error|off] "
+        "[--admin=PATH] [--trace=PATH] [--session-limit=MSGS[,BYTES]] "
+        "[--user-limit=MSGS[,BYTES]]";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:l:d:p:u:x:z:g:L:v:a:T:s:U:", long_options,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 'b':
+            backend = optarg;
+            break;
+        case 'l':
+            backlog = std::atoi(optarg);
+            break;
+        case 'd':
+            defer_accept = std::atoi(optarg);
+            break;
+        case 'p':
+            profile_name = optarg;
+            break;
+        case 'u':
+            busy_poll = std::atoi(optarg);
+            break;
+        case 'x':
+            unix_path = optarg;
+            break;
+        case 'z':
+            zerocopy = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'g':
+            broadcast_log = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'L':
+            lag = optarg;
+            break;
+        case 'v':
+            log_level = optarg;
+            break;
+        case 'a':
+            admin_path = optarg;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 's':
+        case 'U':
             try {
-                username_sessions.at(contents.destination)
-                    ->send_queue.push(message);
-            } catch (std::out_of_range &e) {
-	    	// lmao i guess
+                (opt == 's' ? session_limit : user_limit) = parse_rate(optarg);
+            } catch (std::invalid_argument &e) {
+                print(usage);
+                exit(-1);
             }
+            break;
+        default:
+            print(usage);
+            exit(-1);
         }
-
-    }
-    if (msg == message_t::MSG_LOGOUT) {
-        // TODO: if we are already logged out, should this fail with NOLOGIN?
-        session->authed = false;
-        if (session->username != "") {
-            print(session->username + " logged out");
-        }
-        username_sessions.erase(session->username);
-        session->username = "";
-        return make_frame(message_t::MSG_OK);
     }
 
-    if (msg == message_t::MSG_GETLIST) {
-        if (!session->authed) {
-            return make_frame(message_t::ERR_NOLOGIN);
-        }
-        print(session->username + " requested online user list.");
-        std::vector<std::string> users;
-        for (const auto& lp : username_sessions) {
-            users.push_back(lp.first);
-        }
-
-        ListPacket pack { .users = users };
-
-        return make_frame(message_t::MSG_LIST, pack);
-     
+    if ((lag != "disconnect" && lag != "skip") || broadcast_log == 0) {
+        print(usage);
+        exit(-1);
+    }
+    try {
+        polly::Logger::get().set_level(polly::Logger::named(log_level));
+    } catch (std::invalid_argument &e) {
+        print(usage);
+        exit(-1);
     }
 
-    return std::nullopt;
-}
-int main(int argc, char* argv[]) {
-
-    if (argc != 2) {
+    if (argc - optind != 1) {
         print("ERROR: incorrect number of arguments. usage: ./server <port>");
         exit(-1);
     }
 
-    std::string port = argv[1];
+    std::string port = argv[optind];
     if (port == "reset") {
         print("resetting internal database");
-        store.reset();
+        DataStore<ServerData>("serverdata.bin").reset();
 
         exit(0);
     }
@@ -211,122 +197,143 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
-    store.load();
-
     auto listen_socket = std::make_shared<Netty::Socket>(move(gotten));
-    auto epoll = polly::Epoll();
 
-    listen_socket->setnonblocking(true);
+    std::unique_ptr<polly::EventLoop> loop;
+    polly::Ring *ring = nullptr;
+    if (backend == "uring") {
+        try {
+            auto r = std::make_unique<polly::Ring>();
+            ring = r.get();
+            loop = std::move(r);
+            print("Using io_uring backend");
+        } catch (std::system_error& e) {
+            print("io_uring unavailable, falling back to epoll: " +
+                  std::string(e.what()));
+        }
+    } else if (backend != "epoll") {
+        print("ERROR: unknown backend " + backend);
+        exit(-1);
+    }
+    if (!loop) {
+        loop = std::make_unique<polly::Epoll>();
+    }
+    auto &epoll = *loop;
+
+    Netty::SocketProfile profile;
+    try {
+        profile = Netty::SocketProfile::named(profile_name);
+    } catch (std::invalid_argument &e) {
+        print(std::string("ERROR: ") + e.what());
+        exit(-1);
+    }
+    if (busy_poll > 0) {
+        profile.busy_poll = std::chrono::microseconds(busy_poll);
+    }
 
+    // has to happen before bind() to do anything.
+    listen_socket->set(Netty::opt::reuseaddr, true);
     listen_socket->bind();
-    listen_socket->listen();
+    if (defer_accept > 0) {
+        listen_socket->set(Netty::opt::defer_accept, defer_accept);
+    }
+    // accepted connections inherit these from the listener, so this covers
+    // all of them without any syscalls per connection.
+    try {
+        listen_socket->apply(profile);
+    } catch (std::system_error &e) {
+        print(std::string("ERROR: couldn't apply socket profile: ") +
+              e.what());
+        exit(-1);
+    }
+    listen_socket->listen(backlog);
 
-    // the client handler function. It will manage the lifetime of the
-    // connection and receive messages from the socket.
-    auto client_handler = [&](Netty::Socket &s, int events) {
-        auto session = socket_sessions[s.get_fd()];
-        if (events & EPOLLRDHUP) {
-            print("Closing connection " + std::to_string(s.get_fd()) + (session->authed ? " (" + session->username + ")" : ""));
-            if (session->authed) {
-                username_sessions.erase(session->username);
-            }
-            socket_sessions.erase(s.get_fd()); // cleanup the session.
-            epoll.delete_item(s);
-            return;
-        }
-        if (events & EPOLLIN) {
-            auto new_data = s.recv(1024);
-            recv_state &r_state = session->r_state;
-            session->r_state.data.insert(session->r_state.data.end(),
-                                         new_data.begin(), new_data.end());
-            // 	std::cout << "got " << new_data.size() << " bytes, total " <<
-            // r_state.data.size() << "\n"; std::cout << "awaiting " <<
-            // r_state.desired_bytes << " for a " << (r_state.await_header ?
-            // "header" : "frame") << "\n";
-            while (r_state.data.size() >= r_state.desired_bytes) {
-                if (r_state.await_header) {
-                    auto header = surreal::DataBuf(r_state.data.begin(),
-                                                   r_state.data.begin() +
-                                                       r_state.desired_bytes);
-                    r_state.data.erase(r_state.data.begin(),
-                                       r_state.data.begin() +
-                                           r_state.desired_bytes);
-                    unsigned char dummy;
-                    header.deserialize(dummy);
-                    if (dummy != 0xFE) {
-                        throw std::runtime_error("frame bad");
-                    }
+    std::vector<std::shared_ptr<Netty::Socket>> listeners = {listen_socket};
+    if (!unix_path.empty()) {
+        listeners.push_back(listen_unix(unix_path, backlog));
+    }
 
-                    std::size_t payload_size;
-                    header.deserialize(payload_size);
-                    // std::cout << "got enough data for a header, packet size:
-                    // " << payload_size << std::endl;
-                    r_state.await_header = false;
-                    r_state.desired_bytes = payload_size;
-                } else {
-                    // we have enough bytes for the intended frame.
-                    // std::cout << "got enough data for a frame\n";
-                    // copy the vector
-                    auto frame_buf = std::vector<uint8_t>(
-                        r_state.data.begin(),
-                        r_state.data.begin() + r_state.desired_bytes);
-                    r_state.data.erase(r_state.data.begin(),
-                                       r_state.data.begin() +
-                                           r_state.desired_bytes);
-                    auto message = get_frame(frame_buf);
-                    auto type = std::get<message_t>(message);
-                    auto payload = std::get<Packet_t>(message);
-                    auto response = clientHandler(type, payload, session);
-                    if (response.has_value()) {
-                        session->send_queue.push(response.value());
-                    }
+    // io_uring operations fail with EAGAIN instead of waiting on non-blocking
+    // sockets, so the listeners only go non-blocking for epoll.
+    if (!ring) {
+        for (auto &listener : listeners) {
+            listener->setnonblocking(true);
+        }
+    }
 
-                    // reset for the next header.
-                    r_state.await_header = true;
-                    r_state.desired_bytes = header_size;
-                }
-            }
+    // everything else happens in here, see chatserver.hpp.
+    std::unique_ptr<ChatServer> server;
+    try {
+        server = std::make_unique<ChatServer>(epoll);
+    } catch (std::exception &e) {
+        print(std::string("ERROR: couldn't load serverdata.bin: ") + e.what());
+        exit(-1);
+    }
+    server->set_zerocopy(zerocopy);
+    server->set_limits(session_limit, user_limit);
+    if (!trace_path.empty()) {
+        try {
+            server->set_trace(trace_path);
+        } catch (std::system_error &e) {
+            print("ERROR: couldn't record to " + trace_path + ": " + e.what());
+            exit(-1);
         }
-        if (events & EPOLLOUT) {
-	
-            if (session->send_queue.size() == 0) {
-                epoll.set_events(s, EPOLLIN | EPOLLRDHUP);
-                return;
+    }
+    server->set_broadcast(broadcast_log, lag == "skip" ? LagPolicy::skip
+                                                       : LagPolicy::disconnect);
+    for (auto &listener : listeners) {
+        server->listen(listener);
+    }
+    if (!admin_path.empty()) {
+        // scrapes are rare, so this one's readiness based on either backend
+        // and always non-blocking.
+        auto admin = listen_unix(admin_path, 16);
+        admin->setnonblocking(true);
+        server->serve_metrics(admin);
+    }
+
+    // splice() can't be told MSG_NOSIGNAL like send() can, so a recipient
+    // hanging up mid-file would kill us. We'd rather get the EPIPE.
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGINT/SIGTERM arrive as ordinary events, so we can block in wait()
+    // for as long as it takes and still shut down cleanly. SIGUSR1 dumps the
+    // event loop stats.
+    bool running = true;
+    auto signals = std::make_shared<polly::Signal>(
+        std::initializer_list<int>{SIGINT, SIGTERM, SIGUSR1});
+    signals->set_handler([&running, &epoll](polly::Signal &sig, int events) {
+        while (auto info = sig.read()) {
+            if (info->ssi_signo == SIGUSR1) {
+                print(epoll.stats().report());
+            } else {
+                running = false;
             }
-            s.send_delimited(session->send_queue.front());
-            session->send_queue.pop();
         }
-    };
-
-    listen_socket->set_handler([&epoll, &client_handler](Netty::Socket &s,
-                                                         int events) {
-        auto new_sock = std::make_shared<Netty::Socket>(s.accept());
-        socket_sessions[new_sock->get_fd()] = std::make_shared<ClientSession>();
-        new_sock->setnonblocking(true);
-        new_sock->set_handler(client_handler);
-        epoll.add_item(new_sock, EPOLLIN | EPOLLRDHUP);
     });
+    epoll.add_item(signals, EPOLLIN);
 
-    listen_socket->setsockopt(SO_REUSEADDR, 1);
-
-    epoll.add_item(listen_socket, EPOLLIN);
-
-    std::signal(SIGINT, sighandler);
     print("Server starting...");
-    while (1) {
+    int status = 0;
+    while (running) {
+        epoll.wait(-1);
         try {
-            epoll.wait(200);
-        } catch (std::system_error& e) {
-            if (quit.load()) {
-                break;
-            } else throw e;
+            server->flush();
+        } catch (std::system_error &e) {
+            // nobody's been told their change was saved, and they won't
+            // be. Hanging up on everyone is all that's left.
+            print(std::string("ERROR: couldn't write the journal: ") +
+                  e.what());
+            status = 1;
+            break;
         }
-	for (const auto& [fd, ses] : socket_sessions) {
-		if (ses->send_queue.size() > 0) {
-			epoll.set_events(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
-		}
-	}
     }
     print("Shutting down...");
-    return 0;
+    if (!unix_path.empty()) {
+        unlink(unix_path.c_str());
+    }
+    if (!admin_path.empty()) {
+        unlink(admin_path.c_str());
+    }
+    return status;
 }
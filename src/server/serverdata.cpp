@@ -0,0 +1,272 @@
+#include "serverdata.hpp"
+#include "journal.hpp"
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+template <typename T> static T decode(std::span<const std::uint8_t> bytes) {
+    T thing;
+    auto buf = surreal::DataBuf(bytes.begin(), bytes.end());
+    buf.deserialize(thing);
+    return thing;
+}
+
+std::optional<LoginPacket> ServerData::find_user(std::string_view user) const {
+    for (const Changes *c : {&changes, frozen.get()}) {
+        if (!c) {
+            continue;
+        }
+        long pos = c->user_index.find(user, c->user_database);
+        if (pos >= 0) {
+            return c->user_database[pos];
+        }
+    }
+    if (snapshot) {
+        if (auto entry = snapshot->find(user)) {
+            return decode<LoginPacket>(entry->account);
+        }
+    }
+    return std::nullopt;
+}
+
+// what's in user's mailbox once c is on top of msgs.
+static void add_mail(std::vector<MessagePacket> &msgs,
+                     const ServerData::Changes &c, std::string_view user) {
+    if (c.taken.contains(user)) {
+        msgs.clear();
+    }
+    auto box = c.mailboxes.find(user);
+    if (box != c.mailboxes.end()) {
+        msgs.insert(msgs.end(), box->second.begin(), box->second.end());
+    }
+}
+
+std::vector<MessagePacket> ServerData::mailbox(std::string_view user) const {
+    std::vector<MessagePacket> msgs;
+    bool gone = changes.taken.contains(user) ||
+                (frozen && frozen->taken.contains(user));
+    if (snapshot && !gone) {
+        auto entry = snapshot->find(user);
+        if (entry && !entry->mail.empty()) {
+            msgs = decode<std::vector<MessagePacket>>(entry->mail);
+        }
+    }
+    if (frozen) {
+        add_mail(msgs, *frozen, user);
+    }
+    add_mail(msgs, changes, user);
+    return msgs;
+}
+
+std::vector<std::string> ServerData::rooms(std::string_view user) const {
+    for (const Changes *c : {&changes, frozen.get()}) {
+        if (!c) {
+            continue;
+        }
+        auto changed = c->memberships.find(user);
+        if (changed != c->memberships.end()) {
+            return {changed->second.begin(), changed->second.end()};
+        }
+    }
+    if (snapshot) {
+        auto entry = snapshot->find(user);
+        if (entry && !entry->rooms.empty()) {
+            return decode<std::vector<std::string>>(entry->rooms);
+        }
+    }
+    return {};
+}
+
+void ServerData::apply(const Record &r) {
+    switch (r.kind) {
+    case Record::account:
+        changes.user_index.insert(r.login.username,
+                                  changes.user_database.size());
+        changes.user_database.push_back(r.login);
+        break;
+    case Record::mail:
+        changes.mailboxes[r.message.destination].push_back(r.message);
+        break;
+    case Record::taken:
+        changes.mailboxes.erase(r.message.destination);
+        changes.taken.insert(r.message.destination);
+        break;
+    case Record::join:
+    case Record::part: {
+        auto it = changes.memberships.find(r.message.username);
+        if (it == changes.memberships.end()) {
+            // start from what's underneath.
+            auto old = rooms(r.message.username);
+            it = changes.memberships
+                     .emplace(r.message.username,
+                              std::set<std::string>(old.begin(), old.end()))
+                     .first;
+        }
+        if (r.kind == Record::join) {
+            it->second.insert(r.message.destination);
+        } else {
+            it->second.erase(r.message.destination);
+        }
+        break;
+    }
+    }
+}
+
+ServerData::Frozen ServerData::freeze() {
+    frozen = std::make_shared<const Changes>(std::move(changes));
+    changes = Changes();
+    return {snapshot, frozen};
+}
+
+// serverdata.bin before snapshots: every account and then every offline
+// message, surreal encoded. That's a size and then the things for the lists,
+// and a size and then the bytes for strings, sizes being 64 bit big endian.
+// It's read by hand so that a broken file is an error instead of surreal
+// reading off the end of it.
+class LegacyReader {
+    std::span<const std::uint8_t> rest;
+
+    std::span<const std::uint8_t> take(std::uint64_t size) {
+        if (size > rest.size()) {
+            throw std::runtime_error("cut short");
+        }
+        auto bytes = rest.first(size);
+        rest = rest.subspan(size);
+        return bytes;
+    }
+
+  public:
+    LegacyReader(std::span<const std::uint8_t> bytes) : rest(bytes) {}
+
+    std::uint64_t size() {
+        std::uint64_t value;
+        std::memcpy(&value, take(sizeof(value)).data(), sizeof(value));
+        return be64toh(value);
+    }
+    std::string string() {
+        auto bytes = take(size());
+        return {bytes.begin(), bytes.end()};
+    }
+    bool done() const { return rest.empty(); }
+};
+
+// if path is a serverdata.bin from before snapshots, write it out again as
+// one, so upgrading doesn't cost anyone their account or their mail. Only
+// the magic is read for one that's a snapshot already.
+static void upgrade(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        return;
+    }
+    std::uint8_t start[8];
+    ssize_t n = fd == -1 ? -1 : ::read(fd, start, sizeof(start));
+    if (n == -1) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "couldn't read " + path);
+    }
+    ::close(fd);
+    if (Snapshot::is_snapshot({start, static_cast<std::size_t>(n)})) {
+        return;
+    }
+
+    std::vector<std::uint8_t> bytes;
+    read_file(path, bytes);
+    auto c = std::make_shared<ServerData::Changes>();
+    try {
+        LegacyReader in(bytes);
+        for (auto count = in.size(); count > 0; count--) {
+            LoginPacket login;
+            login.username = in.string();
+            login.password = in.string();
+            if (c->user_index.find(login.username, c->user_database) < 0) {
+                c->user_index.insert(login.username, c->user_database.size());
+                c->user_database.push_back(login);
+            }
+        }
+        // mail was only ever kept for registered users, which is all
+        // make_snapshot() looks for.
+        for (auto count = in.size(); count > 0; count--) {
+            MessagePacket msg;
+            msg.username = in.string();
+            msg.destination = in.string();
+            msg.message = in.string();
+            c->mailboxes[msg.destination].push_back(msg);
+        }
+        if (!in.done()) {
+            throw std::runtime_error("too long");
+        }
+    } catch (std::runtime_error &e) {
+        throw std::runtime_error(path + " isn't a snapshot or old " +
+                                 "serverdata (" + e.what() + ")");
+    }
+    // generation 0, since there's no journal to go with it.
+    replace_file(path, ServerData::make_snapshot({nullptr, c}, 0));
+    print("Upgraded " + path + " to a snapshot: " +
+          std::to_string(c->user_database.size()) + " accounts");
+}
+
+std::uint64_t ServerData::open_snapshot(const std::string &path) {
+    upgrade(path);
+    snapshot = Snapshot::open(path);
+    frozen.reset();
+    return snapshot ? snapshot->generation() : 0;
+}
+
+std::vector<std::uint8_t> ServerData::make_snapshot(const Frozen &frozen,
+                                                    std::uint64_t generation) {
+    SnapshotWriter out;
+    const Changes &c = *frozen.changes;
+    // mail only ever goes to registered users, so every mailbox belongs to
+    // one of the accounts.
+    auto write_mail = [&](std::string_view user,
+                          std::span<const std::uint8_t> old) {
+        auto box = c.mailboxes.find(user);
+        bool keep_old = !c.taken.contains(user);
+        if (box == c.mailboxes.end()) {
+            // nothing new, so the old bytes can go straight across.
+            return keep_old ? std::vector<std::uint8_t>(old.begin(), old.end())
+                            : std::vector<std::uint8_t>{};
+        }
+        std::vector<MessagePacket> msgs;
+        if (keep_old && !old.empty()) {
+            msgs = decode<std::vector<MessagePacket>>(old);
+        }
+        msgs.insert(msgs.end(), box->second.begin(), box->second.end());
+        surreal::DataBuf buf;
+        buf.serialize(msgs);
+        return std::vector<std::uint8_t>(buf);
+    };
+    // same again for rooms, which only ever change as a whole.
+    auto write_rooms = [&](std::string_view user,
+                           std::span<const std::uint8_t> old) {
+        auto changed = c.memberships.find(user);
+        if (changed == c.memberships.end()) {
+            return std::vector<std::uint8_t>(old.begin(), old.end());
+        }
+        if (changed->second.empty()) {
+            return std::vector<std::uint8_t>{};
+        }
+        std::vector<std::string> names(changed->second.begin(),
+                                       changed->second.end());
+        surreal::DataBuf buf;
+        buf.serialize(names);
+        return std::vector<std::uint8_t>(buf);
+    };
+    if (frozen.snapshot) {
+        frozen.snapshot->for_each([&](const Snapshot::Entry &e) {
+            out.add(e.key, e.account, write_mail(e.key, e.mail),
+                    write_rooms(e.key, e.rooms));
+        });
+    }
+    for (auto &login : c.user_database) {
+        std::vector<std::uint8_t> account = surreal::DataBuf(login);
+        out.add(login.username, account, write_mail(login.username, {}),
+                write_rooms(login.username, {}));
+    }
+    return out.finish(generation);
+}
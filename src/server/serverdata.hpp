@@ -0,0 +1,85 @@
+// serverdata.hpp - the accounts, offline messages and rooms the server keeps
+// (c) Saji Champlin 2022
+#pragma once
+#include "libchat.hpp"
+#include "snapshot.hpp"
+#include "userindex.hpp"
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Everything starts out in the snapshot (see snapshot.hpp), which is mapped in
+// rather than read, so the server is up in milliseconds however many accounts
+// there are. An account or a mailbox in there is only decoded when someone
+// asks for it. Whatever changed since the snapshot was taken (i.e what got
+// replayed from the journal, or happened since we started) is kept on top of
+// it in memory until the next compaction writes it all into a new snapshot.
+//
+// While that's being written, the changes it's made from are frozen (see
+// freeze()) and new ones pile up on top of them, so reading goes: the live
+// changes, then the frozen ones, then the snapshot.
+struct ServerData {
+    // What's changed since the layer underneath.
+    struct Changes {
+        // accounts registered, and an index of them.
+        std::vector<LoginPacket> user_database;
+        UserIndex user_index;
+        // mail that came in, by recipient.
+        std::map<std::string, std::vector<MessagePacket>, std::less<>>
+            mailboxes;
+        // users who've emptied their mailbox. What's underneath for them is
+        // already gone.
+        std::set<std::string, std::less<>> taken;
+        // the rooms of everyone who's joined or left one, all of them (not
+        // just the changes), so these replace what's underneath.
+        std::map<std::string, std::set<std::string>, std::less<>> memberships;
+    };
+
+    std::shared_ptr<const Snapshot> snapshot; // nullptr if there wasn't one.
+    // being written into the next snapshot, nullptr the rest of the time.
+    std::shared_ptr<const Changes> frozen;
+    Changes changes;
+
+    // the account with this username, if there is one.
+    std::optional<LoginPacket> find_user(std::string_view user) const;
+
+    // everything that's waiting for user, oldest first.
+    std::vector<MessagePacket> mailbox(std::string_view user) const;
+
+    // the rooms user is in, in order.
+    std::vector<std::string> rooms(std::string_view user) const;
+
+    // One change to all of the above, as it goes in the journal. Make them
+    // with DataStore::apply(), never by hand, or they won't be saved.
+    struct Record {
+        enum kind_t : std::uint8_t {
+            account, // login was registered.
+            mail,    // message is waiting for message.destination.
+            taken,   // message.destination emptied their mailbox.
+            join,    // message.username joined room message.destination.
+            part,    // and left it.
+        };
+        kind_t kind;
+        LoginPacket login;
+        MessagePacket message;
+        MAKE_SERIAL(kind, login, message)
+    };
+    void apply(const Record &r);
+
+    // for DataStore. A Frozen is the snapshot and the changes on top of it,
+    // neither of which change again, so a thread can read them while we
+    // carry on. Only one thing can be frozen at a time: open_snapshot() (with
+    // the snapshot made from it) is what lets go of it.
+    struct Frozen {
+        std::shared_ptr<const Snapshot> snapshot;
+        std::shared_ptr<const Changes> changes;
+    };
+    Frozen freeze();
+    static std::vector<std::uint8_t> make_snapshot(const Frozen &frozen,
+                                                   std::uint64_t generation);
+    std::uint64_t open_snapshot(const std::string &path);
+};
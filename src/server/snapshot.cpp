@@ -0,0 +1,200 @@
+#include "snapshot.hpp"
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+// the last byte is the version. Version 1 didn't have rooms.
+static constexpr char magic[8] = {'G', 'C', 'S', 'N', 'A', 'P', 0, 2};
+
+struct Snapshot::Mapping {
+    const std::uint8_t *data = nullptr;
+    std::size_t size = 0;
+    ~Mapping() {
+        if (data) {
+            ::munmap(const_cast<std::uint8_t *>(data), size);
+        }
+    }
+};
+
+std::uint64_t Snapshot::hash(std::string_view key) {
+    // FNV-1a. It has to be the same in every build, since it's on disk.
+    std::uint64_t h = 0xcbf29ce484222325;
+    for (unsigned char c : key) {
+        h = (h ^ c) * 0x100000001b3;
+    }
+    return h;
+}
+
+std::span<const std::uint8_t> Snapshot::bytes(std::uint64_t offset,
+                                              std::uint64_t size) const {
+    if (offset > map->size || size > map->size - offset) {
+        throw std::runtime_error("snapshot is corrupt (offset out of range)");
+    }
+    return {map->data + offset, size};
+}
+
+std::uint64_t Snapshot::u64(std::uint64_t offset) const {
+    std::uint64_t value;
+    std::memcpy(&value, bytes(offset, sizeof(value)).data(), sizeof(value));
+    return be64toh(value);
+}
+
+bool Snapshot::is_snapshot(std::span<const std::uint8_t> start) {
+    return start.size() >= sizeof(magic) &&
+           std::memcmp(start.data(), magic, sizeof(magic) - 1) == 0 &&
+           start[7] >= 1 && start[7] <= magic[7];
+}
+
+std::shared_ptr<const Snapshot> Snapshot::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fd == -1 || ::fstat(fd, &st) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "couldn't open " + path);
+    }
+    auto snap = std::make_shared<Snapshot>();
+    snap->map = std::make_shared<Mapping>();
+    if (st.st_size > 0) {
+        void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(),
+                                    "mmap() failed");
+        }
+        snap->map->data = static_cast<const std::uint8_t *>(p);
+        snap->map->size = st.st_size;
+    }
+    // the mapping keeps the file around by itself.
+    ::close(fd);
+
+    if (snap->map->size < header_size ||
+        !is_snapshot({snap->map->data, snap->map->size})) {
+        throw std::runtime_error(path + " isn't a snapshot");
+    }
+    snap->version = snap->map->data[7];
+    snap->gen = snap->u64(8);
+    snap->count = snap->u64(16);
+    snap->slots = snap->u64(24);
+    if (snap->slots & (snap->slots - 1)) {
+        throw std::runtime_error("snapshot is corrupt (bad slot count)");
+    }
+    snap->bytes(header_size, snap->slots * 16); // the table has to fit.
+    return snap;
+}
+
+Snapshot::Entry Snapshot::entry(std::uint64_t at) const {
+    Entry e;
+    auto k = bytes(at + 8, u64(at));
+    e.key = {reinterpret_cast<const char *>(k.data()), k.size()};
+    at += 8 + k.size();
+    e.account = bytes(at + 8, u64(at));
+    at += 8 + e.account.size();
+    e.mail = bytes(at + 8, u64(at));
+    at += 8 + e.mail.size();
+    if (version >= 2) {
+        e.rooms = bytes(at + 8, u64(at));
+        at += 8 + e.rooms.size();
+    }
+    e.next = at;
+    return e;
+}
+
+std::optional<Snapshot::Entry> Snapshot::find(std::string_view key) const {
+    if (slots == 0) {
+        return std::nullopt;
+    }
+    std::uint64_t h = hash(key);
+    std::uint64_t mask = slots - 1;
+    for (std::uint64_t i = h & mask, probes = 0; probes < slots;
+         i = (i + 1) & mask, probes++) {
+        std::uint64_t slot = header_size + i * 16;
+        std::uint64_t offset = u64(slot + 8);
+        if (offset == 0) {
+            return std::nullopt;
+        }
+        if (u64(slot) != h) {
+            continue;
+        }
+        auto k = bytes(offset + 8, u64(offset));
+        if (std::string_view(reinterpret_cast<const char *>(k.data()),
+                             k.size()) != key) {
+            continue;
+        }
+        return entry(offset);
+    }
+    return std::nullopt;
+}
+
+void Snapshot::for_each(const std::function<void(const Entry &)> &fn) const {
+    std::uint64_t at = header_size + slots * 16;
+    for (std::uint64_t n = 0; n < count; n++) {
+        auto e = entry(at);
+        at = e.next;
+        fn(e);
+    }
+}
+
+static void put_u64(std::vector<std::uint8_t> &out, std::uint64_t value) {
+    value = htobe64(value);
+    auto *p = reinterpret_cast<const std::uint8_t *>(&value);
+    out.insert(out.end(), p, p + sizeof(value));
+}
+
+void SnapshotWriter::add(std::string_view key,
+                         std::span<const std::uint8_t> account,
+                         std::span<const std::uint8_t> mail,
+                         std::span<const std::uint8_t> rooms) {
+    index.push_back({Snapshot::hash(key), entries.size()});
+    put_u64(entries, key.size());
+    entries.insert(entries.end(), key.begin(), key.end());
+    put_u64(entries, account.size());
+    entries.insert(entries.end(), account.begin(), account.end());
+    put_u64(entries, mail.size());
+    entries.insert(entries.end(), mail.begin(), mail.end());
+    put_u64(entries, rooms.size());
+    entries.insert(entries.end(), rooms.begin(), rooms.end());
+}
+
+std::vector<std::uint8_t> SnapshotWriter::finish(std::uint64_t generation) {
+    // at most half full, like UserIndex.
+    std::uint64_t slots = 0;
+    if (!index.empty()) {
+        slots = 16;
+        while (slots < index.size() * 2) {
+            slots *= 2;
+        }
+    }
+    std::uint64_t base = Snapshot::header_size + slots * 16;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> table(slots);
+    for (auto &p : index) {
+        std::uint64_t i = p.hash & (slots - 1);
+        while (table[i].second != 0) {
+            i = (i + 1) & (slots - 1);
+        }
+        table[i] = {p.hash, base + p.offset};
+    }
+
+    std::vector<std::uint8_t> out;
+    out.reserve(base + entries.size());
+    out.insert(out.end(), magic, magic + sizeof(magic));
+    put_u64(out, generation);
+    put_u64(out, index.size());
+    put_u64(out, slots);
+    for (auto &[hash, offset] : table) {
+        put_u64(out, hash);
+        put_u64(out, offset);
+    }
+    out.insert(out.end(), entries.begin(), entries.end());
+    return out;
+}
@@ -0,0 +1,87 @@
+// snapshot.hpp - memory-mapped, indexed snapshots for DataStore
+// (c) Saji Champlin 2022
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A snapshot file is a hash table of keys (usernames) up front, followed by an
+// entry for each key holding three blobs: what they are (the account), what's
+// waiting for them (their mail) and the rooms they're in. Opening one is an
+// mmap() and a look at the header, however big it is. Looking something up
+// hashes the key, probes the table and hands back views straight into the
+// mapping, so nothing gets decoded until someone actually asks for it.
+//
+//     header:  magic, generation, entry count, slot count  (8 bytes each)
+//     slots:   slot count x {hash, entry offset}           (offset 0 = empty)
+//     entries: {key size, key, account size, account, mail size, mail,
+//               rooms size, rooms}...
+//
+// Numbers are 64 bit big endian, like everywhere else. The last byte of the
+// magic is the version, and version 1 snapshots (no rooms) still open.
+class Snapshot {
+    struct Mapping;
+    std::shared_ptr<Mapping> map;
+    std::uint8_t version = 0;
+    std::uint64_t gen = 0;
+    std::uint64_t count = 0;
+    std::uint64_t slots = 0;
+
+    // the number at offset, checking it's actually inside the file.
+    std::uint64_t u64(std::uint64_t offset) const;
+    std::span<const std::uint8_t> bytes(std::uint64_t offset,
+                                        std::uint64_t size) const;
+
+  public:
+    struct Entry {
+        std::string_view key;
+        std::span<const std::uint8_t> account;
+        std::span<const std::uint8_t> mail;
+        std::span<const std::uint8_t> rooms;
+        std::uint64_t next; // offset of the entry after this one.
+    };
+
+    static constexpr std::uint64_t header_size = 32;
+
+  private:
+    // the entry starting at offset.
+    Entry entry(std::uint64_t offset) const;
+
+  public:
+    // map the snapshot at path. Returns nullptr if there isn't one. A file
+    // that isn't a snapshot is a std::runtime_error, other errors are
+    // std::system_error.
+    static std::shared_ptr<const Snapshot> open(const std::string &path);
+    // whether a file starting with these bytes is a snapshot we can open.
+    static bool is_snapshot(std::span<const std::uint8_t> start);
+
+    std::uint64_t generation() const { return gen; }
+    std::uint64_t size() const { return count; }
+
+    std::optional<Entry> find(std::string_view key) const;
+    // every entry, in the order they're in the file.
+    void for_each(const std::function<void(const Entry &)> &fn) const;
+
+    static std::uint64_t hash(std::string_view key);
+};
+
+// builds a snapshot file in memory. add() everything, then finish().
+class SnapshotWriter {
+    struct Pending {
+        std::uint64_t hash;
+        std::uint64_t offset; // into entries.
+    };
+    std::vector<Pending> index;
+    std::vector<std::uint8_t> entries;
+
+  public:
+    void add(std::string_view key, std::span<const std::uint8_t> account,
+             std::span<const std::uint8_t> mail,
+             std::span<const std::uint8_t> rooms);
+    std::vector<std::uint8_t> finish(std::uint64_t generation);
+};
@@ -0,0 +1,132 @@
+#include "trace.hpp"
+#include "journal.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+namespace trace {
+
+Writer::Writer(const std::string &path) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "open() failed");
+    }
+    buf.reserve(chunk + 4096);
+    buf.insert(buf.end(), magic, magic + sizeof(magic));
+}
+
+Writer::~Writer() {
+    try {
+        flush();
+    } catch (std::system_error &e) {
+        // nowhere to say so from a destructor. It's only a trace.
+    }
+    ::close(fd);
+}
+
+void Writer::put(std::uint64_t n) {
+    while (n >= 0x80) {
+        buf.push_back(std::uint8_t(n) | 0x80);
+        n >>= 7;
+    }
+    buf.push_back(std::uint8_t(n));
+}
+
+void Writer::start(kind k, std::uint64_t now_ns, std::uint64_t conn) {
+    buf.push_back(std::uint8_t(k));
+    // the first one's delta is 0, times are relative to it.
+    put(last_ns == 0 || now_ns < last_ns ? 0 : now_ns - last_ns);
+    last_ns = now_ns;
+    put(conn);
+}
+
+void Writer::frame(std::uint64_t now_ns, std::uint64_t conn,
+                   std::span<const std::uint8_t> bytes) {
+    start(kind::frame, now_ns, conn);
+    put(bytes.size());
+    buf.insert(buf.end(), bytes.begin(), bytes.end());
+    if (buf.size() >= chunk) {
+        flush();
+    }
+}
+
+void Writer::closed(std::uint64_t now_ns, std::uint64_t conn) {
+    start(kind::closed, now_ns, conn);
+    if (buf.size() >= chunk) {
+        flush();
+    }
+}
+
+void Writer::flush() {
+    std::size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            // throw away what's been written, keep the rest for next time.
+            int err = errno;
+            buf.erase(buf.begin(), buf.begin() + done);
+            throw std::system_error(err, std::generic_category(),
+                                    "write() failed");
+        }
+        done += n;
+    }
+    buf.clear();
+}
+
+Reader::Reader(const std::string &path) {
+    if (!read_file(path, data)) {
+        throw std::system_error(ENOENT, std::generic_category(),
+                                "couldn't open " + path);
+    }
+    if (data.size() < sizeof(magic) ||
+        std::memcmp(data.data(), magic, sizeof(magic)) != 0) {
+        throw std::runtime_error(path + " isn't a trace");
+    }
+}
+
+std::optional<std::uint64_t> Reader::get() {
+    std::uint64_t n = 0;
+    for (unsigned shift = 0; at < data.size() && shift < 64; shift += 7) {
+        std::uint8_t b = data[at++];
+        n |= std::uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return n;
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<Record> Reader::next() {
+    if (at >= data.size()) {
+        return std::nullopt;
+    }
+    Record r;
+    r.k = kind(data[at++]);
+    auto delta = get();
+    auto conn = get();
+    if (!delta || !conn) {
+        return std::nullopt;
+    }
+    time += first ? 0 : *delta;
+    first = false;
+    r.time_ns = time;
+    r.conn = *conn;
+    if (r.k == kind::frame) {
+        auto len = get();
+        if (!len || *len > data.size() - at) {
+            return std::nullopt;
+        }
+        r.bytes = std::span<const std::uint8_t>(data.data() + at, *len);
+        at += *len;
+    } else if (r.k != kind::closed) {
+        return std::nullopt; // from something newer than us.
+    }
+    return r;
+}
+
+} // namespace trace
@@ -0,0 +1,84 @@
+// trace.hpp - recording what clients send, to play it back later
+// (c) Saji Champlin 2022
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// A trace is every frame the server got, from whom and when, so real traffic
+// can be played back against another build (see src/replay). After an 8 byte
+// magic, each record is
+//
+//     kind (1 byte), time since the last record (ns), connection,
+//     and for frames the frame's length and then the frame itself
+//
+// with the numbers as LEB128 varints, so a small frame costs a handful of
+// bytes on top of itself. Connections are just numbers that are different
+// for each one; the server uses its session handles.
+//
+// The bodies of streamed files aren't kept: they can be huge, and on epoll
+// they never leave the kernel anyway. The STREAM frame says how big the body
+// was, which is enough to send one the same size.
+namespace trace {
+
+enum class kind : std::uint8_t { frame = 0, closed = 1 };
+
+constexpr char magic[8] = {'g', 'c', 'h', 'a', 't', 't', 'r', '1'};
+
+// Records are buffered and written out in big chunks, so a busy server
+// makes a write() every few hundred frames rather than one each. Whatever's
+// left is written when it's destroyed. A crash loses the last chunk.
+class Writer {
+    int fd = -1;
+    std::vector<std::uint8_t> buf;
+    std::uint64_t last_ns = 0;
+
+    void put(std::uint64_t n);
+    void start(kind k, std::uint64_t now_ns, std::uint64_t conn);
+
+  public:
+    static constexpr std::size_t chunk = 256 * 1024;
+
+    // creates (or truncates) path. Throws std::system_error if it can't.
+    explicit Writer(const std::string &path);
+    Writer(const Writer &other) = delete;
+    ~Writer();
+
+    // now_ns can be from any clock, as long as it's the same one every time.
+    void frame(std::uint64_t now_ns, std::uint64_t conn,
+               std::span<const std::uint8_t> bytes);
+    void closed(std::uint64_t now_ns, std::uint64_t conn);
+
+    // write out everything buffered. Errors are thrown as std::system_error.
+    void flush();
+};
+
+struct Record {
+    kind k;
+    std::uint64_t time_ns; // since the first record.
+    std::uint64_t conn;
+    std::span<const std::uint8_t> bytes; // the frame, into the Reader.
+};
+
+// The whole trace, read in at once.
+class Reader {
+    std::vector<std::uint8_t> data;
+    std::size_t at = sizeof(magic);
+    std::uint64_t time = 0;
+    bool first = true;
+
+    std::optional<std::uint64_t> get();
+
+  public:
+    // Throws std::system_error if path can't be read, and
+    // std::runtime_error if it isn't a trace.
+    explicit Reader(const std::string &path);
+
+    // the next record, or nothing at the end. A record that's cut off (the
+    // server crashed while writing it) counts as the end.
+    std::optional<Record> next();
+};
+
+} // namespace trace
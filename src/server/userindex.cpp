@@ -0,0 +1,56 @@
+#include "userindex.hpp"
+#include <functional>
+
+std::size_t UserIndex::hash(std::string_view name) {
+    return std::hash<std::string_view>{}(name);
+}
+
+void UserIndex::place(Slot slot) {
+    std::size_t mask = slots.size() - 1;
+    std::size_t i = slot.hash & mask;
+    while (slots[i].pos != empty) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = slot;
+}
+
+void UserIndex::grow() {
+    auto old = std::move(slots);
+    slots.assign(old.empty() ? 16 : old.size() * 2, Slot{});
+    for (auto &slot : old) {
+        if (slot.pos != empty) {
+            place(slot);
+        }
+    }
+}
+
+void UserIndex::insert(std::string_view name, std::uint32_t pos) {
+    if ((used + 1) * 2 > slots.size()) {
+        grow();
+    }
+    place({hash(name), pos});
+    used++;
+}
+
+long UserIndex::find(std::string_view name,
+                     const std::vector<LoginPacket> &users) const {
+    if (slots.empty()) {
+        return -1;
+    }
+    std::size_t h = hash(name);
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t i = h & mask; slots[i].pos != empty; i = (i + 1) & mask) {
+        if (slots[i].hash == h && users[slots[i].pos].username == name) {
+            return slots[i].pos;
+        }
+    }
+    return -1;
+}
+
+void UserIndex::rebuild(const std::vector<LoginPacket> &users) {
+    slots.clear();
+    used = 0;
+    for (std::uint32_t i = 0; i < users.size(); i++) {
+        insert(users[i].username, i);
+    }
+}
@@ -0,0 +1,46 @@
+// userindex.hpp - hash index from usernames to accounts
+// (c) Saji Champlin 2022
+#pragma once
+#include "libchat.hpp"
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Finding a user used to be a find_if over every account (copying each one
+// into the lambda on the way), on every register, login and offline DM. This
+// is an open addressing hash table from usernames to their position in the
+// account list instead, so those are all O(1).
+//
+// It only indexes the list, it doesn't own it. Lookups take the list so they
+// can compare the actual usernames, and nothing here gets saved: after the
+// list is loaded from disk the index is rebuilt from it, so the two can't
+// disagree.
+class UserIndex {
+    static constexpr std::uint32_t empty = UINT32_MAX;
+    struct Slot {
+        std::size_t hash; // kept so growing doesn't have to rehash strings.
+        std::uint32_t pos = empty;
+    };
+    // linear probing. The size is always a power of two, and it's kept at
+    // most half full so probe sequences stay short.
+    std::vector<Slot> slots;
+    std::size_t used = 0;
+
+    static std::size_t hash(std::string_view name);
+    void place(Slot slot);
+    void grow();
+
+  public:
+    // index users[pos] under name. Usernames have to be unique.
+    void insert(std::string_view name, std::uint32_t pos);
+
+    // where name is in users, or -1 if nobody has it. Takes a string_view,
+    // so looking up a name out of a packet doesn't copy it.
+    long find(std::string_view name,
+              const std::vector<LoginPacket> &users) const;
+
+    // start over from users, e.g after loading them.
+    void rebuild(const std::vector<LoginPacket> &users);
+
+    std::size_t size() const { return used; }
+};